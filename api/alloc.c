@@ -0,0 +1,305 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Copyright 2017-2020 The University of Manchester
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "../dbm.h"
+
+#ifdef PLUGINS_NEW
+
+/*
+  Plugin memory is served from per-thread arenas. Requests up to
+  ARENA_MAX_SMALL bytes (header included) are rounded up to a power of two
+  size class and carved out of ARENA_CHUNK_SZ chunks; freed objects go back
+  on the free list of their class. Larger requests are mapped directly.
+  Allocations made without a thread context (e.g. in plugin constructors),
+  or with the context of a thread other than the calling one, come from a
+  single, lock protected global arena. An arena is only modified directly
+  by the thread which owns it, both in mambo_alloc() and mambo_free().
+
+  Objects freed by a thread other than their owner are pushed on the
+  owner's remote_free list and reclaimed the next time the owner allocates
+  from the same arena.
+
+  Objects can be shared with other threads and outlive the thread which
+  allocated them, so arenas are never unmapped. When a thread exits, after
+  the POST_THREAD callbacks have run, its arena is retired with all its
+  objects and handed over to the next thread to be created.
+*/
+
+#define ARENA_MIN_SHIFT  5
+#define ARENA_MAX_SMALL  (1 << (ARENA_MIN_SHIFT + ARENA_SIZE_CLASSES - 1))
+#define ARENA_CHUNK_SZ   (64 * 1024)
+#define ARENA_LARGE      (0xFFFFFFFF)
+
+struct arena_obj_hdr_s {
+  mambo_arena *arena;
+  uint32_t size_class;
+} __attribute__((aligned(16)));
+
+struct arena_chunk_s {
+  arena_chunk *next;
+} __attribute__((aligned(16)));
+
+struct arena_large_s {
+  arena_large *prev;
+  arena_large *next;
+  size_t map_size;
+  arena_obj_hdr hdr;
+};
+
+static mambo_arena global_arena;
+static pthread_mutex_t global_arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+static mambo_arena *retired_arenas;
+static pthread_mutex_t retired_arenas_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static inline size_t arena_class_size(uint32_t size_class) {
+  return (size_t)1 << (size_class + ARENA_MIN_SHIFT);
+}
+
+static inline arena_obj_hdr **arena_obj_next(arena_obj_hdr *hdr) {
+  return (arena_obj_hdr **)(hdr + 1);
+}
+
+static uint32_t arena_size_class(size_t size) {
+  if (size > ARENA_MAX_SMALL - sizeof(arena_obj_hdr)) return ARENA_LARGE;
+
+  uint32_t size_class = 0;
+  while (arena_class_size(size_class) < size + sizeof(arena_obj_hdr)) {
+    size_class++;
+  }
+  return size_class;
+}
+
+static void arena_account_alloc(mambo_arena *arena, size_t size) {
+  arena->stats.alloc_count++;
+  arena->stats.bytes_in_use += size;
+  if (arena->stats.bytes_in_use > arena->stats.peak_bytes_in_use) {
+    arena->stats.peak_bytes_in_use = arena->stats.bytes_in_use;
+  }
+}
+
+static int arena_refill(mambo_arena *arena) {
+  /* Chunks are first touched by the thread which owns the arena, so with
+     the default memory policy their pages are placed on its local node */
+  arena_chunk *chunk = mmap(NULL, ARENA_CHUNK_SZ, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (chunk == MAP_FAILED) return -1;
+
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+  arena->bump = (uint8_t *)(chunk + 1);
+  arena->bump_end = (uint8_t *)chunk + ARENA_CHUNK_SZ;
+  arena->stats.bytes_mapped += ARENA_CHUNK_SZ;
+
+  return 0;
+}
+
+static void *arena_alloc_large(mambo_arena *arena, size_t size) {
+  size_t map_size = ROUND_UP(size + sizeof(arena_large), page_size);
+  arena_large *large = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (large == MAP_FAILED) return NULL;
+
+  large->prev = NULL;
+  large->next = arena->large;
+  if (arena->large != NULL) {
+    arena->large->prev = large;
+  }
+  arena->large = large;
+  large->map_size = map_size;
+  large->hdr.arena = arena;
+  large->hdr.size_class = ARENA_LARGE;
+
+  arena->stats.bytes_mapped += map_size;
+  arena_account_alloc(arena, map_size);
+
+  return &large->hdr + 1;
+}
+
+static void arena_release(mambo_arena *arena, arena_obj_hdr *hdr) {
+  assert(hdr->arena == arena);
+
+  if (hdr->size_class == ARENA_LARGE) {
+    arena_large *large = (arena_large *)((uint8_t *)hdr - offsetof(arena_large, hdr));
+    if (large->prev != NULL) {
+      large->prev->next = large->next;
+    } else {
+      arena->large = large->next;
+    }
+    if (large->next != NULL) {
+      large->next->prev = large->prev;
+    }
+    arena->stats.bytes_in_use -= large->map_size;
+    arena->stats.bytes_mapped -= large->map_size;
+    if (munmap(large, large->map_size) != 0) {
+      fprintf(stderr, "MAMBO: error unmapping a large plugin allocation\n");
+      while(1);
+    }
+  } else {
+    assert(hdr->size_class < ARENA_SIZE_CLASSES);
+    *arena_obj_next(hdr) = arena->free_lists[hdr->size_class];
+    arena->free_lists[hdr->size_class] = hdr;
+    arena->stats.bytes_in_use -= arena_class_size(hdr->size_class);
+  }
+  arena->stats.free_count++;
+}
+
+static void arena_push_remote(mambo_arena *arena, arena_obj_hdr *hdr) {
+  arena_obj_hdr *head = arena->remote_free;
+  do {
+    *arena_obj_next(hdr) = head;
+  } while (!__atomic_compare_exchange_n(&arena->remote_free, &head, hdr, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void arena_drain_remote(mambo_arena *arena) {
+  arena_obj_hdr *hdr = __atomic_exchange_n(&arena->remote_free, NULL, __ATOMIC_ACQUIRE);
+  while (hdr != NULL) {
+    arena_obj_hdr *next = *arena_obj_next(hdr);
+    arena_release(arena, hdr);
+    hdr = next;
+  }
+}
+
+static void *arena_alloc(mambo_arena *arena, size_t size) {
+  uint32_t size_class = arena_size_class(size);
+  if (size_class == ARENA_LARGE) {
+    return arena_alloc_large(arena, size);
+  }
+  size_t class_size = arena_class_size(size_class);
+
+  if (arena->free_lists[size_class] == NULL && arena->remote_free != NULL) {
+    arena_drain_remote(arena);
+  }
+
+  arena_obj_hdr *hdr = arena->free_lists[size_class];
+  if (hdr != NULL) {
+    arena->free_lists[size_class] = *arena_obj_next(hdr);
+    // Fresh chunks are zeroed by the kernel, keep recycled objects consistent
+    memset(hdr + 1, 0, class_size - sizeof(arena_obj_hdr));
+  } else {
+    if (arena->bump == NULL || (arena->bump + class_size) > arena->bump_end) {
+      if (arena_refill(arena) != 0) return NULL;
+    }
+    hdr = (arena_obj_hdr *)arena->bump;
+    arena->bump += class_size;
+    hdr->arena = arena;
+    hdr->size_class = size_class;
+  }
+
+  arena_account_alloc(arena, class_size);
+
+  return hdr + 1;
+}
+
+static mambo_arena *arena_for_ctx(mambo_context *ctx) {
+  if (ctx->thread_data != NULL && ctx->thread_data == current_thread) {
+    return current_thread->arena;
+  }
+  return &global_arena;
+}
+
+/* Public API */
+void *mambo_alloc(mambo_context *ctx, size_t size) {
+  mambo_arena *arena = arena_for_ctx(ctx);
+  void *ptr;
+
+  if (arena == &global_arena) {
+    pthread_mutex_lock(&global_arena_mutex);
+    ptr = arena_alloc(arena, size);
+    pthread_mutex_unlock(&global_arena_mutex);
+  } else {
+    ptr = arena_alloc(arena, size);
+  }
+
+  return ptr;
+}
+
+void mambo_free(mambo_context *ctx, void *ptr) {
+  if (ptr == NULL) return;
+
+  arena_obj_hdr *hdr = ((arena_obj_hdr *)ptr) - 1;
+  mambo_arena *arena = hdr->arena;
+
+  if (arena == &global_arena) {
+    pthread_mutex_lock(&global_arena_mutex);
+    arena_release(arena, hdr);
+    pthread_mutex_unlock(&global_arena_mutex);
+  } else if (current_thread != NULL && arena == current_thread->arena) {
+    arena_release(arena, hdr);
+  } else {
+    arena_push_remote(arena, hdr);
+  }
+}
+
+int mambo_get_alloc_stats(mambo_context *ctx, mambo_alloc_stats *stats) {
+  mambo_arena *arena = (ctx->thread_data != NULL) ? ctx->thread_data->arena : &global_arena;
+
+  if (arena == &global_arena) {
+    pthread_mutex_lock(&global_arena_mutex);
+    *stats = arena->stats;
+    pthread_mutex_unlock(&global_arena_mutex);
+  } else {
+    if (current_thread == ctx->thread_data) {
+      arena_drain_remote(arena);
+    }
+    *stats = arena->stats;
+  }
+
+  return MAMBO_SUCCESS;
+}
+
+/* Internal */
+// Returns a retired arena if there is any, or a new one
+mambo_arena *mambo_arena_acquire(void) {
+  pthread_mutex_lock(&retired_arenas_mutex);
+  mambo_arena *arena = retired_arenas;
+  if (arena != NULL) {
+    retired_arenas = arena->next_retired;
+  }
+  pthread_mutex_unlock(&retired_arenas_mutex);
+
+  if (arena == NULL) {
+    arena = mmap(NULL, sizeof(*arena), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED) return NULL;
+  } else {
+    arena->next_retired = NULL;
+    arena_drain_remote(arena);
+  }
+
+  return arena;
+}
+
+void mambo_arena_retire(mambo_arena *arena) {
+  assert(arena != &global_arena);
+
+  pthread_mutex_lock(&retired_arenas_mutex);
+  arena->next_retired = retired_arenas;
+  retired_arenas = arena;
+  pthread_mutex_unlock(&retired_arenas_mutex);
+}
+
+#endif // PLUGINS_NEW
@@ -0,0 +1,145 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Copyright 2017-2020 The University of Manchester
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+
+#ifdef PLUGINS_NEW
+
+#include <assert.h>
+#include <pthread.h>
+
+#include "../plugins.h"
+
+/*
+  Counter registry
+
+  Each thread has a shard of MAX_MAMBO_COUNTERS values in its dbm_thread,
+  cache line aligned, so the increments of different threads never share a
+  cache line and don't need to be atomic with respect to each other. When a
+  thread exits, or at process exit, its shard is added to the totals.
+  mambo_counter_get() also adds the current values of the live shards, which
+  are read racily and therefore give a snapshot of the counter.
+*/
+
+static struct {
+  pthread_mutex_t lock;
+  int count;
+  char *names[MAX_MAMBO_COUNTERS];
+  uint64_t totals[MAX_MAMBO_COUNTERS];
+  mambo_counter_shard *shards;
+} registry = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static bool is_valid_counter(int counter) {
+  return counter >= 0 && counter < registry.count;
+}
+
+// Called by MAMBO before the PRE_THREAD_C callbacks
+void mambo_counters_thread_init(dbm_thread *thread_data) {
+  mambo_counter_shard *shard = &thread_data->counter_shard;
+
+  for (int i = 0; i < MAX_MAMBO_COUNTERS; i++) {
+    shard->values[i] = 0;
+  }
+
+  pthread_mutex_lock(&registry.lock);
+  shard->next = registry.shards;
+  registry.shards = shard;
+  pthread_mutex_unlock(&registry.lock);
+}
+
+// Called by MAMBO after the POST_THREAD_C callbacks, the thread won't run any more code
+void mambo_counters_thread_exit(dbm_thread *thread_data) {
+  mambo_counter_shard *shard = &thread_data->counter_shard;
+
+  pthread_mutex_lock(&registry.lock);
+  mambo_counter_shard **prev = &registry.shards;
+  while (*prev != NULL && *prev != shard) {
+    prev = &(*prev)->next;
+  }
+  if (*prev == shard) {
+    *prev = shard->next;
+    for (int i = 0; i < registry.count; i++) {
+      registry.totals[i] += shard->values[i];
+      shard->values[i] = 0;
+    }
+  }
+  pthread_mutex_unlock(&registry.lock);
+}
+
+// After fork, only the shard of the calling thread is still live
+void mambo_counters_reset_process(dbm_thread *thread_data) {
+  int ret = pthread_mutex_init(&registry.lock, NULL);
+  assert(ret == 0);
+
+  thread_data->counter_shard.next = NULL;
+  registry.shards = &thread_data->counter_shard;
+}
+
+/* Public API */
+int mambo_counter_register(mambo_context *ctx, char *name) {
+  int counter = -1;
+
+  pthread_mutex_lock(&registry.lock);
+  if (registry.count < MAX_MAMBO_COUNTERS) {
+    counter = registry.count++;
+    registry.names[counter] = name;
+    registry.totals[counter] = 0;
+  }
+  pthread_mutex_unlock(&registry.lock);
+
+  return counter;
+}
+
+char *mambo_counter_get_name(mambo_context *ctx, int counter) {
+  if (!is_valid_counter(counter)) return NULL;
+  return registry.names[counter];
+}
+
+// Value of the counter in the current thread
+uint64_t mambo_counter_get_thread(mambo_context *ctx, int counter) {
+  if (!is_valid_counter(counter) || ctx->thread_data == NULL) return 0;
+  return ctx->thread_data->counter_shard.values[counter];
+}
+
+// Value of the counter summed across all the threads, including the exited ones
+uint64_t mambo_counter_get(mambo_context *ctx, int counter) {
+  if (!is_valid_counter(counter)) return 0;
+
+  pthread_mutex_lock(&registry.lock);
+  uint64_t value = registry.totals[counter];
+  for (mambo_counter_shard *shard = registry.shards; shard != NULL; shard = shard->next) {
+    value += *(volatile uint64_t *)&shard->values[counter];
+  }
+  pthread_mutex_unlock(&registry.lock);
+
+  return value;
+}
+
+/* Code caches are thread-private, so the address of the counter in the shard
+   of the scanning thread is embedded in the generated code. Increments are
+   coalesced per fragment on AArch64, with neighbouring counters of the shard
+   sharing a base register. On AArch32, incr must be at most 255. */
+int emit_counter_incr(mambo_context *ctx, int counter, uint64_t incr) {
+  if (!is_valid_counter(counter)) return -1;
+
+  return emit_counter64_incr_coalesced(ctx, &ctx->thread_data->counter_shard.values[counter], incr);
+}
+
+#endif // PLUGINS_NEW
@@ -0,0 +1,36 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Copyright 2017-2020 The University of Manchester
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+
+#ifndef __API_COUNTERS_H__
+#define __API_COUNTERS_H__
+
+#include <stdint.h>
+
+/* Named 64-bit counters, stored in per-thread shards. The generated code
+   only increments the shard of the current thread, the values are added
+   to the totals when the thread exits and when the process exits */
+int mambo_counter_register(mambo_context *ctx, char *name);
+char *mambo_counter_get_name(mambo_context *ctx, int counter);
+uint64_t mambo_counter_get_thread(mambo_context *ctx, int counter);
+uint64_t mambo_counter_get(mambo_context *ctx, int counter);
+
+int emit_counter_incr(mambo_context *ctx, int counter, uint64_t incr);
+
+#endif
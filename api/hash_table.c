@@ -21,9 +21,14 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "hash_table.h"
 
+static inline bool __mambo_ht_valid_key(uintptr_t key) {
+  return key != 0 && key < MAMBO_HT_BUSY;
+}
+
 int mambo_ht_init(mambo_ht_t *ht, size_t initial_size, int index_shift, int fill_factor, bool allow_resize) {
   if (fill_factor < 10 || fill_factor > 90) return -1;
   if (index_shift < 0 || index_shift > 20) return -1;
@@ -45,9 +50,25 @@ int mambo_ht_init(mambo_ht_t *ht, size_t initial_size, int index_shift, int fill
   ht->index_shift = index_shift;
   ht->resize_threshold = (ht->size * ht->fill_factor) / 100;
 
+  ht->resize_seq = 0;
+  for (int i = 0; i < MAMBO_HT_STRIPES; i++) {
+    ht->stripe_locks[i] = 0;
+  }
+  ht->retired_count = 0;
+
   return 0;
 }
 
+void mambo_ht_destroy(mambo_ht_t *ht) {
+  for (int i = 0; i < ht->retired_count; i++) {
+    free(ht->retired[i]);
+  }
+  ht->retired_count = 0;
+  free(ht->entries);
+  ht->entries = NULL;
+  pthread_mutex_destroy(&ht->lock);
+}
+
 void __mambo_ht_lock(mambo_ht_t *ht) {
   int ret = pthread_mutex_lock(&ht->lock);
   assert(ret == 0);
@@ -58,82 +79,284 @@ void __mambo_ht_unlock(mambo_ht_t *ht) {
   assert(ret == 0);
 }
 
-int __mambo_ht_resize(mambo_ht_t *ht) {
-  mambo_ht_entry_t *prev_entries = ht->entries;
-  size_t prev_size = ht->size;
+static inline int __mambo_ht_stripe(mambo_ht_t *ht, uintptr_t key) {
+  return (key >> ht->index_shift) & (MAMBO_HT_STRIPES - 1);
+}
 
-  size_t new_size = ht->size << 1;
-  mambo_ht_entry_t *new_entries = calloc(new_size, sizeof(mambo_ht_entry_t));
-  if (new_entries == NULL) return -1;
- 
-  ht->entries = new_entries;
-  ht->entry_count = 0;
-  ht->size = new_size;
-  ht->resize_threshold = ht->size * ht->fill_factor / 100;
+static void __mambo_ht_stripe_lock(mambo_ht_t *ht, int stripe) {
+  while (__atomic_exchange_n(&ht->stripe_locks[stripe], 1, __ATOMIC_ACQUIRE) != 0) {
+    while (__atomic_load_n(&ht->stripe_locks[stripe], __ATOMIC_RELAXED) != 0);
+  }
+}
 
-  for (size_t i = 0; i < prev_size; i++) {
-    if (prev_entries[i].key != 0) {
-      int ret = mambo_ht_add_nolock(ht, prev_entries[i].key, prev_entries[i].value);
-      assert(ret == 0);
+static void __mambo_ht_stripe_unlock(mambo_ht_t *ht, int stripe) {
+  __atomic_store_n(&ht->stripe_locks[stripe], 0, __ATOMIC_RELEASE);
+}
+
+static void __mambo_ht_insert_entries(mambo_ht_t *ht, mambo_ht_entry_t *entries, size_t size,
+                                      mambo_ht_entry_t *from, size_t count) {
+  size_t index_max = size - 1;
+  for (size_t i = 0; i < count; i++) {
+    uintptr_t key = from[i].key;
+    if (__mambo_ht_valid_key(key)) {
+      size_t index = (key >> ht->index_shift) & index_max;
+      while (entries[index].key != 0) {
+        index = (index + 1) & index_max;
+      }
+      __atomic_store_n(&entries[index].value, from[i].value, __ATOMIC_RELAXED);
+      __atomic_store_n(&entries[index].key, key, __ATOMIC_RELAXED);
     }
   }
 }
 
-int mambo_ht_add_nolock(mambo_ht_t *ht, uintptr_t key, uintptr_t value) {
-  if (key == 0) return -1;
+/* Rebuilds the table, dropping the deleted entries. The caller must exclude
+   all the writers. If most of the used entries have been deleted, the table
+   is rebuilt in place and the readers wait for it to complete. Otherwise, it
+   grows to twice the size and the readers continue on the previous array of
+   entries until the new one is published. */
+static int __mambo_ht_rehash(mambo_ht_t *ht) {
+  mambo_ht_entry_t *entries = ht->entries;
+  size_t size = ht->size;
+  size_t live = 0;
+  for (size_t i = 0; i < size; i++) {
+    if (__mambo_ht_valid_key(entries[i].key)) live++;
+  }
+
+  bool grow = (live >= ht->resize_threshold / 2);
+  if (grow && (!ht->allow_resize || ht->retired_count >= MAMBO_HT_MAX_RETIRED)) return -1;
+
+  mambo_ht_entry_t *new_entries;
+  size_t new_size = grow ? (size << 1) : size;
+  if (grow) {
+    new_entries = calloc(new_size, sizeof(mambo_ht_entry_t));
+    if (new_entries == NULL) return -1;
+    __mambo_ht_insert_entries(ht, new_entries, new_size, entries, size);
+  } else {
+    new_entries = malloc(size * sizeof(mambo_ht_entry_t));
+    if (new_entries == NULL) return -1;
+    memcpy(new_entries, entries, size * sizeof(mambo_ht_entry_t));
+  }
+
+  uint32_t seq = ht->resize_seq;
+  __atomic_store_n(&ht->resize_seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  if (grow) {
+    /* The readers load the size before the entries, so the new entries
+       must be visible by the time the new size is */
+    ht->retired[ht->retired_count++] = entries;
+    __atomic_store_n(&ht->entries, new_entries, __ATOMIC_RELEASE);
+    __atomic_store_n(&ht->size, new_size, __ATOMIC_RELEASE);
+  } else {
+    for (size_t i = 0; i < size; i++) {
+      __atomic_store_n(&entries[i].key, 0, __ATOMIC_RELAXED);
+    }
+    __mambo_ht_insert_entries(ht, entries, size, new_entries, size);
+    free(new_entries);
+  }
+  ht->entry_count = live;
+  ht->resize_threshold = new_size * ht->fill_factor / 100;
+
+  __atomic_store_n(&ht->resize_seq, seq + 2, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+/* Rebuilds the table, unless it has been rebuilt since prev_seq was read.
+   Takes all the stripe locks, unless the caller already excludes the other
+   writers */
+int __mambo_ht_resize(mambo_ht_t *ht, uint32_t prev_seq, bool nolock) {
+  int ret = 0;
+
+  if (!nolock) {
+    for (int i = 0; i < MAMBO_HT_STRIPES; i++) {
+      __mambo_ht_stripe_lock(ht, i);
+    }
+  }
+
+  // Another thread might have resized the table in the meantime
+  if (ht->resize_seq == prev_seq) {
+    ret = __mambo_ht_rehash(ht);
+  }
 
-  if (ht->entry_count >= ht->resize_threshold) {
-    if (ht->allow_resize) {
-      __mambo_ht_resize(ht);
-    } else {
-      return -1;
+  if (!nolock) {
+    for (int i = MAMBO_HT_STRIPES - 1; i >= 0; i--) {
+      __mambo_ht_stripe_unlock(ht, i);
     }
   }
 
+  return ret;
+}
+
+/* Reserves a slot with a CAS, so that the concurrent readers never observe
+   the key before its value. The value is stored with release semantics, so
+   that a reader which loads it also observes that the slot was claimed */
+static bool __mambo_ht_claim(mambo_ht_entry_t *entry, uintptr_t expected,
+                             uintptr_t key, uintptr_t value) {
+  if (!__atomic_compare_exchange_n(&entry->key, &expected, MAMBO_HT_BUSY, false,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    return false;
+  }
+  __atomic_store_n(&entry->value, value, __ATOMIC_RELEASE);
+  __atomic_store_n(&entry->key, key, __ATOMIC_RELEASE);
+  return true;
+}
+
+/* Must be called with the writers for this key excluded, the entries can't
+   be reallocated concurrently. Returns 1 if the table must be resized. */
+static int __mambo_ht_insert(mambo_ht_t *ht, uintptr_t key, uintptr_t value) {
+  mambo_ht_entry_t *entries = ht->entries;
   size_t index_max = (ht->size - 1);
-  size_t index = (key >> ht->index_shift) & index_max;
+  size_t start = (key >> ht->index_shift) & index_max;
+  size_t index = start;
+  mambo_ht_entry_t *deleted = NULL;
+
+  for (size_t i = 0; i < ht->size; i++) {
+    uintptr_t cur = __atomic_load_n(&entries[index].key, __ATOMIC_ACQUIRE);
+    if (cur == key) {
+      __atomic_store_n(&entries[index].value, value, __ATOMIC_RELAXED);
+      return 0;
+    }
+    if (cur == 0) break;
+    if (cur == MAMBO_HT_DELETED && deleted == NULL) {
+      deleted = &entries[index];
+    }
+    index = (index + 1) & index_max;
+  }
+
+  // The key isn't in the table, reuse a deleted entry if possible
+  if (deleted != NULL && __mambo_ht_claim(deleted, MAMBO_HT_DELETED, key, value)) {
+    return 0;
+  }
+
+  if (__atomic_load_n(&ht->entry_count, __ATOMIC_RELAXED) >= ht->resize_threshold) {
+    return 1;
+  }
 
-  while (ht->entries[index].key != 0 && ht->entries[index].key != key) {
+  // Other keys can be inserted concurrently, retry until an empty slot is claimed
+  index = start;
+  for (size_t i = 0; i < ht->size; i++) {
+    if (__atomic_load_n(&entries[index].key, __ATOMIC_RELAXED) == 0 &&
+        __mambo_ht_claim(&entries[index], 0, key, value)) {
+      __atomic_fetch_add(&ht->entry_count, 1, __ATOMIC_RELAXED);
+      return 0;
+    }
     index = (index + 1) & index_max;
   }
-  if (ht->entries[index].key == 0) {
-    ht->entry_count++;
+
+  return 1;
+}
+
+int mambo_ht_add_nolock(mambo_ht_t *ht, uintptr_t key, uintptr_t value) {
+  if (!__mambo_ht_valid_key(key)) return -1;
+
+  int ret;
+  while ((ret = __mambo_ht_insert(ht, key, value)) > 0) {
+    ret = __mambo_ht_resize(ht, ht->resize_seq, true);
+    if (ret != 0) return ret;
   }
-  ht->entries[index].key = key;
-  ht->entries[index].value = value;
 
-  return 0;
+  return ret;
 }
 
 int mambo_ht_add(mambo_ht_t *ht, uintptr_t key, uintptr_t value) {
-  __mambo_ht_lock(ht);
-  int ret = mambo_ht_add_nolock(ht, key, value);
-  __mambo_ht_unlock(ht);
+  if (!__mambo_ht_valid_key(key)) return -1;
+
+  int stripe = __mambo_ht_stripe(ht, key);
+  uint32_t seq;
+  int ret;
+  while (1) {
+    __mambo_ht_stripe_lock(ht, stripe);
+    seq = ht->resize_seq;
+    ret = __mambo_ht_insert(ht, key, value);
+    __mambo_ht_stripe_unlock(ht, stripe);
+    if (ret <= 0) break;
+
+    ret = __mambo_ht_resize(ht, seq, false);
+    if (ret != 0) break;
+  }
+
   return ret;
 }
 
-int mambo_ht_get_nolock(mambo_ht_t *ht, uintptr_t key, uintptr_t *value) {
-  if (key == 0) return -1;
+static int __mambo_ht_find(mambo_ht_entry_t *entries, size_t size, int index_shift,
+                           uintptr_t key, mambo_ht_entry_t **entryp) {
+  size_t index_max = (size - 1);
+  size_t index = (key >> index_shift) & index_max;
 
-  size_t index_max = (ht->size - 1);
-  size_t index = (key >> ht->index_shift) & index_max;
-  while (ht->entries[index].key != 0 && ht->entries[index].key != key) {
+  for (size_t i = 0; i < size; i++) {
+    uintptr_t cur = __atomic_load_n(&entries[index].key, __ATOMIC_ACQUIRE);
+    if (cur == key) {
+      *entryp = &entries[index];
+      return 0;
+    }
+    if (cur == 0) break;
     index = (index + 1) & index_max;
   }
-  if (ht->entries[index].key == key) {
-    *value = ht->entries[index].value;
-    return 0;
-  }
+
   return -1;
 }
 
+int mambo_ht_get_nolock(mambo_ht_t *ht, uintptr_t key, uintptr_t *value) {
+  return mambo_ht_get(ht, key, value);
+}
+
 int mambo_ht_get(mambo_ht_t *ht, uintptr_t key, uintptr_t *value) {
-  __mambo_ht_lock(ht);
-  int ret = mambo_ht_get_nolock(ht, key, value);
-  __mambo_ht_unlock(ht);
+  if (!__mambo_ht_valid_key(key)) return -1;
+
+  uint32_t seq;
+  uintptr_t val;
+  bool stale;
+  int ret;
+  do {
+    stale = false;
+    seq = __atomic_load_n(&ht->resize_seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) continue;
+
+    size_t size = __atomic_load_n(&ht->size, __ATOMIC_ACQUIRE);
+    mambo_ht_entry_t *entries = __atomic_load_n(&ht->entries, __ATOMIC_ACQUIRE);
+    mambo_ht_entry_t *entry;
+    ret = __mambo_ht_find(entries, size, ht->index_shift, key, &entry);
+    if (ret == 0) {
+      val = __atomic_load_n(&entry->value, __ATOMIC_ACQUIRE);
+      /* The key might have been deleted and its slot reused for another key
+         after it was matched, in which case val belongs to the other key */
+      stale = (__atomic_load_n(&entry->key, __ATOMIC_RELAXED) != key);
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((seq & 1) || stale || __atomic_load_n(&ht->resize_seq, __ATOMIC_RELAXED) != seq);
+
+  if (ret == 0) {
+    *value = val;
+  }
+  return ret;
+}
+
+/* Deleted entries are marked with MAMBO_HT_DELETED, so that the probing
+   sequences of the other keys are preserved. They are reused by later
+   insertions and dropped when the table is resized. */
+static int __mambo_ht_remove(mambo_ht_t *ht, uintptr_t key) {
+  mambo_ht_entry_t *entry;
+  int ret = __mambo_ht_find(ht->entries, ht->size, ht->index_shift, key, &entry);
+  if (ret == 0) {
+    __atomic_store_n(&entry->key, MAMBO_HT_DELETED, __ATOMIC_RELEASE);
+  }
   return ret;
 }
 
 int mambo_ht_delete_nolock(mambo_ht_t *ht, uintptr_t key) {
-  
+  if (!__mambo_ht_valid_key(key)) return -1;
+  return __mambo_ht_remove(ht, key);
+}
+
+int mambo_ht_delete(mambo_ht_t *ht, uintptr_t key) {
+  if (!__mambo_ht_valid_key(key)) return -1;
+
+  int stripe = __mambo_ht_stripe(ht, key);
+  __mambo_ht_stripe_lock(ht, stripe);
+  int ret = __mambo_ht_remove(ht, key);
+  __mambo_ht_stripe_unlock(ht, stripe);
+
+  return ret;
 }
@@ -19,6 +19,24 @@
 
 #include <stdbool.h>
 
+/*
+  Open addressing hash table with linear probing
+
+  mambo_ht_get() is lock-free. mambo_ht_add() and mambo_ht_delete() only
+  serialise on one of MAMBO_HT_STRIPES locks, selected by the key, while a
+  resize briefly excludes all writers. The _nolock variants are for callers
+  which serialise all the writers themselves, e.g. by holding ht->lock.
+
+  The keys 0, MAMBO_HT_BUSY and MAMBO_HT_DELETED are reserved. Code iterating
+  over the entries should only do so while there are no concurrent writers
+  and should skip the deleted entries.
+*/
+#define MAMBO_HT_STRIPES 16
+#define MAMBO_HT_MAX_RETIRED 64
+
+#define MAMBO_HT_DELETED UINTPTR_MAX
+#define MAMBO_HT_BUSY (UINTPTR_MAX - 1)
+
 typedef struct {
   uintptr_t key;
   uintptr_t value;
@@ -36,11 +54,22 @@ typedef struct {
 
   pthread_mutex_t lock;
 
-  mambo_ht_entry_t *entries; 
+  mambo_ht_entry_t *entries;
+
+  // Odd while a resize is in progress, the lock-free readers retry if it changes
+  uint32_t resize_seq;
+  uint32_t stripe_locks[MAMBO_HT_STRIPES];
+  /* Previous arrays of entries, which might still be accessed by the readers.
+     They are only released by mambo_ht_destroy() */
+  int retired_count;
+  mambo_ht_entry_t *retired[MAMBO_HT_MAX_RETIRED];
 } mambo_ht_t;
 
 int mambo_ht_init(mambo_ht_t *ht, size_t initial_size, int index_shift, int fill_factor, bool allow_resize);
+void mambo_ht_destroy(mambo_ht_t *ht);
 int mambo_ht_add_nolock(mambo_ht_t *ht, uintptr_t key, uintptr_t value);
 int mambo_ht_add(mambo_ht_t *ht, uintptr_t key, uintptr_t value);
 int mambo_ht_get_nolock(mambo_ht_t *ht, uintptr_t key, uintptr_t *value);
 int mambo_ht_get(mambo_ht_t *ht, uintptr_t key, uintptr_t *value);
+int mambo_ht_delete_nolock(mambo_ht_t *ht, uintptr_t key);
+int mambo_ht_delete(mambo_ht_t *ht, uintptr_t key);
@@ -21,9 +21,14 @@
 #ifdef PLUGINS_NEW
 
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include "../plugins.h"
+#ifdef __aarch64__
+#include <sys/auxv.h>
+#endif
 #ifdef __arm__
 #include "../pie/pie-thumb-encoder.h"
 #elif __aarch64__
@@ -175,7 +180,133 @@ static inline int emit_thumb_add_sub(mambo_context *ctx, int rd, int rn, int rm)
 #endif // __arm__
 
 #ifdef __aarch64__
+/* Registers which are dead in the application don't have to be preserved.
+   Their outermost push is elided and so is the matching pop, while nested
+   pushes of the same register save the value set by the plugin. A pair costs
+   the same as a single register, so one register is kept on the stack rather
+   than leaving an odd number of pushed registers, for which the stack space
+   would no longer match plugin_pushed_reg_count */
+static uint32_t a64_elide_push(mambo_context *ctx, uint32_t regs) {
+  for (int r = 0; r < 32; r++) {
+    if (regs & ctx->code.elided_regs & (1 << r)) {
+      ctx->code.elided_depth[r]++;
+    }
+  }
+
+  uint32_t elided = regs & ctx->code.dead_regs;
+  if (count_bits(regs & ~elided) & 1) {
+    elided &= elided - 1;
+  }
+  for (int r = 0; r < 32; r++) {
+    if (elided & (1 << r)) {
+      ctx->code.elided_depth[r] = 0;
+    }
+  }
+  ctx->code.dead_regs &= ~elided;
+  ctx->code.elided_regs |= elided;
+
+  return regs & ~elided;
+}
+
+static uint32_t a64_elide_pop(mambo_context *ctx, uint32_t regs) {
+  uint32_t elided = 0;
+  for (int r = 0; r < 32; r++) {
+    if (regs & ctx->code.elided_regs & (1 << r)) {
+      if (ctx->code.elided_depth[r] > 0) {
+        ctx->code.elided_depth[r]--;
+      } else {
+        elided |= 1 << r;
+      }
+    }
+  }
+  ctx->code.elided_regs &= ~elided;
+  ctx->code.dead_regs |= elided;
+
+  return regs & ~elided;
+}
+
+static void a64_pop_regs(uint32_t **o_write_p, uint32_t regs) {
+  uint32_t *write_p = *o_write_p;
+  uint32_t to_pop[2];
+  int reg_no;
+
+  while (regs != 0) {
+    reg_no = get_lowest_n_regs(regs, to_pop, 2);
+    assert(reg_no == 1 || reg_no == 2);
+    if (reg_no == 2) {
+      a64_pop_pair_reg(to_pop[0], to_pop[1]);
+      regs &= ~((1 << to_pop[0]) | (1 << to_pop[1]));
+    } else if (reg_no == 1) {
+      a64_pop_reg(to_pop[0]);
+      regs &= ~(1 << to_pop[0]);
+    }
+  }
+
+  *o_write_p = write_p;
+}
+
+/* Reloads registers saved by emit_a64_push() from their stack slots, in the
+   order used by a64_pop_regs(), without moving SP */
+static void a64_reload_regs(uint32_t **o_write_p, uint32_t regs) {
+  uint32_t *write_p = *o_write_p;
+  uint32_t to_load[2];
+  int offset = 0;
+  int reg_no;
+
+  while (regs != 0) {
+    reg_no = get_lowest_n_regs(regs, to_load, 2);
+    if (reg_no == 2) {
+      a64_LDP_STP(&write_p, 2, 0, 2, 1, offset / 8, to_load[1], sp, to_load[0]);
+      regs &= ~((1 << to_load[0]) | (1 << to_load[1]));
+    } else {
+      assert(reg_no == 1);
+      a64_LDR_STR_unsigned_immed(&write_p, 3, 0, 1, offset / 8, sp, to_load[0]);
+      regs &= ~(1 << to_load[0]);
+    }
+    write_p++;
+    offset += 16;
+  }
+
+  *o_write_p = write_p;
+}
+
+/* Spill coalescing
+   When the instrumentation of an instruction ends by popping registers which
+   the following application code doesn't access, the pop is deferred. If
+   the next instrumentation point starts by pushing the same registers, both
+   the pop and the push are replaced by a reload of the application values
+   from the stack slots which still hold them, as the plugin may read them.
+   The scanner restores the registers before any instruction which uses them,
+   uses SP, isn't modelled by the liveness analysis, ends the block or isn't
+   instrumented, and the branch helpers restore them before emitting any
+   control flow. Pops are not deferred after a callback has stopped the scan,
+   as it emits its own exit. Application code executed in between sees the
+   plugin's values in those registers and a lower SP, which only matters to
+   signal handlers inspecting the interrupted context. */
+void emit_a64_flush_spills(mambo_context *ctx) {
+  uint32_t regs = ctx->thread_data->pending_spill;
+  if (regs == 0) return;
+
+  ctx->thread_data->pending_spill = 0;
+  mambo_reserve_cc_space(ctx, ((count_bits(regs) + 1) / 2) * 4);
+  a64_pop_regs((uint32_t **)&ctx->code.write_p, regs);
+}
+
 void emit_a64_push(mambo_context *ctx, uint32_t regs) {
+  regs = a64_elide_push(ctx, regs);
+
+  uint32_t *pending = &ctx->thread_data->pending_spill;
+  if (*pending != 0) {
+    if (ctx->code.plugin_pushed_reg_count == 0 && regs == *pending) {
+      // Still saved by the previous instrumentation
+      *pending = 0;
+      ctx->code.plugin_pushed_reg_count += count_bits(regs);
+      a64_reload_regs((uint32_t **)&ctx->code.write_p, regs);
+      return;
+    }
+    emit_a64_flush_spills(ctx);
+  }
+
   int reg_no = count_bits(regs);
   ctx->code.plugin_pushed_reg_count += reg_no;
 
@@ -200,26 +331,19 @@ void emit_a64_push(mambo_context *ctx, uint32_t regs) {
 }
 
 void emit_a64_pop(mambo_context *ctx, uint32_t regs) {
+  regs = a64_elide_pop(ctx, regs);
   ctx->code.plugin_pushed_reg_count -= count_bits(regs);
   assert(ctx->code.plugin_pushed_reg_count >= 0);
 
-  uint32_t *write_p = ctx->code.write_p;
-  uint32_t to_pop[2];
-  int reg_no;
-
-  while (regs != 0) {
-    reg_no = get_lowest_n_regs(regs, to_pop, 2);
-    assert(reg_no == 1 || reg_no == 2);
-    if (reg_no == 2) {
-      a64_pop_pair_reg(to_pop[0], to_pop[1]);
-      regs &= ~((1 << to_pop[0]) | (1 << to_pop[1]));
-    } else if (reg_no == 1) {
-      a64_pop_reg(to_pop[0]);
-      regs &= ~(1 << to_pop[0]);
-    }
+  if (regs != 0 && ctx->code.plugin_pushed_reg_count == 0
+      && (regs & ~ctx->code.coalesce_regs) == 0
+      && (ctx->code.stop == NULL || !*ctx->code.stop)) {
+    assert(ctx->thread_data->pending_spill == 0);
+    ctx->thread_data->pending_spill = regs;
+    return;
   }
 
-  ctx->code.write_p = write_p;
+  a64_pop_regs((uint32_t **)&ctx->code.write_p, regs);
 }
 
 static inline int emit_a64_add_sub_shift(mambo_context *ctx, int rd, int rn, int rm,
@@ -271,6 +395,77 @@ void emit_pop(mambo_context *ctx, uint32_t regs) {
 #endif
 }
 
+#ifdef __aarch64__
+/* Constants which would need at least LIT_POOL_MIN_MOVS MOVZ/MOVK instructions
+   are placed in a literal pool in the data area at the end of the basic block
+   (growing down from data_p) and loaded with a single LDR (literal). Literals
+   are reused within the fragment as long as they are in range of the LDR. */
+#define LIT_POOL_MIN_MOVS 3
+#define LIT_MAX_OFFSET    ((1 << 20) - 4)
+
+static int a64_mov_wide_count(uint64_t value) {
+  int count = 1;
+  for (int i = 1; i < 4; i++) {
+    if ((value >> (i * 16)) & 0xFFFF) count++;
+  }
+  return count;
+}
+
+static bool a64_lit_in_range(uint32_t *write_p, uint64_t *lit) {
+  intptr_t diff = (uintptr_t)lit - (uintptr_t)write_p;
+  return diff >= -LIT_MAX_OFFSET - 4 && diff <= LIT_MAX_OFFSET;
+}
+
+static void emit_a64_ldr_lit(mambo_context *ctx, enum reg reg, uint64_t *lit) {
+  intptr_t diff = (uintptr_t)lit - (uintptr_t)ctx->code.write_p;
+  emit_a64_LDR_lit(ctx, 1, 0, (diff >> 2) & 0x7FFFF, reg);
+}
+
+static bool emit_a64_set_reg_lit(mambo_context *ctx, enum reg reg, uint64_t value) {
+  switch (ctx->event_type) {
+    case PRE_INST_C:
+    case POST_INST_C:
+    case PRE_BB_C:
+    case POST_BB_C:
+    case PRE_FRAGMENT_C:
+    case POST_FRAGMENT_C:
+    case PRE_FN_C:
+    case POST_FN_C:
+      break;
+    default:
+      return false;
+  }
+  if (ctx->code.fragment_type != mambo_bb || ctx->code.data_p == NULL) return false;
+  if (a64_mov_wide_count(value) < LIT_POOL_MIN_MOVS) return false;
+
+  a64_literal_pool *pool = &ctx->thread_data->lit_pool;
+  for (int i = 0; i < pool->count; i++) {
+    if (pool->values[i] == value && a64_lit_in_range(ctx->code.write_p, pool->addrs[i])) {
+      emit_a64_ldr_lit(ctx, reg, pool->addrs[i]);
+      return true;
+    }
+  }
+
+  // Space for the LDR, the literal and its alignment, chaining a new block if needed
+  mambo_reserve_cc_space(ctx, 4 * 4);
+
+  uintptr_t data_p = (uintptr_t)ctx->code.data_p;
+  uint64_t *lit = (uint64_t *)((data_p - sizeof(uint64_t)) & ~(sizeof(uint64_t) - 1));
+  if ((uint32_t *)lit < (uint32_t *)ctx->code.write_p + 1) return false;
+  *lit = value;
+  ctx->code.data_p = lit;
+
+  if (pool->count < MAX_LITERAL_POOL) {
+    pool->values[pool->count] = value;
+    pool->addrs[pool->count] = lit;
+    pool->count++;
+  }
+
+  emit_a64_ldr_lit(ctx, reg, lit);
+  return true;
+}
+#endif
+
 void emit_set_reg(mambo_context *ctx, enum reg reg, uintptr_t value) {
 #ifdef __arm__
   inst_set isa = mambo_get_inst_type(ctx);
@@ -280,7 +475,9 @@ void emit_set_reg(mambo_context *ctx, enum reg reg, uintptr_t value) {
     emit_thumb_copy_to_reg_32bit(ctx, reg, value);
   }
 #elif __aarch64__
-  a64_copy_to_reg_64bits((uint32_t **)&ctx->code.write_p, reg, value);
+  if (!emit_a64_set_reg_lit(ctx, reg, value)) {
+    a64_copy_to_reg_64bits((uint32_t **)&ctx->code.write_p, reg, value);
+  }
 #endif
 }
 
@@ -488,6 +685,9 @@ inline int emit_add_sub(mambo_context *ctx, int rd, int rn, int rm) {
 }
 
 int emit_branch_cond(mambo_context *ctx, void *target, mambo_cond cond) {
+#ifdef __aarch64__
+  emit_a64_flush_spills(ctx);
+#endif
   void *write_p = mambo_get_cc_addr(ctx);
   int ret = __emit_branch_cond(mambo_get_inst_type(ctx), write_p, (uintptr_t)target, cond, false);
   if (ret == 0) {
@@ -513,6 +713,9 @@ int __emit_branch_cbz_cbnz(mambo_context *ctx, void *write_p, void *target, enum
 }
 
 int emit_branch_cbz_cbnz(mambo_context *ctx, void *target, enum reg reg, bool is_cbz) {
+#ifdef __aarch64__
+  emit_a64_flush_spills(ctx);
+#endif
   void *write_p = mambo_get_cc_addr(ctx);
 
   int ret = __emit_branch_cbz_cbnz(ctx, write_p, target, reg, is_cbz);
@@ -535,6 +738,9 @@ int emit_branch_cbnz(mambo_context *ctx, void *target, enum reg reg) {
 }
 
 int __mambo_reserve(mambo_context *ctx, mambo_branch *br, size_t incr) {
+#ifdef __aarch64__
+  emit_a64_flush_spills(ctx);
+#endif
   if (ctx->code.write_p) {
     br->loc = ctx->code.write_p;
     ctx->code.write_p += incr;
@@ -558,6 +764,9 @@ int mambo_reserve_branch_cbz(mambo_context *ctx, mambo_branch *br) {
 }
 
 int __emit_local_branch(mambo_context *ctx, mambo_branch *br, mambo_cond cond, bool link) {
+#ifdef __aarch64__
+  emit_a64_flush_spills(ctx);
+#endif
   uintptr_t target = (uintptr_t)mambo_get_cc_addr(ctx);
 #ifdef __arm__
   if (ctx->code.inst_type == THUMB_INST) {
@@ -580,6 +789,9 @@ int emit_local_fcall(mambo_context *ctx, mambo_branch *br) {
 }
 
 int emit_local_branch_cbz_cbnz(mambo_context *ctx, mambo_branch *br, enum reg reg, bool is_cbz) {
+#ifdef __aarch64__
+  emit_a64_flush_spills(ctx);
+#endif
   return __emit_branch_cbz_cbnz(ctx, br->loc, mambo_get_cc_addr(ctx), reg, is_cbz);
 }
 
@@ -647,7 +859,7 @@ void emit_counter64_incr(mambo_context *ctx, void *counter, unsigned incr) {
 #ifdef __aarch64__
   assert(incr <= 0xFFF);
   emit_a64_push(ctx, (1 << x0) | (1 << x1));
-  a64_copy_to_reg_64bits((uint32_t **)&ctx->code.write_p, x0, (uintptr_t)counter);
+  emit_set_reg(ctx, x0, (uintptr_t)counter);
   emit_a64_LDR_STR_unsigned_immed(ctx, 3, 0, 1, 0, x0, x1);
   emit_a64_ADD_SUB_immed(ctx, 1, 0, 0, 0, incr, x1, x1);
   emit_a64_LDR_STR_unsigned_immed(ctx, 3, 0, 0, 0, x0, x1);
@@ -655,8 +867,457 @@ void emit_counter64_incr(mambo_context *ctx, void *counter, unsigned incr) {
 #endif
 }
 
+int emit_load_thread_slot(mambo_context *ctx, enum reg reg, int slot) {
+  if (slot < 0 || slot >= global_data.free_thread_slot || slot >= MAX_THREAD_SLOTS) return MAMBO_INVALID_SLOT;
+
+#ifdef __aarch64__
+  /* MRS reg, TPIDR_EL0
+     LDR reg, [reg, #slot_offset] */
+  uintptr_t offset = (uintptr_t)&mambo_thread_slots[slot] - (uintptr_t)__builtin_thread_pointer();
+  if ((offset & 7) == 0 && (offset >> 3) <= 0xFFF) {
+    emit_a64_MRS_MSR_reg(ctx, 1, 1, 3, 13, 0, 2, reg);
+    emit_a64_LDR_STR_unsigned_immed(ctx, 3, 0, 1, offset >> 3, reg, reg);
+    return 0;
+  }
+#endif
+
+  /* Code caches are thread-private and instrumentation is generated by the
+     thread which will run it, so the slot's address can be embedded directly */
+  emit_set_reg(ctx, reg, (uintptr_t)&mambo_thread_slots[slot]);
+#ifdef __arm__
+  if (mambo_get_inst_type(ctx) == ARM_INST) {
+    emit_arm_ldr(ctx, IMM_LDR, reg, reg, 0, 1, 1, 0);
+  } else {
+    emit_thumb_ldrwi32(ctx, reg, reg, 0);
+  }
+#elif __aarch64__
+  emit_a64_LDR_STR_unsigned_immed(ctx, 3, 0, 1, 0, reg, reg);
+#endif
+  return 0;
+}
+
+#ifdef __aarch64__
+#ifndef HWCAP_ATOMICS
+  #define HWCAP_ATOMICS (1 << 8)
+#endif
+
+// STADD Xs, [Xn], encoded as LDADD Xs, XZR, [Xn]
+#define a64_STADD(rs, rn) (0xF820001F | ((rs) << 16) | ((rn) << 5))
+
+/* Worst case size of the code and literals emitted for a single counter
+   by emit_a64_deferred_counters() */
+#define DEFERRED_COUNTER_SZ (80)
+
+static bool a64_has_lse(void) {
+  static int has_lse = -1;
+  if (has_lse < 0) {
+    has_lse = (getauxval(AT_HWCAP) & HWCAP_ATOMICS) ? 1 : 0;
+  }
+  return has_lse;
+}
+
+/* Adds incr to the 64-bit counter at [addr]. The LL/SC fallback also uses
+   tmp and status. Inside an application exclusive access sequence, a plain
+   LDR/ADD/STR is used instead to avoid breaking the application's monitor. */
+static void emit_a64_counter_add(mambo_context *ctx, enum reg addr, enum reg incr,
+                                 enum reg tmp, enum reg status, bool atomic) {
+  if (!atomic) {
+    emit_a64_LDR_STR_unsigned_immed(ctx, 3, 0, 1, 0, addr, tmp);
+    emit_a64_ADD_SUB_shift_reg(ctx, 1, 0, 0, LSL, incr, 0, tmp, tmp);
+    emit_a64_LDR_STR_unsigned_immed(ctx, 3, 0, 0, 0, addr, tmp);
+  } else if (a64_has_lse()) {
+    uint32_t *write_p = ctx->code.write_p;
+    *write_p++ = a64_STADD(incr, addr);
+    ctx->code.write_p = write_p;
+  } else {
+    void *retry = ctx->code.write_p;
+    emit_a64_LDX_STX(ctx, 3, 0, 1, 0, 31, 0, 31, addr, tmp);     // LDXR tmp, [addr]
+    emit_a64_ADD_SUB_shift_reg(ctx, 1, 0, 0, LSL, incr, 0, tmp, tmp);
+    emit_a64_LDX_STX(ctx, 3, 0, 0, 0, status, 0, 31, addr, tmp); // STXR status, tmp, [addr]
+    int ret = emit_branch_cbnz(ctx, retry, status);
+    assert(ret == 0);
+  }
+}
+
+static bool a64_ends_fragment(int inst) {
+  switch (inst) {
+    case A64_B_BL:
+    case A64_B_COND:
+    case A64_CBZ_CBNZ:
+    case A64_TBZ_TBNZ:
+    case A64_BR:
+    case A64_BLR:
+    case A64_RET:
+    case A64_SVC:
+    case A64_HVC:
+    case A64_BRK:
+    case A64_INVALID:
+      return true;
+  }
+  return false;
+}
+
+/* Emits the increments accumulated by emit_counter64_incr_coalesced(). Counters
+   are sorted by address so that neighbouring counters can share a base
+   register. */
+static void a64_flush_counters(mambo_context *ctx) {
+  a64_deferred_counters *dc = &ctx->thread_data->deferred_counters;
+  int count = dc->count;
+
+  if (count == 0) return;
+  // The branch helpers used by the LL/SC fallback flush the pending state
+  dc->count = 0;
+
+  for (int i = 1; i < count; i++) {
+    uint64_t *counter = dc->counters[i];
+    uint64_t incr = dc->incrs[i];
+    int j;
+    for (j = i - 1; j >= 0 && dc->counters[j] > counter; j--) {
+      dc->counters[j + 1] = dc->counters[j];
+      dc->incrs[j + 1] = dc->incrs[j];
+    }
+    dc->counters[j + 1] = counter;
+    dc->incrs[j + 1] = incr;
+  }
+
+  uint32_t regs = (1 << x0) | (1 << x1) | (1 << x2) | (1 << x3) | (1 << x4);
+  mambo_reserve_cc_space(ctx, 2 * 3 * 4 + DEFERRED_COUNTER_SZ);
+  emit_a64_push(ctx, regs);
+
+  uintptr_t base = 0;
+  uint64_t cur_incr = 0;
+  for (int i = 0; i < count; i++) {
+    uintptr_t addr = (uintptr_t)dc->counters[i];
+    enum reg addr_reg = x0;
+
+    mambo_reserve_cc_space(ctx, DEFERRED_COUNTER_SZ);
+    if (i > 0 && (addr - base) <= 0xFFF) {
+      if (addr != base) {
+        emit_a64_ADD_SUB_immed(ctx, 1, 0, 0, 0, addr - base, x0, x2);
+        addr_reg = x2;
+      }
+    } else {
+      emit_set_reg(ctx, x0, addr);
+      base = addr;
+    }
+    if (i == 0 || dc->incrs[i] != cur_incr) {
+      cur_incr = dc->incrs[i];
+      emit_set_reg(ctx, x1, cur_incr);
+    }
+    emit_a64_counter_add(ctx, addr_reg, x1, x3, x4, !dc->in_exclusive);
+  }
+
+  emit_a64_pop(ctx, regs);
+}
+
+/* Called by the scanner after the PRE_INST_C callbacks. Emits the deferred
+   increments before any instruction which can leave the fragment. */
+void emit_a64_deferred_counters(mambo_context *ctx) {
+  a64_deferred_counters *dc = &ctx->thread_data->deferred_counters;
+
+  if (ctx->code.inst == A64_LDX_STX) {
+    uint32_t size, o2, l, o1, rs, o0, rt2, rn, rt;
+    a64_LDX_STX_decode_fields(ctx->code.read_address, &size, &o2, &l, &o1, &rs, &o0, &rt2, &rn, &rt);
+    if (o2 == 0) {
+      dc->in_exclusive = (l == 1);
+    }
+  } else if (ctx->code.inst == A64_CLREX) {
+    dc->in_exclusive = false;
+  }
+
+  if (a64_ends_fragment(ctx->code.inst)) {
+    a64_flush_counters(ctx);
+  }
+}
+
+/* Emits the state carried between instrumentation points, the deferred
+   counters and the pending spill. Used before the exits of the fragment
+   which aren't application branches and before uninstrumented code. */
+void emit_a64_flush_pending(mambo_context *ctx) {
+  a64_flush_counters(ctx);
+  emit_a64_flush_spills(ctx);
+}
+#endif
+
+void emit_counter64_incr_atomic(mambo_context *ctx, void *counter, uint64_t incr) {
+#ifdef __aarch64__
+  uint32_t regs = (1 << x0) | (1 << x1) | (1 << x2) | (1 << x3);
+  emit_a64_push(ctx, regs);
+  emit_set_reg(ctx, x0, (uintptr_t)counter);
+  emit_set_reg(ctx, x1, incr);
+  emit_a64_counter_add(ctx, x0, x1, x2, x3, !ctx->thread_data->deferred_counters.in_exclusive);
+  emit_a64_pop(ctx, regs);
+#elif __arm__
+  // uint64_t atomic_increment_u64(uint64_t *loc, uint64_t inc), inc is passed in R2:R3
+  emit_safe_fcall_static_args(ctx, atomic_increment_u64, 4, (uintptr_t)counter, 0,
+                              (uintptr_t)incr, (uintptr_t)(incr >> 32));
+#endif
+}
+
+/* On AArch64, increments to the same counter are merged and all the pending
+   increments of a fragment are emitted together, atomically, before its exit.
+   On AArch32 this is equivalent to emit_counter64_incr(). Like the other
+   emit functions, it can't be used from callbacks which can't emit code, such
+   as the POST_INST_C callbacks of the instruction ending a fragment; it
+   returns -1 there. */
+int emit_counter64_incr_coalesced(mambo_context *ctx, void *counter, uint64_t incr) {
+#ifdef __aarch64__
+  a64_deferred_counters *dc = &ctx->thread_data->deferred_counters;
+
+  if (dc->closed) return -1;
+
+  for (int i = 0; i < dc->count; i++) {
+    if (dc->counters[i] == counter) {
+      dc->incrs[i] += incr;
+      return 0;
+    }
+  }
+
+  if (dc->count < MAX_DEFERRED_COUNTERS) {
+    dc->counters[dc->count] = counter;
+    dc->incrs[dc->count] = incr;
+    dc->count++;
+    return 0;
+  }
+  emit_counter64_incr_atomic(ctx, counter, incr);
+#elif __arm__
+  emit_counter64_incr(ctx, counter, incr);
+#endif
+  return 0;
+}
+
+/* One-shot probes
+   A probe calls cb the first time any thread executes it. Each translation
+   of the probe, including the copies in traces, then queues the
+   retranslation of its fragment, which the thread owning it performs on its
+   next dispatcher entry, see queue_invalidation(). The plugin's scan
+   callbacks run again for the new translation, where emit_one_shot_probe()
+   doesn't emit anything for probes which have already fired. Until then,
+   the old translation returns immediately from mambo_one_shot_probe_fire(),
+   as do the copies in the middle of traces, which aren't retranslated.
+
+   Each translation has its own probe, on the list of the thread which owns
+   it. A probe is freed by mambo_free_one_shot_probes() at a dispatcher entry
+   after the retranslation of its basic block has been applied, or after the
+   code cache containing it has been flushed. Probes in traces are only
+   freed with the code cache. */
+typedef struct one_shot_probe_s one_shot_probe;
+struct one_shot_probe_s {
+  mambo_probe_cb cb;
+  void *data;
+  void *source_addr;
+  void *fragment_addr;
+  int plugin_id;
+  bool in_trace;
+  // Only accessed by the thread which owns the translation
+  bool queued;
+  bool removed;
+  one_shot_probe *next;
+};
+
+static mambo_ht_t fired_probes;
+static pthread_once_t fired_probes_once = PTHREAD_ONCE_INIT;
+
+static void fired_probes_init(void) {
+  int ret = mambo_ht_init(&fired_probes, 1024, 2, 70, true);
+  assert(ret == 0);
+}
+
+// The value is a bitmap of the plugins for which the probe has fired
+static bool probe_has_fired(void *source_addr, int plugin_id, bool set) {
+  uintptr_t plugins = 0;
+
+  pthread_once(&fired_probes_once, fired_probes_init);
+  pthread_mutex_lock(&fired_probes.lock);
+  mambo_ht_get_nolock(&fired_probes, (uintptr_t)source_addr, &plugins);
+  bool fired = (plugins & (1 << plugin_id)) != 0;
+  if (!fired && set) {
+    int ret = mambo_ht_add_nolock(&fired_probes, (uintptr_t)source_addr, plugins | (1 << plugin_id));
+    assert(ret == 0);
+  }
+  pthread_mutex_unlock(&fired_probes.lock);
+
+  return fired;
+}
+
+/* Called from the code cache. The fragment containing the probe is still
+   running, so it isn't retranslated here */
+void mambo_one_shot_probe_fire(one_shot_probe *probe) {
+  if (probe->queued) return;
+  probe->queued = true;
+
+  if (!probe_has_fired(probe->source_addr, probe->plugin_id, true)) {
+    probe->cb(probe->source_addr, probe->data);
+  }
+  queue_invalidation(current_thread, (uintptr_t)probe->fragment_addr,
+                     (uintptr_t)probe->fragment_addr + 1);
+}
+
+/* Returns 1 if the probe has already fired and no code was emitted */
+int emit_one_shot_probe(mambo_context *ctx, mambo_probe_cb cb, void *data) {
+  void *source_addr = mambo_get_source_addr(ctx);
+
+  if (cb == NULL) return -1;
+  if (probe_has_fired(source_addr, ctx->plugin_id, false)) return 1;
+
+  one_shot_probe *probe = mambo_alloc(ctx, sizeof(*probe));
+  if (probe == NULL) return -1;
+  probe->cb = cb;
+  probe->data = data;
+  probe->source_addr = source_addr;
+  probe->fragment_addr = ctx->thread_data->code_cache_meta[ctx->code.fragment_id].source_addr;
+  probe->plugin_id = ctx->plugin_id;
+  probe->in_trace = (ctx->code.fragment_type != mambo_bb);
+  probe->queued = false;
+  probe->removed = false;
+  probe->next = ctx->thread_data->one_shot_probes;
+  ctx->thread_data->one_shot_probes = probe;
+
+  return emit_safe_fcall_static_args(ctx, mambo_one_shot_probe_fire, 1, (uintptr_t)probe);
+}
+
+/* Called when the code cache of thread_data is flushed. The flushed code may
+   still be running, e.g. after a system call, so the probes are only marked
+   to be freed at the next dispatcher entry */
+void mambo_one_shot_probes_flushed(dbm_thread *thread_data) {
+  for (one_shot_probe *probe = thread_data->one_shot_probes; probe != NULL; probe = probe->next) {
+    probe->removed = true;
+  }
+}
+
+/* Frees the probes which can no longer run, or all of them when the thread
+   exits. Only called by the thread owning the probes, outside the code cache */
+void mambo_free_one_shot_probes(dbm_thread *thread_data, bool all) {
+  mambo_context ctx;
+  // Not delivering any event
+  set_mambo_context(&ctx, thread_data, CALLBACK_MAX_IDX);
+
+  one_shot_probe **prev = (one_shot_probe **)&thread_data->one_shot_probes;
+  while (*prev != NULL) {
+    one_shot_probe *probe = *prev;
+    if (all || probe->removed || (probe->queued && !probe->in_trace)) {
+      *prev = probe->next;
+      mambo_free(&ctx, probe);
+    } else {
+      prev = &probe->next;
+    }
+  }
+}
+
+/* Inline templates
+   Small position-independent A64 routines which are copied into the code
+   cache instead of being called through safe_fcall_trampoline. Only the
+   general purpose registers declared as clobbered and, if needed, NZCV are
+   saved. As for emit_safe_fcall(), the caller sets up the arguments in
+   X0 to X(argno - 1) and is responsible for preserving them. Templates can
+   branch within themselves or to their end, but can't call functions,
+   return, use PC-relative addressing, make system calls or modify the
+   FP/SIMD registers. */
+int mambo_init_inline_template(mambo_inline_template *tmpl, const void *start, const void *end,
+                               uint32_t clobbered_regs, bool clobbers_flags) {
+#ifdef __aarch64__
+  uint32_t *code = (uint32_t *)start;
+  int size = (uint32_t *)end - code;
+
+  if (size <= 0 || size > MAX_INLINE_TEMPLATE_SZ) return -1;
+  if (clobbered_regs & ~((1u << 31) - 1)) return -1;
+
+  for (int i = 0; i < size; i++) {
+    uint32_t op, imm, sf, rt, b5, b40, cond;
+    int64_t offset;
+
+    switch (a64_decode(&code[i])) {
+      case A64_B_BL:
+        a64_B_BL_decode_fields(&code[i], &op, &imm);
+        if (op == 1) return -1; // BL
+        offset = sign_extend64(28, imm << 2);
+        break;
+      case A64_B_COND:
+        a64_B_cond_decode_fields(&code[i], &imm, &cond);
+        offset = sign_extend64(21, imm << 2);
+        break;
+      case A64_CBZ_CBNZ:
+        a64_CBZ_CBNZ_decode_fields(&code[i], &sf, &op, &imm, &rt);
+        offset = sign_extend64(21, imm << 2);
+        break;
+      case A64_TBZ_TBNZ:
+        a64_TBZ_TBNZ_decode_fields(&code[i], &b5, &op, &b40, &imm, &rt);
+        offset = sign_extend64(16, imm << 2);
+        break;
+      case A64_ADR:
+      case A64_LDR_LIT:
+      case A64_BR:
+      case A64_BLR:
+      case A64_RET:
+      case A64_SVC:
+      case A64_HVC:
+      case A64_BRK:
+      case A64_INVALID:
+        return -1;
+      default:
+        continue;
+    }
+    // Branches must stay within the template
+    int64_t target = i + (offset >> 2);
+    if (target < 0 || target > size) return -1;
+  }
+
+  tmpl->code = code;
+  tmpl->size = size;
+  tmpl->clobbered_regs = clobbered_regs;
+  tmpl->clobbers_flags = clobbers_flags;
+
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+int emit_inline_template(mambo_context *ctx, mambo_inline_template *tmpl, int argno) {
+#ifdef __aarch64__
+  if (tmpl->code == NULL || argno < 0 || argno > MAX_FCALL_ARGS) return -1;
+
+  uint32_t to_push = tmpl->clobbered_regs & ~((1 << argno) - 1);
+  int flags_reg = -1;
+
+  if (tmpl->clobbers_flags && !ctx->code.nzcv_dead) {
+    // Any register which isn't an argument and isn't used by the template
+    for (int r = argno; r < x29 && flags_reg < 0; r++) {
+      if ((tmpl->clobbered_regs & (1 << r)) == 0) {
+        flags_reg = r;
+      }
+    }
+    if (flags_reg < 0) return -1;
+    to_push |= 1 << flags_reg;
+  }
+
+  int pairs = (count_bits(to_push) + 1) / 2;
+  mambo_reserve_cc_space(ctx, (tmpl->size + pairs * 2 + 2) * 4);
+
+  emit_push(ctx, to_push);
+  if (flags_reg >= 0) {
+    // MRS Xt, NZCV
+    emit_a64_MRS_MSR_reg(ctx, 1, 1, 3, 4, 2, 0, flags_reg);
+  }
+
+  memcpy(ctx->code.write_p, tmpl->code, tmpl->size * sizeof(uint32_t));
+  ctx->code.write_p += tmpl->size * sizeof(uint32_t);
+
+  if (flags_reg >= 0) {
+    // MSR NZCV, Xt
+    emit_a64_MRS_MSR_reg(ctx, 0, 1, 3, 4, 2, 0, flags_reg);
+  }
+  emit_pop(ctx, to_push);
+
+  return 0;
+#else
+  return -1;
+#endif
+}
+
 int emit_indirect_branch_by_spc(mambo_context *ctx, enum reg reg) {
 #ifdef __aarch64__
+  emit_a64_flush_pending(ctx);
   // Uses fragment id 0 to prevent the dispatcher from attempting linking on an IHL miss
   a64_inline_hash_lookup(current_thread, 0, (uint32_t **)&ctx->code.write_p, ctx->code.read_address, reg, false, false);
 #else
@@ -36,6 +36,8 @@ typedef struct {
 #endif
 
 void emit_counter64_incr(mambo_context *ctx, void *counter, unsigned incr);
+void emit_counter64_incr_atomic(mambo_context *ctx, void *counter, uint64_t incr);
+int emit_counter64_incr_coalesced(mambo_context *ctx, void *counter, uint64_t incr);
 void emit_push(mambo_context *ctx, uint32_t regs);
 void emit_pop(mambo_context *ctx, uint32_t regs);
 void emit_set_reg(mambo_context *ctx, enum reg reg, uintptr_t value);
@@ -43,6 +45,30 @@ void emit_fcall(mambo_context *ctx, void *function_ptr);
 int emit_safe_fcall(mambo_context *ctx, void *function_ptr, int argno);
 int emit_safe_fcall_static_args(mambo_context *ctx, void *fptr, int argno, ...);
 int emit_indirect_branch_by_spc(mambo_context *ctx, enum reg reg);
+int emit_load_thread_slot(mambo_context *ctx, enum reg reg, int slot);
+
+#define MAX_INLINE_TEMPLATE_SZ 32 // in instructions
+typedef struct {
+  const uint32_t *code;
+  int size;
+  uint32_t clobbered_regs;
+  bool clobbers_flags;
+} mambo_inline_template;
+
+/* Places the A64 assembly in asm_code between the name##_start and name##_end
+   symbols, to be passed to mambo_init_inline_template() */
+#define MAMBO_INLINE_TEMPLATE_CODE(name, asm_code) \
+  extern const uint32_t name##_start[], name##_end[]; \
+  __asm__(".pushsection .text\n.balign 4\n" \
+          #name "_start:\n" asm_code "\n" #name "_end:\n" \
+          ".popsection\n")
+
+int mambo_init_inline_template(mambo_inline_template *tmpl, const void *start, const void *end,
+                               uint32_t clobbered_regs, bool clobbers_flags);
+int emit_inline_template(mambo_context *ctx, mambo_inline_template *tmpl, int argno);
+
+typedef void (*mambo_probe_cb)(void *source_addr, void *data);
+int emit_one_shot_probe(mambo_context *ctx, mambo_probe_cb cb, void *data);
 
 void emit_mov(mambo_context *ctx, enum reg rd, enum reg rn);
 int emit_add_sub_i(mambo_context *ctx, int rd, int rn, int offset);
@@ -101,6 +127,9 @@ static inline int emit_a64_add_sub_shift(mambo_context *ctx, int rd, int rn, int
                                    unsigned int shift_type, unsigned int shift);
 static inline int emit_a64_add_sub(mambo_context *ctx, int rd, int rn, int rm);
 int emit_a64_add_sub_ext(mambo_context *ctx, int rd, int rn, int rm, int ext_option, int shift);
+void emit_a64_deferred_counters(mambo_context *ctx);
+void emit_a64_flush_spills(mambo_context *ctx);
+void emit_a64_flush_pending(mambo_context *ctx);
 #endif
 
 #endif
@@ -19,6 +19,7 @@
 */
 
 #include <assert.h>
+#include <stdio.h>
 
 #include "../dbm.h"
 #include "../plugins.h"
@@ -47,6 +48,13 @@ void set_mambo_context_code(mambo_context *ctx, dbm_thread *thread_data, mambo_c
   ctx->code.pushed_regs = 0;
   ctx->code.available_regs = 0;
   ctx->code.plugin_pushed_reg_count = 0;
+  ctx->code.dead_regs = 0;
+  ctx->code.nzcv_dead = false;
+  ctx->code.dead_scratch_regs = 0;
+  ctx->code.elided_regs = 0;
+  ctx->code.coalesce_regs = 0;
+  ctx->code.ld_st_decoded = 0;
+  ctx->code.ld_st_addr_reg = reg_invalid;
   ctx->code.stop = stop;
 }
 
@@ -98,20 +106,89 @@ void mambo_deliver_callbacks_code(unsigned cb_id, dbm_thread *thread_data, cc_ty
 #endif
 }
 
-void _function_callback_wrapper(mambo_context *ctx, watched_func_t *func) {
 #ifdef PLUGINS_NEW
+/* Replacements are applied at the entry of the original function:
+     translated:  the scan continues from the replacement
+     native:      PUSH {es, lr}
+                  BL   replacement
+                  POP  {es, lr}
+                  <inline hash lookup of lr>   // return to the caller
+   Calls to the alias of the original function continue from its address. If
+   the original function hasn't been found, -1 is returned and the alias is
+   translated unmodified, faulting on the null literal like it does natively. */
+#define REPLACE_NATIVE_SZ 320
+
+static int _function_replace(mambo_context *ctx, watched_func_t *func) {
+  int ret;
+
+  ctx->event_type = PRE_FN_C;
+  if (ctx->code.read_address == func->orig_alias) {
+    uintptr_t orig = __atomic_load_n(func->orig_addr, __ATOMIC_ACQUIRE);
+    if (orig == 0) return -1;
+    ret = mambo_set_source_addr(ctx, (void *)orig);
+    if (ret != 0) return ret;
+  } else if (func->replace_flags & MAMBO_REPLACE_NATIVE) {
+    mambo_reserve_cc_space(ctx, REPLACE_NATIVE_SZ);
+    ctx->code.dead_regs = 0;
+    ctx->code.nzcv_dead = false;
+    emit_push(ctx, (1 << es) | (1 << lr));
+    emit_fcall(ctx, func->replacement);
+    emit_pop(ctx, (1 << es) | (1 << lr));
+    emit_indirect_branch_by_spc(ctx, lr);
+    // The rest of the original function is unreachable
+    mambo_stop_scan(ctx);
+  } else {
+    ret = mambo_set_source_addr(ctx, func->replacement);
+    if (ret != 0) return ret;
+  }
+
+  return 0;
+}
+#endif
+
+/* Without a direct call, the post-function callbacks are delivered through a
+   return shim at the entry of the function:
+     PUSH {es, lr}
+     <pre-function callbacks>
+     BL   body
+   post:                                // identity mapped
+     POP  {x0, x1}                      // pushed by the IHL, {r5, r6} on AArch32
+     <post-function callbacks>
+     POP  {es, lr}
+     <inline hash lookup of lr>         // return to the caller
+   body:
+
+   Direct calls on AArch64 are matched by their return instead, which then
+   continues at a fragment translated with the post-function callbacks, see
+   POST_FN_RET_TAG */
+void _function_callback_wrapper(mambo_context *ctx, watched_func_t *func, bool direct_call) {
+#ifdef PLUGINS_NEW
+  if (func->replacement != NULL) {
+    ctx->plugin_id = func->plugin_id;
+    ctx->code.func_name = func->name;
+    if (_function_replace(ctx, func) != 0) {
+      fprintf(stderr, "MAMBO: failed to replace %s at %p\n", func->name, ctx->code.read_address);
+    }
+    return;
+  }
+
   ctx->plugin_id = func->plugin_id;
   ctx->code.available_regs = ctx->code.pushed_regs;
   ctx->code.func_name = func->name;
+  bool shim = (func->post_callback != NULL && !direct_call);
 
-  if (func->post_callback != NULL) {
+  if (shim) {
+    /* The registers pushed here are popped after the function returns,
+       when the liveness at its entry no longer applies */
+    ctx->code.dead_regs = 0;
+    ctx->code.nzcv_dead = false;
     emit_push(ctx, (1 << es) | (1 << lr));
   }
   if (func->pre_callback != NULL) {
     ctx->event_type = PRE_FN_C;
     func->pre_callback(ctx);
   }
-  if (func->post_callback != NULL) {
+  if (shim) {
     mambo_branch fcall;
     int ret = mambo_reserve_branch(ctx, &fcall);
     assert(ret == 0);
@@ -24,6 +24,7 @@
 #include <assert.h>
 
 #include "../plugins.h"
+#include "../scanner_common.h"
 #ifdef __arm__
   #include "../pie/pie-thumb-field-decoder.h"
   #include "../pie/pie-arm-field-decoder.h"
@@ -86,7 +87,7 @@ void _a64_is_load_or_store(mambo_context *ctx, bool *is_load, bool *is_store) {
 }
 #endif
 
-bool mambo_is_load(mambo_context *ctx) {
+static bool _is_load(mambo_context *ctx) {
   if (ctx->code.inst == -1) return false;
 #ifdef __arm__
   if (ctx->code.inst_type == THUMB_INST) {
@@ -186,7 +187,7 @@ bool mambo_is_load(mambo_context *ctx) {
   return false;
 }
 
-bool mambo_is_store(mambo_context *ctx) {
+static bool _is_store(mambo_context *ctx) {
   if (ctx->code.inst == -1) return false;
 #ifdef __arm__
   if (ctx->code.inst_type == THUMB_INST) {
@@ -264,14 +265,58 @@ bool mambo_is_store(mambo_context *ctx) {
   return false;
 }
 
-bool mambo_is_load_or_store(mambo_context *ctx) {
+/* The load/store descriptor of the current instruction is decoded on first use
+   and cached in the context, which is shared by all the plugins handling the
+   same event. The size is decoded separately because it's not implemented for
+   all instructions. */
+#define LD_ST_DECODED_TYPE (1 << 0)
+#define LD_ST_DECODED_SIZE (1 << 1)
+
+static int _get_ld_st_size(mambo_context *ctx);
+
+static mambo_ld_st_info *_get_ld_st_info(mambo_context *ctx, bool with_size) {
+  mambo_ld_st_info *info = &ctx->code.ld_st;
+
+  if ((ctx->code.ld_st_decoded & LD_ST_DECODED_TYPE) == 0) {
 #ifdef __arm__
-  return mambo_is_load(ctx) || mambo_is_store(ctx);
+    info->is_load = _is_load(ctx);
+    info->is_store = _is_store(ctx);
 #elif __aarch64__
-  bool is_load, is_store;
-  _a64_is_load_or_store(ctx, &is_load, &is_store);
-  return is_load || is_store;
+    _a64_is_load_or_store(ctx, &info->is_load, &info->is_store);
 #endif
+    info->size = -1;
+    ctx->code.ld_st_decoded |= LD_ST_DECODED_TYPE;
+  }
+
+  if (with_size && (ctx->code.ld_st_decoded & LD_ST_DECODED_SIZE) == 0) {
+    if (info->is_load || info->is_store) {
+      info->size = _get_ld_st_size(ctx);
+    }
+    ctx->code.ld_st_decoded |= LD_ST_DECODED_SIZE;
+  }
+
+  return info;
+}
+
+bool mambo_is_load(mambo_context *ctx) {
+  return _get_ld_st_info(ctx, false)->is_load;
+}
+
+bool mambo_is_store(mambo_context *ctx) {
+  return _get_ld_st_info(ctx, false)->is_store;
+}
+
+bool mambo_is_load_or_store(mambo_context *ctx) {
+  mambo_ld_st_info *info = _get_ld_st_info(ctx, false);
+  return info->is_load || info->is_store;
+}
+
+int mambo_get_ld_st_info(mambo_context *ctx, mambo_ld_st_info *info) {
+  if (ctx->event_type != PRE_INST_C && ctx->event_type != POST_INST_C) return -1;
+  if (!mambo_is_load_or_store(ctx)) return -1;
+
+  *info = *_get_ld_st_info(ctx, true);
+  return 0;
 }
 
 void _generate_addr(mambo_context *ctx, int reg, int rn, int rm, int offset) {
@@ -707,86 +752,117 @@ int _arm_calc_ld_st_addr(mambo_context *ctx, enum reg reg) {
 #endif
 
 #ifdef __aarch64__
-int _a64_calc_ld_st_addr(mambo_context *ctx, enum reg reg) {
+/* Decodes the address of a load or store as base register, index register and
+   offset, in the format expected by _generate_addr(). For literal loads, rn is
+   set to reg_invalid and offset to the absolute address. */
+int _a64_decode_ld_st_addr(mambo_context *ctx, int *rn, int *rm, intptr_t *offset) {
+  *rm = reg_invalid;
+  *offset = 0;
+
   switch (ctx->code.inst) {
     case A64_LDP_STP: {
-      uint32_t opc, v, type, l, imm7, rt2, rn, rt;
-      a64_LDP_STP_decode_fields(ctx->code.read_address, &opc, &v, &type, &l, &imm7, &rt2, &rn, &rt);
-      int offset = sign_extend32(7, imm7) << (2 + (opc >> (1 - v)));
-      _generate_addr(ctx, reg, rn, reg_invalid, (type != 1) ? offset : 0);
+      uint32_t opc, v, type, l, imm7, rt2, n, rt;
+      a64_LDP_STP_decode_fields(ctx->code.read_address, &opc, &v, &type, &l, &imm7, &rt2, &n, &rt);
+      if (type != 1) {
+        *offset = sign_extend32(7, imm7) << (2 + (opc >> (1 - v)));
+      }
+      *rn = n;
       return 0;
     }
     case A64_LDR_STR_UNSIGNED_IMMED: {
-      uint32_t size, v, opc, imm12, rn, rt;
-      a64_LDR_STR_unsigned_immed_decode_fields(ctx->code.read_address, &size, &v, &opc, &imm12, &rn, &rt);
-      int offset = imm12 << (((v & (opc >> 1)) << 2) + size);
-      _generate_addr(ctx, reg, rn, reg_invalid, offset);
+      uint32_t size, v, opc, imm12, n, rt;
+      a64_LDR_STR_unsigned_immed_decode_fields(ctx->code.read_address, &size, &v, &opc, &imm12, &n, &rt);
+      *offset = imm12 << (((v & (opc >> 1)) << 2) + size);
+      *rn = n;
       return 0;
     }
     case A64_LDR_STR_IMMED: {
-      uint32_t size, v, opc, imm9, type, rn, rt;
-      a64_LDR_STR_immed_decode_fields(ctx->code.read_address, &size, &v, &opc, &imm9, &type, &rn, &rt);
-      int offset = sign_extend32(9, imm9);
-      _generate_addr(ctx, reg, rn, reg_invalid, (type != 1) ? offset : 0);
+      uint32_t size, v, opc, imm9, type, n, rt;
+      a64_LDR_STR_immed_decode_fields(ctx->code.read_address, &size, &v, &opc, &imm9, &type, &n, &rt);
+      if (type != 1) {
+        *offset = sign_extend32(9, imm9);
+      }
+      *rn = n;
       return 0;
     }
     case A64_LDR_LIT: {
       uint32_t opc, v, imm19, rt;
       a64_LDR_lit_decode_fields(ctx->code.read_address, &opc, &v, &imm19, &rt);
-      uintptr_t offset = sign_extend64(19, imm19) << 2;
-      uintptr_t addr = (uintptr_t)ctx->code.read_address + offset;
-      emit_set_reg(ctx, reg, addr);
+      *offset = (uintptr_t)ctx->code.read_address + (sign_extend64(19, imm19) << 2);
+      *rn = reg_invalid;
       return 0;
     }
     case A64_LDR_STR_REG: {
-      uint32_t size, v, opc, rm, opt, s, rn, rt;
-      a64_LDR_STR_reg_decode_fields(ctx->code.read_address, &size, &v, &opc, &rm, &opt, &s, &rn, &rt);
-      if (rm == x31) {
-        _generate_addr(ctx, reg, rn, reg_invalid, 0);
-      } else {
+      uint32_t size, v, opc, m, opt, s, n, rt;
+      a64_LDR_STR_reg_decode_fields(ctx->code.read_address, &size, &v, &opc, &m, &opt, &s, &n, &rt);
+      if (m != x31) {
         int shift = s ? (((v & (opc >> 1)) << 2) + size) : 0;
-        _generate_addr(ctx, reg, rn, rm, (shift << 3) | opt);
+        *rm = m;
+        *offset = (shift << 3) | opt;
       }
+      *rn = n;
       return 0;
     }
     case A64_LDX_STX: {
-      uint32_t size, o2, l, o1, rs, o0, rt2, rn, rt;
-      a64_LDX_STX_decode_fields(ctx->code.read_address, &size, &o2, &l, &o1, &rs, &o0, &rt2, &rn, &rt);
-      _generate_addr(ctx, reg, rn, reg_invalid, 0);
+      uint32_t size, o2, l, o1, rs, o0, rt2, n, rt;
+      a64_LDX_STX_decode_fields(ctx->code.read_address, &size, &o2, &l, &o1, &rs, &o0, &rt2, &n, &rt);
+      *rn = n;
       return 0;
     }
     case A64_LDX_STX_MULTIPLE: {
-      uint32_t q, l, op, size, rn, rt;
-      a64_LDx_STx_multiple_decode_fields(ctx->code.read_address, &q, &l, &op, &size, &rn, &rt);
-      _generate_addr(ctx, reg, rn, reg_invalid, 0);
+      uint32_t q, l, op, size, n, rt;
+      a64_LDx_STx_multiple_decode_fields(ctx->code.read_address, &q, &l, &op, &size, &n, &rt);
+      *rn = n;
       return 0;
     }
     case A64_LDX_STX_MULTIPLE_POST: {
-      uint32_t q, l, rm, op, sz, rn, rt;
-      a64_LDx_STx_multiple_post_decode_fields(ctx->code.read_address, &q, &l, &rm, &op, &sz, &rn, &rt);
-      _generate_addr(ctx, reg, rn, reg_invalid, 0);
+      uint32_t q, l, m, op, sz, n, rt;
+      a64_LDx_STx_multiple_post_decode_fields(ctx->code.read_address, &q, &l, &m, &op, &sz, &n, &rt);
+      *rn = n;
       return 0;
     }
     case A64_LDX_STX_SINGLE: {
-      uint32_t q, l, r, op, s, size, rn, rt;
-      a64_LDx_STx_single_decode_fields(ctx->code.read_address, &q, &l, &r, &op, &s, &size, &rn, &rt);
-      _generate_addr(ctx, reg, rn, reg_invalid, 0);
+      uint32_t q, l, r, op, s, size, n, rt;
+      a64_LDx_STx_single_decode_fields(ctx->code.read_address, &q, &l, &r, &op, &s, &size, &n, &rt);
+      *rn = n;
       return 0;
     }
     case A64_LDX_STX_SINGLE_POST: {
-      uint32_t q, l, r, rm, op, s, size, rn, rt;
-      a64_LDx_STx_single_post_decode_fields(ctx->code.read_address, &q, &l, &r, &rm, &op, &s, &size, &rn, &rt);
-      _generate_addr(ctx, reg, rn, reg_invalid, 0);
+      uint32_t q, l, r, m, op, s, size, n, rt;
+      a64_LDx_STx_single_post_decode_fields(ctx->code.read_address, &q, &l, &r, &m, &op, &s, &size, &n, &rt);
+      *rn = n;
       return 0;
     }
   }
 
   return -1;
 }
+
+int _a64_calc_ld_st_addr(mambo_context *ctx, enum reg reg) {
+  int rn, rm;
+  intptr_t offset;
+
+  if (_a64_decode_ld_st_addr(ctx, &rn, &rm, &offset) != 0) return -1;
+
+  if (rn == reg_invalid) {
+    emit_set_reg(ctx, reg, offset);
+  } else {
+    _generate_addr(ctx, reg, rn, rm, offset);
+  }
+  return 0;
+}
 #endif
 
 
 int mambo_calc_ld_st_addr(mambo_context *ctx, enum reg reg) {
+  // Reuse the address already computed by the scanner, see mambo_share_ld_st_addr()
+  if (ctx->code.ld_st_addr_reg != reg_invalid) {
+    if (reg != ctx->code.ld_st_addr_reg) {
+      emit_mov(ctx, reg, ctx->code.ld_st_addr_reg);
+    }
+    return 0;
+  }
+
 #ifdef __arm__
   if (ctx->code.inst_type == THUMB_INST) {
     return _thumb_calc_ld_st_addr(ctx, reg);
@@ -1189,7 +1265,7 @@ int _arm_get_ld_st_size(mambo_context *ctx) {
 }
 #endif
 
-int mambo_get_ld_st_size(mambo_context *ctx) {
+static int _get_ld_st_size(mambo_context *ctx) {
 #ifdef __arm__
   if (ctx->code.inst_type == THUMB_INST) {
     return _thumb_get_ld_st_size(ctx);
@@ -1202,5 +1278,104 @@ int mambo_get_ld_st_size(mambo_context *ctx) {
   return -1;
 }
 
+int mambo_get_ld_st_size(mambo_context *ctx) {
+  return _get_ld_st_info(ctx, true)->size;
+}
+
+/* Static classification of memory accesses
+
+  Reported as a combination of:
+    LD_ST_STACK     the base register is SP, or is derived from SP in the same
+                    basic block, e.g. X29 after ADD X29, SP, #imm
+    LD_ST_LITERAL   PC-relative literal load
+    LD_ST_TLS       the base register is derived from TPIDR_EL0
+    LD_ST_READ_ONLY the address, known at scan time, is in a mapping without
+                    write permissions
+  Only base registers derived through ADD and SUB (immediate) are followed.
+  Mappings whose permissions change later aren't reclassified, because the
+  code cache isn't flushed. Not implemented for AArch32.
+*/
+#ifdef __aarch64__
+static bool _is_read_only(uintptr_t addr, int size) {
+  interval_map_entry entry;
+  int ret = interval_map_search_by_addr(&global_data.read_only_allocs, addr, &entry);
+  return ret == 1 && (addr + size) <= entry.end;
+}
+#endif
+
+mambo_ld_st_class mambo_classify_ld_st(mambo_context *ctx) {
+  mambo_ld_st_class cls = 0;
+
+  if (ctx->event_type != PRE_INST_C && ctx->event_type != POST_INST_C) return 0;
+  if (!mambo_is_load_or_store(ctx)) return 0;
+
+#ifdef __aarch64__
+  int rn, rm;
+  intptr_t offset;
+  uintptr_t addr;
+  bool known_addr = false;
+
+  if (_a64_decode_ld_st_addr(ctx, &rn, &rm, &offset) != 0) return 0;
+
+  if (rn == reg_invalid) {
+    cls |= LD_ST_LITERAL;
+    addr = offset;
+    known_addr = true;
+  } else if (rn == sp) {
+    cls |= LD_ST_STACK;
+  } else {
+    switch (a64_trace_reg_origin(ctx->thread_data, ctx->code.read_address, rn, &addr)) {
+      case A64_ORIGIN_SP:
+        cls |= LD_ST_STACK;
+        break;
+      case A64_ORIGIN_TPIDR:
+        cls |= LD_ST_TLS;
+        break;
+      case A64_ORIGIN_CONST:
+        if (rm == reg_invalid) {
+          addr += offset;
+          known_addr = true;
+        }
+        break;
+      case A64_ORIGIN_UNKNOWN:
+        break;
+    }
+  }
+
+  if (known_addr && _is_read_only(addr, mambo_get_ld_st_size(ctx))) {
+    cls |= LD_ST_READ_ONLY;
+  }
+#endif
+
+  return cls;
+}
+
+/* Shared effective address
+
+  When enabled, the scanner computes the effective address of each A64 load
+  and store into a register before calling the PRE_INST_C callbacks and
+  restores it after all of them have returned, so the address computation is
+  emitted once per instruction instead of once per plugin. The register is
+  selected from X19-X28, which are preserved by the functions called with
+  emit_safe_fcall(), preferring a register which is dead at this point. It
+  must not be modified by the plugins.
+*/
+int mambo_share_ld_st_addr(mambo_context *ctx) {
+#ifdef __aarch64__
+  global_data.share_ld_st_addr = true;
+  return MAMBO_SUCCESS;
+#else
+  return -1;
+#endif
+}
+
+// Returns the register holding the effective address, if one was allocated
+int mambo_get_ld_st_addr_reg(mambo_context *ctx, int *regp) {
+  if (ctx->event_type != PRE_INST_C) return -1;
+  if (ctx->code.ld_st_addr_reg == reg_invalid) return -1;
+
+  *regp = ctx->code.ld_st_addr_reg;
+  return 0;
+}
 
 #endif
@@ -20,6 +20,9 @@
 
 #include <stdio.h>
 #include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
 #include <sys/mman.h>
 #include <stdarg.h>
 
@@ -122,7 +125,105 @@ int mambo_register_function_cb(mambo_context *ctx, char *fn_name,
 #endif
   if (cb_pre == NULL && cb_post == NULL) return -1;
   if (cb_post && (max_args > ARG_LIMIT || max_args < 0)) return -2;
-  return function_watch_add(&global_data.watched_functions, fn_name, ctx->plugin_id, cb_pre, cb_post);
+  return function_watch_add(&global_data.watched_functions, fn_name, ctx->plugin_id, cb_pre, cb_post, false);
+}
+
+/* Function replacement
+   The alias of an original function is a stub which branches to the address
+   in a literal, stored on the following page:
+     LDR X16, #page_size               // LDR PC, [PC, #(page_size - 8)] on AArch32
+     BR  X16
+   The literal is set when the original function is found. Running natively,
+   the stub calls the original function, while the scanner translates calls
+   to the alias as the original function, without applying the replacement. */
+#define REPLACE_ALIAS_SZ 8
+
+// Protected by the lock of global_data.watched_functions
+static uint8_t *replace_aliases;
+static int replace_alias_count;
+
+static void *replace_alias_alloc(uintptr_t **orig_addr) {
+  if (replace_aliases == NULL) {
+    size_t page_sz = PAGE_SIZE;
+    assert((MAX_WATCHED_FUNCS * REPLACE_ALIAS_SZ) <= page_sz);
+    uint8_t *pages = mmap(NULL, page_sz * 2, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pages == MAP_FAILED) return NULL;
+
+    for (int i = 0; i < MAX_WATCHED_FUNCS; i++) {
+      uint32_t *stub = (uint32_t *)(pages + i * REPLACE_ALIAS_SZ);
+#ifdef __aarch64__
+      stub[0] = 0x58000010 | ((page_sz >> 2) << 5);
+      stub[1] = 0xD61F0200;
+#elif __arm__
+      assert((page_sz - 8) <= 0xFFF);
+      stub[0] = 0xE59FF000 | (page_sz - 8);
+      stub[1] = 0xE320F000; // NOP
+#endif
+    }
+    __clear_cache((char *)pages, (char *)pages + page_sz);
+    int ret = mprotect(pages, page_sz, PROT_READ | PROT_EXEC);
+    if (ret != 0) {
+      munmap(pages, page_sz * 2);
+      return NULL;
+    }
+
+    replace_aliases = pages;
+  }
+
+  if (replace_alias_count >= MAX_WATCHED_FUNCS) return NULL;
+  uint8_t *alias = replace_aliases + replace_alias_count++ * REPLACE_ALIAS_SZ;
+  *orig_addr = (uintptr_t *)(alias + PAGE_SIZE);
+
+  return alias;
+}
+
+/* Releases the last allocated alias, and the pages once none are in use */
+static void replace_alias_free(void *alias) {
+  assert(replace_alias_count > 0);
+  assert(alias == replace_aliases + (replace_alias_count - 1) * REPLACE_ALIAS_SZ);
+
+  replace_alias_count--;
+  *(uintptr_t *)((uint8_t *)alias + PAGE_SIZE) = 0;
+  if (replace_alias_count == 0) {
+    int ret = munmap(replace_aliases, PAGE_SIZE * 2);
+    assert(ret == 0);
+    replace_aliases = NULL;
+  }
+}
+
+/* Redirects the calls to fn_name to replacement, without any callbacks. If
+   orig isn't NULL, it's set to an alias through which the replacement can
+   call the original function */
+int mambo_replace_function(mambo_context *ctx, char *fn_name, void *replacement, int flags, void **orig) {
+  void *alias = NULL;
+  uintptr_t *orig_addr = NULL;
+
+  if (fn_name == NULL || replacement == NULL) return -1;
+  if (flags & ~MAMBO_REPLACE_NATIVE) return -1;
+
+  // The aliases are allocated and released under the watched functions lock
+  function_watch_lock_funcs(&global_data.watched_functions);
+
+  int ret = 0;
+  if (orig != NULL) {
+    alias = replace_alias_alloc(&orig_addr);
+    if (alias == NULL) ret = -1;
+  }
+
+  if (ret == 0) {
+    ret = function_watch_add_replacement(&global_data.watched_functions, fn_name, ctx->plugin_id,
+                                         replacement, flags, alias, orig_addr);
+    if (ret != 0 && alias != NULL) {
+      replace_alias_free(alias);
+    }
+  }
+
+  function_watch_unlock_funcs(&global_data.watched_functions);
+
+  if (ret == 0 && orig != NULL) *orig = alias;
+
+  return ret;
 }
 
 /* Access plugin data */
@@ -166,12 +267,412 @@ void *mambo_get_thread_plugin_data(mambo_context *ctx) {
   return ctx->thread_data->plugin_priv[p_id];
 }
 
-/* Memory management */
-void *mambo_alloc(mambo_context *ctx, size_t size) {
-  return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+/* Per-thread slots
+   The slots live in MAMBO's own TLS block, so only the thread which owns
+   a slot can access it. Generated code reaches them through TPIDR_EL0,
+   which always holds MAMBO's thread pointer: the application's value is
+   emulated in thread_data->tls. */
+int mambo_alloc_thread_slot(mambo_context *ctx) {
+  int slot = atomic_increment_i32(&global_data.free_thread_slot, 1) - 1;
+  if (slot >= MAX_THREAD_SLOTS) {
+    return MAMBO_INVALID_SLOT;
+  }
+  return slot;
+}
+
+static bool mambo_is_valid_slot(int slot) {
+  return slot >= 0 && slot < global_data.free_thread_slot && slot < MAX_THREAD_SLOTS;
+}
+
+int mambo_set_thread_slot(mambo_context *ctx, int slot, uintptr_t value) {
+  if (!mambo_is_valid_slot(slot)) {
+    return MAMBO_INVALID_SLOT;
+  }
+  if (ctx->thread_data == NULL || ctx->thread_data != current_thread) {
+    return MAMBO_INVALID_THREAD;
+  }
+  mambo_thread_slots[slot] = value;
+  return MAMBO_SUCCESS;
+}
+
+uintptr_t mambo_get_thread_slot(mambo_context *ctx, int slot) {
+  if (!mambo_is_valid_slot(slot)) {
+    return 0;
+  }
+  if (ctx->thread_data == NULL || ctx->thread_data != current_thread) {
+    return 0;
+  }
+  return mambo_thread_slots[slot];
+}
+
+/* Helper threads
+   Helper threads run MAMBO-side code natively, outside the code cache, on
+   their own stacks. They are not registered as application threads and
+   they block all signals. At exit, after the POST_THREAD callbacks and
+   before the EXIT callbacks, MAMBO calls the stop function of each helper
+   thread (if set) and then joins it.
+   They are tracked under their own lock rather than the thread list lock,
+   because they are usually started from PRE_THREAD callbacks, which run
+   with the thread list locked. */
+int mambo_create_helper_thread(mambo_context *ctx, void *(*fn)(void *), void (*stop)(void *), void *arg) {
+  sigset_t all, prev;
+  int ret = MAMBO_SUCCESS;
+
+  if (fn == NULL) return MAMBO_INVALID_CB;
+
+  pthread_mutex_lock(&global_data.helper_thread_mutex);
+  int index = global_data.helper_thread_count;
+  if (index >= MAX_HELPER_THREADS) {
+    ret = MAMBO_HELPER_THREAD_FAILED;
+  } else {
+    mambo_helper_thread *helper = &global_data.helper_threads[index];
+    helper->stop = stop;
+    helper->arg = arg;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &prev);
+    if (pthread_create(&helper->thread, NULL, fn, arg) == 0) {
+      global_data.helper_thread_count++;
+    } else {
+      ret = MAMBO_HELPER_THREAD_FAILED;
+    }
+    pthread_sigmask(SIG_SETMASK, &prev, NULL);
+  }
+  pthread_mutex_unlock(&global_data.helper_thread_mutex);
+
+  return ret;
+}
+
+void mambo_stop_helper_threads(void) {
+  pthread_mutex_lock(&global_data.helper_thread_mutex);
+  for (int i = 0; i < global_data.helper_thread_count; i++) {
+    mambo_helper_thread *helper = &global_data.helper_threads[i];
+    if (helper->stop != NULL) {
+      helper->stop(helper->arg);
+    }
+  }
+  for (int i = 0; i < global_data.helper_thread_count; i++) {
+    int ret = pthread_join(global_data.helper_threads[i].thread, NULL);
+    assert(ret == 0);
+  }
+  global_data.helper_thread_count = 0;
+  pthread_mutex_unlock(&global_data.helper_thread_mutex);
+}
+
+/* Targeted retranslation
+   The fragments whose entry addresses are in [start, end) are translated
+   again, with the scan callbacks delivered again, the next time they are
+   executed. The links to the old fragments are redirected. The current
+   thread applies the change immediately, unless called while scanning, and
+   the other threads the next time they enter the dispatcher. It can also be
+   called with a NULL context from code called from the code cache, in which
+   case it only applies to the current thread, the next time it enters the
+   dispatcher: the thread list can't be locked and the code cache can't be
+   modified while the calling fragment is running. */
+static bool mambo_is_scanning(mambo_context *ctx) {
+  if (ctx == NULL) return false;
+  switch (ctx->event_type) {
+    case PRE_INST_C:
+    case POST_INST_C:
+    case PRE_BB_C:
+    case POST_BB_C:
+    case PRE_FRAGMENT_C:
+    case POST_FRAGMENT_C:
+    case PRE_FN_C:
+    case POST_FN_C:
+      return true;
+    default:
+      return false;
+  }
+}
+
+int mambo_invalidate_range(mambo_context *ctx, void *start, void *end) {
+  bool scanning = mambo_is_scanning(ctx);
+
+  if (end <= start) return -1;
+
+  if (ctx == NULL) {
+    if (current_thread == NULL) return MAMBO_INVALID_THREAD;
+    queue_invalidation(current_thread, (uintptr_t)start, (uintptr_t)end);
+    return MAMBO_SUCCESS;
+  }
+
+  lock_thread_list();
+  for (dbm_thread *thread = global_data.threads; thread != NULL; thread = thread->next_thread) {
+    if (thread != current_thread || scanning) {
+      queue_invalidation(thread, (uintptr_t)start, (uintptr_t)end);
+    }
+  }
+  unlock_thread_list();
+
+  if (current_thread != NULL && !scanning) {
+    invalidate_fragments(current_thread, (uintptr_t)start, (uintptr_t)end);
+  }
+
+  return MAMBO_SUCCESS;
+}
+
+int mambo_retranslate(mambo_context *ctx, void *addr) {
+  return mambo_invalidate_range(ctx, addr, addr + 1);
+}
+
+/* Dual-mode translation
+   Each fragment can be translated twice: with the plugins' instrumentation
+   and bare. Every thread runs in one of the two modes and only switches at
+   fragment boundaries, when the entry check of a fragment translated in the
+   other mode sends it back to the dispatcher. Dual-mode translation must be
+   enabled before the application starts, i.e. from a plugin constructor.
+   Only supported on AArch64. */
+int mambo_enable_dual_mode(mambo_context *ctx) {
+#ifdef __aarch64__
+  if (global_data.threads != NULL) {
+    return MAMBO_DUAL_MODE_UNAVAILABLE;
+  }
+  global_data.dual_mode = true;
+  global_data.instrument = 1;
+  return MAMBO_SUCCESS;
+#else
+  return MAMBO_DUAL_MODE_UNAVAILABLE;
+#endif
+}
+
+/* Can also be called with a NULL context from code called from the code
+   cache, in which case it applies to the current thread */
+int mambo_set_instrumentation(mambo_context *ctx, bool on) {
+  dbm_thread *thread_data = (ctx != NULL) ? ctx->thread_data : current_thread;
+
+  if (!global_data.dual_mode) {
+    return MAMBO_DUAL_MODE_UNAVAILABLE;
+  }
+  if (thread_data == NULL) {
+    return MAMBO_INVALID_THREAD;
+  }
+  thread_data->instrument = on;
+  return MAMBO_SUCCESS;
+}
+
+bool mambo_get_instrumentation(mambo_context *ctx) {
+  dbm_thread *thread_data = (ctx != NULL) ? ctx->thread_data : current_thread;
+
+  if (!global_data.dual_mode || thread_data == NULL) {
+    return true;
+  }
+  return thread_data->instrument != 0;
+}
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool started;
+  bool stop;
+  unsigned int period_us[2]; // off, on
+} sampling = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void sampling_deadline(struct timespec *ts, unsigned int us) {
+  clock_gettime(CLOCK_REALTIME, ts);
+  ts->tv_sec += us / 1000000;
+  ts->tv_nsec += (us % 1000000) * 1000;
+  if (ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
+// Returns false if it's stopped while waiting
+static bool sampling_wait(unsigned int us) {
+  struct timespec ts;
+  sampling_deadline(&ts, us);
+  while (!sampling.stop) {
+    if (pthread_cond_timedwait(&sampling.cond, &sampling.lock, &ts) == ETIMEDOUT) {
+      break;
+    }
+  }
+  return !sampling.stop;
+}
+
+static void *sampling_thread(void *arg) {
+  uint32_t on = 1;
+
+  pthread_mutex_lock(&sampling.lock);
+  while (sampling_wait(sampling.period_us[on])) {
+    on ^= 1;
+    /* dbm_exit() holds the thread list lock while stopping the helper
+       threads, so only try to acquire it */
+    while (pthread_mutex_trylock(&global_data.thread_list_mutex) != 0) {
+      if (!sampling_wait(1000)) goto out;
+    }
+    global_data.instrument = on;
+    for (dbm_thread *thread = global_data.threads; thread != NULL; thread = thread->next_thread) {
+      thread->instrument = on;
+    }
+    unlock_thread_list();
+  }
+out:
+  pthread_mutex_unlock(&sampling.lock);
+  return NULL;
+}
+
+static void sampling_stop(void *arg) {
+  pthread_mutex_lock(&sampling.lock);
+  sampling.stop = true;
+  pthread_cond_broadcast(&sampling.cond);
+  pthread_mutex_unlock(&sampling.lock);
+}
+
+/* Periodically switches the instrumentation of all threads on for on_us
+   and off for off_us microseconds, using a helper thread. It can be called
+   from a plugin constructor or from any callback, e.g. PRE_THREAD.
+   Instruction or event budgets can be implemented by plugins by calling
+   mambo_set_instrumentation() from their instrumentation. */
+int mambo_set_instrumentation_sampling(mambo_context *ctx, unsigned int on_us, unsigned int off_us) {
+  if (!global_data.dual_mode) {
+    return MAMBO_DUAL_MODE_UNAVAILABLE;
+  }
+  if (on_us == 0 || off_us == 0) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&sampling.lock);
+  sampling.period_us[0] = off_us;
+  sampling.period_us[1] = on_us;
+  bool started = sampling.started;
+  sampling.started = true;
+  pthread_mutex_unlock(&sampling.lock);
+
+  if (!started) {
+    int ret = mambo_create_helper_thread(ctx, sampling_thread, sampling_stop, NULL);
+    if (ret != MAMBO_SUCCESS) {
+      pthread_mutex_lock(&sampling.lock);
+      sampling.started = false;
+      pthread_mutex_unlock(&sampling.lock);
+      return ret;
+    }
+  }
+
+  return MAMBO_SUCCESS;
+}
+
+/* Temporal region of interest
+   Built on dual-mode translation: outside the region, threads run bare
+   fragments, so startup code such as ld.so and static constructors runs
+   without any instrumentation. The region is delimited by either:
+   - the MAMBO_ROI_START_INST and MAMBO_ROI_STOP_INST markers in the
+     application, which switch the calling thread immediately and the other
+     threads at their next fragment entry
+   - the entry and exit of a function, for the thread calling it
+   - an instruction count: the region starts after skip instructions executed
+     by a thread and lasts for length instructions. Fragments count all their
+     instructions on entry, so the boundaries are approximate.
+   It must be set up from a plugin constructor. Only supported on AArch64. */
+static int roi_enable(mambo_context *ctx) {
+  int ret = mambo_enable_dual_mode(ctx);
+  if (ret != MAMBO_SUCCESS) {
+    return ret;
+  }
+  global_data.instrument = 0;
+  return MAMBO_SUCCESS;
 }
 
-void mambo_free(mambo_context *ctx, void *ptr) {
+/* Called from the code cache by the markers. The mode of every thread is
+   switched, so that the entry checks of fragments running in linked loops
+   or reached through IHL hits see it. dbm_exit() holds the thread list lock
+   while waiting for the running threads, so it's only tried and given up on
+   exit. The generation is still published for the threads which are being
+   created, which pick it up in lookup_or_scan() */
+void mambo_roi_marker(uintptr_t on) {
+  global_data.instrument = on;
+  __atomic_fetch_add(&global_data.roi.generation, 1, __ATOMIC_RELEASE);
+  current_thread->instrument = on;
+
+  while (pthread_mutex_trylock(&global_data.thread_list_mutex) != 0) {
+    if (global_data.exit_group > 0) return;
+    sched_yield();
+  }
+  for (dbm_thread *thread = global_data.threads; thread != NULL; thread = thread->next_thread) {
+    thread->instrument = on;
+  }
+  unlock_thread_list();
+}
+
+// Called by the dispatcher when the instruction budget of the thread is exhausted
+void roi_budget_expired(dbm_thread *thread_data) {
+  if (thread_data->roi_phase == 0) {
+    thread_data->instrument = 1;
+    thread_data->roi_budget = global_data.roi.length;
+  } else {
+    thread_data->instrument = 0;
+    thread_data->roi_budget = INT64_MAX;
+  }
+  thread_data->roi_phase++;
+}
+
+// Recursive calls are counted, so only the outermost exit ends the region
+static void roi_function_enter(void) {
+  if (current_thread->roi_depth++ == 0) {
+    current_thread->instrument = 1;
+  }
+}
+
+static void roi_function_exit(void) {
+  if (--current_thread->roi_depth == 0) {
+    current_thread->instrument = 0;
+  }
+}
+
+static int roi_function_pre(mambo_context *ctx) {
+  return emit_safe_fcall(ctx, roi_function_enter, 0);
+}
+
+static int roi_function_post(mambo_context *ctx) {
+  return emit_safe_fcall(ctx, roi_function_exit, 0);
+}
+
+int mambo_set_roi_markers(mambo_context *ctx) {
+  int ret = roi_enable(ctx);
+  if (ret != MAMBO_SUCCESS) {
+    return ret;
+  }
+  global_data.roi.markers = true;
+  return MAMBO_SUCCESS;
+}
+
+int mambo_set_roi_function(mambo_context *ctx, char *fn_name) {
+  int ret = roi_enable(ctx);
+  if (ret != MAMBO_SUCCESS) {
+    return ret;
+  }
+  return function_watch_add(&global_data.watched_functions, fn_name, ctx->plugin_id,
+                            roi_function_pre, roi_function_post, true);
+}
+
+int mambo_set_roi_inst_count(mambo_context *ctx, uint64_t skip, uint64_t length) {
+  if (length == 0 || skip > INT64_MAX || length > INT64_MAX) {
+    return -1;
+  }
+  int ret = roi_enable(ctx);
+  if (ret != MAMBO_SUCCESS) {
+    return ret;
+  }
+  global_data.roi.skip = skip;
+  global_data.roi.length = length;
+  global_data.roi.inst_count = true;
+  return MAMBO_SUCCESS;
+}
+
+/* Per-module filter, see module_filter_add_name(). Code which has already
+   been translated isn't affected, so it should be set up from a plugin
+   constructor. */
+int mambo_filter_module(mambo_context *ctx, char *name) {
+  if (name == NULL) return -1;
+  return module_filter_add_name(name);
+}
+
+int mambo_filter_range(mambo_context *ctx, void *start, void *end) {
+  if (start >= end) return -1;
+  return module_filter_add_range((uintptr_t)start, (uintptr_t)end);
 }
 
 /* Other */
@@ -274,14 +775,16 @@ int mambo_set_source_addr(mambo_context *ctx, void *source_addr) {
 #endif
 
   ctx->code.read_address = (void *)((uintptr_t)source_addr & ~1);
+  ctx->code.ld_st_decoded = 0;
   ctx->code.replace = true;
 
   return 0;
 }
 
 /* Allows scratch registers to be shared by multiple plugins
-  This will likely be modified in the future to allocate dead
-  application registers if available.
+  Registers already pushed by other plugins are used first, followed by
+  application registers which are dead at this point. Other registers are
+  pushed and restored by the scanner after the callback returns.
 */
 int mambo_get_scratch_regs(mambo_context *ctx, int count, ...) {
   int *regp;
@@ -301,8 +804,15 @@ int mambo_get_scratch_regs(mambo_context *ctx, int count, ...) {
     int reg = next_reg_in_list(ctx->code.available_regs, 0);
     if (reg != reg_invalid) {
       ctx->code.available_regs &= ~(1 << reg);
+    } else if (ctx->code.dead_regs != 0) {
+      reg = next_reg_in_list(ctx->code.dead_regs, 0);
+      ctx->code.dead_regs &= ~(1 << reg);
+      ctx->code.dead_scratch_regs |= 1 << reg;
     } else {
-      min_pushed_reg--;
+      uint32_t in_use = ctx->code.dead_scratch_regs | ctx->code.elided_regs;
+      do {
+        min_pushed_reg--;
+      } while (min_pushed_reg >= 0 && (in_use & (1 << min_pushed_reg)));
       if (min_pushed_reg >= 0) {
         to_push |= 1 << min_pushed_reg;
         reg = min_pushed_reg;
@@ -329,15 +839,29 @@ int mambo_get_scratch_reg(mambo_context *ctx, int *regp) {
 }
 
 int mambo_free_scratch_regs(mambo_context *ctx, uint32_t regs) {
+  uint32_t dead = regs & ctx->code.dead_scratch_regs;
+  regs &= ~dead;
   if ((regs & ctx->code.pushed_regs) != regs) {
     return -1;
   }
   ctx->code.available_regs |= regs;
+  ctx->code.dead_scratch_regs &= ~dead;
+  ctx->code.dead_regs |= dead;
   return 0;
 }
 
 int mambo_free_scratch_reg(mambo_context *ctx, int reg) {
-  return mambo_free_scratch_reg(ctx, 1 << reg);
+  return mambo_free_scratch_regs(ctx, 1 << reg);
+}
+
+/* Application registers which don't have to be preserved at this point.
+   Only computed for A64 PRE_INST_C, POST_INST_C and PRE_BB_C events */
+uint32_t mambo_get_dead_regs(mambo_context *ctx) {
+  return ctx->code.dead_regs;
+}
+
+bool mambo_is_nzcv_dead(mambo_context *ctx) {
+  return ctx->code.nzcv_dead;
 }
 
 /* Syscall helpers */
@@ -405,7 +929,7 @@ int mambo_add_identity_mapping(mambo_context *ctx) {
     addr |= THUMB;
   }
 
-  int ret = hash_add(&current_thread->entry_address, addr, addr);
+  int ret = hash_add(active_entry_address(current_thread), addr, addr);
   return (ret) ? 0 : -1;
 }
 
@@ -461,6 +985,13 @@ int mambo_stop_scan(mambo_context *ctx) {
   }
 
   if (ctx->code.stop == NULL) return -1;
+#ifdef __aarch64__
+  /* The callback emits its own exit, the deferred state must be emitted
+     before it */
+  if (!ctx->thread_data->deferred_counters.closed) {
+    emit_a64_flush_pending(ctx);
+  }
+#endif
   *ctx->code.stop = true;
 
   return 0;
@@ -24,6 +24,20 @@
 #include "../dbm.h"
 #include "../scanner_public.h"
 
+typedef enum {
+  LD_ST_STACK = (1 << 0),
+  LD_ST_LITERAL = (1 << 1),
+  LD_ST_TLS = (1 << 2),        // A64-only
+  LD_ST_READ_ONLY = (1 << 3),
+} mambo_ld_st_class;
+
+/* Load/store descriptor, see mambo_get_ld_st_info() */
+typedef struct {
+  bool is_load;
+  bool is_store;
+  int size;
+} mambo_ld_st_info;
+
 struct code_ctx {
   cc_type fragment_type;
   int fragment_id;
@@ -40,6 +54,22 @@ struct code_ctx {
   uint32_t available_regs;
   int plugin_pushed_reg_count;
 
+  /* Application registers which are dead at this point and not used by the
+     plugin, the push of which can be elided (A64 only) */
+  uint32_t dead_regs;
+  bool nzcv_dead;
+  uint32_t dead_scratch_regs;
+  uint32_t elided_regs;
+  uint8_t elided_depth[32];
+  // Registers which can be left spilled after the callback (A64 only)
+  uint32_t coalesce_regs;
+
+  // Lazily decoded load/store descriptor, shared by all the plugins
+  uint8_t ld_st_decoded;
+  mambo_ld_st_info ld_st;
+  // Register holding the effective address of the load/store (A64 only)
+  int ld_st_addr_reg;
+
   char *func_name;
 
   bool replace;
@@ -121,6 +151,9 @@ enum mambo_plugin_error {
   MAMBO_CB_ALREADY_SET = -2,
   MAMBO_INVALID_CB = -3,
   MAMBO_INVALID_THREAD = -4,
+  MAMBO_INVALID_SLOT = -5,
+  MAMBO_HELPER_THREAD_FAILED = -6,
+  MAMBO_DUAL_MODE_UNAVAILABLE = -7,
 };
 
 /* Stack frame */
@@ -148,9 +181,48 @@ int mambo_register_vm_op_cb(mambo_context *ctx, mambo_callback cb);
 int mambo_register_function_cb(mambo_context *ctx, char *fn_name,
                                mambo_callback cb_pre, mambo_callback cb_post, int max_args);
 
+/* Function replacement. By default, the replacement is translated like the
+   application code. With MAMBO_REPLACE_NATIVE it runs natively, in which case
+   it can't take arguments on the stack */
+typedef enum {
+  MAMBO_REPLACE_NATIVE = (1 << 0),
+} mambo_replace_flags;
+int mambo_replace_function(mambo_context *ctx, char *fn_name, void *replacement, int flags, void **orig);
+
+/* Helper threads
+   Can be called from plugin constructors and from any callback, including
+   PRE_THREAD and POST_THREAD, but not from the stop function of a helper
+   thread. */
+int mambo_create_helper_thread(mambo_context *ctx, void *(*fn)(void *), void (*stop)(void *), void *arg);
+
+/* Targeted retranslation */
+int mambo_invalidate_range(mambo_context *ctx, void *start, void *end);
+int mambo_retranslate(mambo_context *ctx, void *addr);
+
+/* Dual-mode translation, for sampling instrumentation */
+int mambo_enable_dual_mode(mambo_context *ctx);
+int mambo_set_instrumentation(mambo_context *ctx, bool on);
+bool mambo_get_instrumentation(mambo_context *ctx);
+int mambo_set_instrumentation_sampling(mambo_context *ctx, unsigned int on_us, unsigned int off_us);
+
+/* Temporal region of interest. The markers are HINT instructions, which
+   execute as NOPs natively:
+     asm volatile("hint #0x7e"); // start
+     asm volatile("hint #0x7f"); // stop */
+#define MAMBO_ROI_START_INST 0xD5032FDF
+#define MAMBO_ROI_STOP_INST  0xD5032FFF
+int mambo_set_roi_markers(mambo_context *ctx);
+int mambo_set_roi_function(mambo_context *ctx, char *fn_name);
+int mambo_set_roi_inst_count(mambo_context *ctx, uint64_t skip, uint64_t length);
+
+/* Per-module filter, the plugin callbacks are only delivered for the selected code */
+int mambo_filter_module(mambo_context *ctx, char *name);
+int mambo_filter_range(mambo_context *ctx, void *start, void *end);
+
 /* Memory management */
 void *mambo_alloc(mambo_context *ctx, size_t size);
 void mambo_free(mambo_context *ctx, void *ptr);
+int mambo_get_alloc_stats(mambo_context *ctx, mambo_alloc_stats *stats);
 
 /* Access plugin data */
 int mambo_set_plugin_data(mambo_context *ctx, void *data);
@@ -158,11 +230,18 @@ void *mambo_get_plugin_data(mambo_context *ctx);
 int mambo_set_thread_plugin_data(mambo_context *ctx, void *data);
 void *mambo_get_thread_plugin_data(mambo_context *ctx);
 
+/* Per-thread slots, loadable from generated code with emit_load_thread_slot() */
+int mambo_alloc_thread_slot(mambo_context *ctx);
+int mambo_set_thread_slot(mambo_context *ctx, int slot, uintptr_t value);
+uintptr_t mambo_get_thread_slot(mambo_context *ctx, int slot);
+
 /* Scratch register management */
 int mambo_get_scratch_regs(mambo_context *ctx, int count, ...);
 int mambo_get_scratch_reg(mambo_context *ctx, int *regp);
 int mambo_free_scratch_regs(mambo_context *ctx, uint32_t regs);
 int mambo_free_scratch_reg(mambo_context *ctx, int reg);
+uint32_t mambo_get_dead_regs(mambo_context *ctx);
+bool mambo_is_nzcv_dead(mambo_context *ctx);
 
 /* Syscalls */
 int mambo_syscall_get_no(mambo_context *ctx, uintptr_t *no);
@@ -199,6 +278,10 @@ bool mambo_is_load(mambo_context *ctx);
 bool mambo_is_store(mambo_context *ctx);
 bool mambo_is_load_or_store(mambo_context *ctx);
 int mambo_get_ld_st_size(mambo_context *ctx);
+int mambo_get_ld_st_info(mambo_context *ctx, mambo_ld_st_info *info);
+mambo_ld_st_class mambo_classify_ld_st(mambo_context *ctx);
+int mambo_share_ld_st_addr(mambo_context *ctx);
+int mambo_get_ld_st_addr_reg(mambo_context *ctx, int *regp);
 int mambo_add_identity_mapping(mambo_context *ctx);
 char *mambo_get_cb_function_name(mambo_context *ctx);
 int mambo_stop_scan(mambo_context *ctx);
@@ -0,0 +1,288 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Copyright 2017-2020 The University of Manchester
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifdef PLUGINS_NEW
+
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "../plugins.h"
+
+/*
+  Per-thread buffers of fixed size records
+
+  Each trace buffer is made of two halves. The generated code appends records
+  to the active half and calls mambo_trace_buf_full() when it fills up. Without
+  consumer threads, the flush callback runs immediately on the application
+  thread. Otherwise the full half is queued for the consumer threads and the
+  application continues with the other half, only waiting if that one is still
+  being processed. At most one half of a buffer is in flight at any time, so
+  the records of a thread are always processed in order.
+*/
+
+#define TRACE_BUF_QUEUE_SZ 64
+#define MAX_TRACE_BUF_CONSUMERS 16
+
+typedef struct {
+  mambo_trace_buf *buf;
+  void *records;
+  size_t count;
+} trace_buf_work;
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  bool stop;
+  int threads;
+  int head;
+  int tail;
+  trace_buf_work queue[TRACE_BUF_QUEUE_SZ];
+} pool = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .work = PTHREAD_COND_INITIALIZER,
+  .done = PTHREAD_COND_INITIALIZER,
+};
+
+static void *trace_buf_consumer(void *arg) {
+  pthread_mutex_lock(&pool.lock);
+  while (1) {
+    while (pool.head == pool.tail && !pool.stop) {
+      pthread_cond_wait(&pool.work, &pool.lock);
+    }
+    if (pool.head == pool.tail) break;
+    trace_buf_work work = pool.queue[pool.head];
+    pool.head = (pool.head + 1) % TRACE_BUF_QUEUE_SZ;
+    pthread_mutex_unlock(&pool.lock);
+
+    work.buf->flush(work.records, work.count, work.buf->data);
+
+    pthread_mutex_lock(&pool.lock);
+    work.buf->in_flight = false;
+    pthread_cond_broadcast(&pool.done);
+  }
+  pthread_mutex_unlock(&pool.lock);
+  return NULL;
+}
+
+// Called by MAMBO at exit, the consumers process the queued work before exiting
+static void trace_buf_stop_consumer(void *arg) {
+  pthread_mutex_lock(&pool.lock);
+  pool.stop = true;
+  pthread_cond_broadcast(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+static void trace_buf_wait(mambo_trace_buf *buf) {
+  if (buf->in_flight) {
+    pthread_mutex_lock(&pool.lock);
+    while (buf->in_flight) {
+      pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+  }
+}
+
+static void trace_buf_reset(mambo_trace_buf *buf) {
+  buf->cur = buf->bufs[buf->active];
+  buf->end = buf->cur + buf->records * buf->record_size;
+}
+
+// Called from the code cache through a safe fcall when the active half is full
+void mambo_trace_buf_full(mambo_trace_buf *buf) {
+  void *records = buf->bufs[buf->active];
+  size_t count = (buf->cur - buf->bufs[buf->active]) / buf->record_size;
+
+  if (pool.threads > 0) {
+    pthread_mutex_lock(&pool.lock);
+    while (buf->in_flight) {
+      pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    int next = (pool.tail + 1) % TRACE_BUF_QUEUE_SZ;
+    if (next != pool.head) {
+      pool.queue[pool.tail].buf = buf;
+      pool.queue[pool.tail].records = records;
+      pool.queue[pool.tail].count = count;
+      pool.tail = next;
+      buf->in_flight = true;
+      pthread_cond_signal(&pool.work);
+      pthread_mutex_unlock(&pool.lock);
+
+      buf->active ^= 1;
+      trace_buf_reset(buf);
+      return;
+    }
+    // The queue is full, process the records on this thread
+    pthread_mutex_unlock(&pool.lock);
+  }
+
+  buf->flush(records, count, buf->data);
+  trace_buf_reset(buf);
+}
+
+// Used by the AArch32 code, which calls into C for every record
+void mambo_trace_buf_append(uintptr_t v0, uintptr_t v1, uintptr_t v2, mambo_trace_buf *buf) {
+  uintptr_t *record = (uintptr_t *)buf->cur;
+  uintptr_t values[MAX_TRACE_RECORD_WORDS] = {v0, v1, v2};
+
+  for (int i = 0; i < buf->record_words; i++) {
+    record[i] = values[i];
+  }
+  buf->cur += buf->record_size;
+  if (buf->cur == buf->end) {
+    mambo_trace_buf_full(buf);
+  }
+}
+
+/* Public API */
+mambo_trace_buf *mambo_trace_buf_create(mambo_context *ctx, int record_words, size_t records,
+                                        mambo_trace_buf_cb flush, void *data) {
+  if (record_words < 1 || record_words > MAX_TRACE_RECORD_WORDS) return NULL;
+  if (records == 0 || flush == NULL) return NULL;
+
+  mambo_trace_buf *buf = mambo_alloc(ctx, sizeof(*buf));
+  if (buf == NULL) return NULL;
+
+  buf->record_words = record_words;
+  buf->record_size = record_words * sizeof(uintptr_t);
+  buf->records = records;
+  buf->flush = flush;
+  buf->data = data;
+  buf->in_flight = false;
+  buf->active = 0;
+
+  for (int i = 0; i < 2; i++) {
+    buf->bufs[i] = mambo_alloc(ctx, records * buf->record_size);
+    if (buf->bufs[i] == NULL) {
+      mambo_free(ctx, buf->bufs[0]);
+      mambo_free(ctx, buf);
+      return NULL;
+    }
+  }
+  trace_buf_reset(buf);
+
+  return buf;
+}
+
+// Processes any buffered records on the calling thread
+int mambo_trace_buf_flush(mambo_trace_buf *buf) {
+  trace_buf_wait(buf);
+
+  void *records = buf->bufs[buf->active];
+  size_t count = (buf->cur - buf->bufs[buf->active]) / buf->record_size;
+  if (count > 0) {
+    buf->flush(records, count, buf->data);
+  }
+  trace_buf_reset(buf);
+
+  return MAMBO_SUCCESS;
+}
+
+int mambo_trace_buf_destroy(mambo_context *ctx, mambo_trace_buf *buf) {
+  mambo_trace_buf_flush(buf);
+
+  mambo_free(ctx, buf->bufs[0]);
+  mambo_free(ctx, buf->bufs[1]);
+  mambo_free(ctx, buf);
+
+  return MAMBO_SUCCESS;
+}
+
+// Starts helper threads which process full buffers asynchronously. Like
+// mambo_create_helper_thread(), it can be called from PRE_THREAD callbacks
+int mambo_trace_buf_start_consumers(mambo_context *ctx, int threads) {
+  if (threads < 1 || (pool.threads + threads) > MAX_TRACE_BUF_CONSUMERS) return -1;
+
+  for (int i = 0; i < threads; i++) {
+    int ret = mambo_create_helper_thread(ctx, trace_buf_consumer, trace_buf_stop_consumer, NULL);
+    if (ret != MAMBO_SUCCESS) return ret;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.threads++;
+    pthread_mutex_unlock(&pool.lock);
+  }
+
+  return MAMBO_SUCCESS;
+}
+
+/* Appends a record to the current thread's buffer. The words of the record
+   must be in registers 0 to record_words - 1.
+
+   On AArch64:
+     PUSH {Xw, Xw+1}
+     MOV  Xw, #buf
+     LDR  Xw+1, [Xw]            // cur
+     STR  Xi, [Xw+1, #(i * 8)]  // for each word
+     ADD  Xw+1, Xw+1, #record_size
+     STR  Xw+1, [Xw]
+     LDR  Xw, [Xw, #8]          // end
+     SUB  Xw, Xw, Xw+1
+     CBNZ Xw, not_full
+     <safe fcall to mambo_trace_buf_full(buf)>
+   not_full:
+     POP {Xw, Xw+1}
+*/
+#define TRACE_BUF_WRITE_SZ 224
+
+int emit_trace_buf_write(mambo_context *ctx, mambo_trace_buf *buf) {
+  int words = buf->record_words;
+  int ret;
+
+  mambo_reserve_cc_space(ctx, TRACE_BUF_WRITE_SZ);
+
+#ifdef __aarch64__
+  enum reg buf_reg = words;
+  enum reg cur_reg = words + 1;
+  uint32_t regs = (1 << buf_reg) | (1 << cur_reg);
+  mambo_branch not_full;
+
+  emit_push(ctx, regs);
+  emit_set_reg_ptr(ctx, buf_reg, buf);
+  emit_a64_LDR_STR_unsigned_immed(ctx, 3, 0, 1, 0, buf_reg, cur_reg);
+  for (int i = 0; i < words; i++) {
+    emit_a64_LDR_STR_unsigned_immed(ctx, 3, 0, 0, i, cur_reg, i);
+  }
+  emit_a64_ADD_SUB_immed(ctx, 1, 0, 0, 0, buf->record_size, cur_reg, cur_reg);
+  emit_a64_LDR_STR_unsigned_immed(ctx, 3, 0, 0, 0, buf_reg, cur_reg);
+  emit_a64_LDR_STR_unsigned_immed(ctx, 3, 0, 1, 1, buf_reg, buf_reg);
+  emit_a64_ADD_SUB_shift_reg(ctx, 1, 1, 0, LSL, cur_reg, 0, buf_reg, buf_reg);
+
+  ret = mambo_reserve_branch_cbz(ctx, &not_full);
+  assert(ret == 0);
+  ret = emit_safe_fcall_static_args(ctx, mambo_trace_buf_full, 1, (uintptr_t)buf);
+  assert(ret == 0);
+  ret = emit_local_branch_cbnz(ctx, &not_full, buf_reg);
+  assert(ret == 0);
+
+  emit_pop(ctx, regs);
+#elif __arm__
+  uint32_t regs = (1 << r0) | (1 << r1) | (1 << r2) | (1 << r3);
+
+  emit_push(ctx, regs);
+  emit_set_reg_ptr(ctx, r3, buf);
+  ret = emit_safe_fcall(ctx, mambo_trace_buf_append, 4);
+  assert(ret == 0);
+  emit_pop(ctx, regs);
+#endif
+
+  return 0;
+}
+
+#endif // PLUGINS_NEW
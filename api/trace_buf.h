@@ -0,0 +1,58 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Copyright 2017-2020 The University of Manchester
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef __API_TRACE_BUF_H__
+#define __API_TRACE_BUF_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MAX_TRACE_RECORD_WORDS 3
+
+/* Called with count records of record_words words each. When consumer threads
+   are running, it is called on one of them rather than on the application
+   thread, so it must not use the MAMBO API functions which need a thread */
+typedef void (*mambo_trace_buf_cb)(void *records, size_t count, void *data);
+
+typedef struct {
+  // cur and end are accessed by the generated code and must stay first
+  uint8_t *cur;
+  uint8_t *end;
+
+  uint8_t *bufs[2];
+  int active;
+  volatile bool in_flight;
+
+  int record_words;
+  size_t record_size;
+  size_t records;
+
+  mambo_trace_buf_cb flush;
+  void *data;
+} mambo_trace_buf;
+
+mambo_trace_buf *mambo_trace_buf_create(mambo_context *ctx, int record_words, size_t records,
+                                        mambo_trace_buf_cb flush, void *data);
+int mambo_trace_buf_flush(mambo_trace_buf *buf);
+int mambo_trace_buf_destroy(mambo_context *ctx, mambo_trace_buf *buf);
+int mambo_trace_buf_start_consumers(mambo_context *ctx, int threads);
+
+int emit_trace_buf_write(mambo_context *ctx, mambo_trace_buf *buf);
+
+#endif
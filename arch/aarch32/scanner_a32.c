@@ -252,8 +252,10 @@ bool arm_scanner_deliver_callbacks(dbm_thread *thread_data, mambo_cb_idx cb_id,
     mambo_context ctx;
     set_mambo_context_code(&ctx, thread_data, PRE_INST_C, type, basic_block, ARM_INST, inst, cond, read_address, write_p, data_p, stop);
 
+    // Code excluded by the module filter only gets function callbacks
+    bool filtered = !module_filter_allows(thread_data, (uintptr_t)read_address);
     for (int i = 0; i < global_data.free_plugin; i++) {
-      if (global_data.plugins[i].cbs[cb_id] != NULL) {
+      if (global_data.plugins[i].cbs[cb_id] != NULL && !filtered) {
         ctx.plugin_id = i;
         ctx.code.replace = false;
         ctx.code.write_p = write_p;
@@ -291,7 +293,7 @@ bool arm_scanner_deliver_callbacks(dbm_thread *thread_data, mambo_cb_idx cb_id,
       watched_functions_t *wf = &global_data.watched_functions;
       for (int i = 0; i < wf->funcp_count; i++) {
         if (read_address == wf->funcps[i].addr) {
-          _function_callback_wrapper(&ctx, wf->funcps[i].func);
+          _function_callback_wrapper(&ctx, wf->funcps[i].func, false);
           if (ctx.code.replace) {
             read_address = ctx.code.read_address;
           }
@@ -420,6 +422,133 @@ void pass1_arm(dbm_thread *thread_data, uint32_t *read_address, branch_type *bb_
   }
 }
 
+// Enters the dispatcher with R4-R6 pushed, as left by the inline hash lookup
+static void arm_ihl_dispatcher_exit(dbm_thread *thread_data, uint32_t **o_write_p,
+                                    uint32_t source_index, enum reg target) {
+  uint32_t *write_p = *o_write_p;
+
+  // SUB sp, sp, #8
+  arm_sub(&write_p, IMM_PROC, 0, sp, sp, DISP_RES_WORDS*4);
+  write_p++;
+
+  // PUSH {r0 - r3}
+  arm_push_regs((1 << r0) | (1 << r1) | (1 << r2) | (1 << r3));
+
+  //ADD r3, sp, #24
+  arm_add(&write_p, IMM_PROC, 0, r3, sp, DISP_SP_OFFSET);
+  write_p++;
+
+  // MOV r0, target
+  arm_mov(&write_p, REG_PROC, 0, r0, target);
+  write_p++;
+
+  // MOV r1, #source_index
+  arm_copy_to_reg_32bit(&write_p, r1, source_index);
+
+  // LDMFD R3!, {R4-R6}
+  arm_ldm(&write_p, r3, (1 << r4) | (1 << r5) | (1 << r6), 0, 1, 1, 0);
+  write_p++;
+
+  // B dispatcher
+  arm_b32_helper(write_p, thread_data->dispatcher_addr, AL);
+  write_p++;
+
+  *o_write_p = write_p;
+}
+
+#ifdef DBM_LINK_PLT
+/*
+ * Calls into shared libraries go through PLT stubs:
+ *   ADD IP, PC, #imm1
+ *   ADD IP, IP, #imm2
+ *   LDR PC, [IP, #offset]!
+ * Returns the address of the GOT entry if the LDR at read_address ends a PLT
+ * stub scanned as part of the current basic block, or NULL otherwise.
+ */
+static uint32_t *arm_plt_got_entry(uint32_t *read_address, uint32_t *bb_entry) {
+  uint32_t *stub = read_address - 2;
+  uint32_t immediate, opcode, set_flags, rd, rn, operand2;
+  uint32_t offset, prepostindex, updown, writeback;
+  uint32_t got = (uint32_t)stub + 8;
+
+  if (stub < bb_entry) return NULL;
+
+  for (int i = 0; i < 2; i++) {
+    if (arm_decode(&stub[i]) != ARM_ADD || (stub[i] >> 28) != AL) return NULL;
+    arm_data_proc_decode_fields(&stub[i], &immediate, &opcode, &set_flags, &rd, &rn, &operand2);
+    if (immediate != IMM_PROC || set_flags || rd != r12 || rn != ((i == 0) ? pc : r12)) {
+      return NULL;
+    }
+    uint32_t imm8 = operand2 & 0xFF;
+    uint32_t rot = ((operand2 >> 8) & 0xF) * 2;
+    got += (imm8 >> rot) | (imm8 << ((32 - rot) & 31));
+  }
+
+  arm_ldr_decode_fields(read_address, &immediate, &rd, &rn, &offset, &prepostindex, &updown, &writeback);
+  if (immediate != IMM_LDR || rd != pc || rn != r12 || !prepostindex || !updown || !writeback) {
+    return NULL;
+  }
+
+  return (uint32_t *)(got + offset);
+}
+
+/* The STR alone is also the PUSH {LR} of function prologues, so all of PLT0
+   is matched */
+static const uint32_t arm_plt0[] = {
+  0xE52DE004, // STR LR, [SP, #-4]!
+  0xE59FE004, // LDR LR, [PC, #4]
+  0xE08FE00E, // ADD LR, PC, LR
+  0xE5BEF008, // LDR PC, [LR, #8]!
+};
+
+/* Before lazy binding, GOT entries point to the resolver stub at the start of
+   the PLT, PLT0 */
+static bool arm_is_plt(uint32_t *target) {
+  return memcmp(target, arm_plt0, sizeof(arm_plt0)) == 0
+         || (arm_decode(&target[2]) == ARM_LDR && arm_plt_got_entry(&target[2], target) != NULL);
+}
+
+/*
+ * The target found in the GOT entry at scan time is linked directly, guarded
+ * by a check that the entry hasn't been updated since. The first time the
+ * check fails, e.g. after lazy binding, the fragment is retranslated through
+ * the dispatcher to link the new value. The loaded target is in R5, with
+ * R4-R6 pushed for the inline hash lookup, which follows instead of the link
+ * for targets in the PLT:
+ *   MOVW+MOVT R4, #got_value
+ *   CMP  R4, R5
+ *   BEQ  hit
+ *   <dispatcher exit, source index basic_block | PLT_RELINK_SOURCE>
+ * hit:
+ *   POP  {R4-R6}                        // unless got_value is in the PLT
+ *   B    <translation of got_value>     // unless got_value is in the PLT
+ * The POP is recorded in plt_link_addr, so that unlinking the fragment for
+ * signal delivery redirects the hit path to the inline hash lookup.
+ */
+#define PLT_LINK_SIZE (16 * 4)
+
+static void arm_link_plt(dbm_thread *thread_data, uint32_t **o_write_p, uint32_t target,
+                         int basic_block) {
+  uint32_t *write_p = *o_write_p;
+  uint32_t *branch_hit;
+
+  arm_copy_to_reg_32bit(&write_p, r4, target);
+  arm_cmp(&write_p, REG_PROC, r4, r5);
+  write_p++;
+  branch_hit = write_p++;
+  arm_ihl_dispatcher_exit(thread_data, &write_p, basic_block | PLT_RELINK_SOURCE, r5);
+  arm_b32_helper(branch_hit, (uint32_t)write_p, EQ);
+  if (!arm_is_plt((uint32_t *)target)) {
+    thread_data->code_cache_meta_cold[basic_block].plt_link_addr = write_p;
+    arm_pop_regs((1 << r4) | (1 << r5) | (1 << r6));
+    arm_cc_branch(thread_data, write_p, lookup_or_stub(thread_data, target), AL);
+    write_p++;
+  }
+
+  *o_write_p = write_p;
+}
+#endif
+
 void arm_inline_hash_lookup(dbm_thread *thread_data, uint32_t **o_write_p, int basic_block, int r_target) {
   uint32_t *write_p = *o_write_p;
   uint32_t *loop_start;
@@ -484,31 +613,7 @@ void arm_inline_hash_lookup(dbm_thread *thread_data, uint32_t **o_write_p, int b
   arm_b32_helper(write_p, (uint32_t)loop_start, NE);
   write_p++;
 
-  // SUB sp, sp, #8
-  arm_sub(&write_p, IMM_PROC, 0, sp, sp, DISP_RES_WORDS*4);
-  write_p++;
-
-  // PUSH {r0 - r3}
-  arm_push_regs((1 << r0) | (1 << r1) | (1 << r2) | (1 << r3));
-
-  //ADD r3, sp, #24
-  arm_add(&write_p, IMM_PROC, 0, r3, sp, DISP_SP_OFFSET);
-  write_p++;
-
-  // MOV r0, target
-  arm_mov(&write_p, REG_PROC, 0, r0, target);
-  write_p++;
-
-  // MOV r1, #bb_id
-  arm_copy_to_reg_32bit(&write_p, r1, basic_block);
-
-  // LDMFD R3!, {R4-R6}
-  arm_ldm(&write_p, r3, (1 << r4) | (1 << r5) | (1 << r6), 0, 1, 1, 0);
-  write_p++;
-
-  // B dispatcher
-  arm_b32_helper(write_p, thread_data->dispatcher_addr, AL);
-  write_p++;
+  arm_ihl_dispatcher_exit(thread_data, &write_p, basic_block, target);
 
   *o_write_p = write_p;
 }
@@ -1001,6 +1106,15 @@ size_t scan_a32(dbm_thread *thread_data, uint32_t *read_address, int basic_block
               }
               arm_ldr(&write_p, immediate, r5, rn, offset, prepostindex, updown, writeback);
               write_p++;
+#ifdef DBM_LINK_PLT
+              uint32_t *got_entry = arm_plt_got_entry(read_address, bb_entry);
+              // The dispatcher can only retranslate basic blocks
+              if (got_entry != NULL && (*read_address >> 28) == AL && type == mambo_bb
+                  && *got_entry != 0 && (*got_entry & THUMB) == 0) {
+                arm_check_free_space(thread_data, &write_p, &data_p, PLT_LINK_SIZE, basic_block);
+                arm_link_plt(thread_data, &write_p, *got_entry, basic_block);
+              }
+#endif
             }
             arm_check_free_space(thread_data, &write_p, &data_p, IHL_SPACE, basic_block);
             arm_inline_hash_lookup(thread_data, &write_p, basic_block, -1);
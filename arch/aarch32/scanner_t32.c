@@ -916,8 +916,10 @@ bool thumb_scanner_deliver_callbacks(dbm_thread *thread_data, mambo_cb_idx cb_id
     mambo_context ctx;
     set_mambo_context_code(&ctx, thread_data, PRE_INST_C, type, basic_block, THUMB_INST, inst, cond, read_address, write_p, data_p, stop);
 
+    // Code excluded by the module filter only gets function callbacks
+    bool filtered = !module_filter_allows(thread_data, (uintptr_t)read_address);
     for (int i = 0; i < global_data.free_plugin; i++) {
-      if (global_data.plugins[i].cbs[cb_id] != NULL) {
+      if (global_data.plugins[i].cbs[cb_id] != NULL && !filtered) {
         ctx.plugin_id = i;
         ctx.code.replace = false;
         ctx.code.available_regs = ctx.code.pushed_regs;
@@ -955,7 +957,7 @@ bool thumb_scanner_deliver_callbacks(dbm_thread *thread_data, mambo_cb_idx cb_id
       watched_functions_t *wf = &global_data.watched_functions;
       for (int i = 0; i < wf->funcp_count; i++) {
         if (read_address == (wf->funcps[i].addr -1)) {
-          _function_callback_wrapper(&ctx, wf->funcps[i].func);
+          _function_callback_wrapper(&ctx, wf->funcps[i].func, false);
           if (ctx.code.replace) {
             read_address = ctx.code.read_address;
           }
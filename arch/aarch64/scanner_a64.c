@@ -35,6 +35,14 @@
 
 #define NOP_INSTRUCTION 0xD503201F
 #define MIN_FSPACE      60
+#define COLD_STUB_SIZE  16 // in instructions, enough for a conditional exit
+/* Worst case sizes of the cold stubs, with up to 4 instructions for an
+   address and 2 for a fragment id */
+#define COLD_UNCOND_STUB_SIZE (1 + 2 + 4 + 1)
+#define COLD_COND_STUB_SIZE   (1 + 2 + 1 + 4 + 1 + 4 + 1)
+#define COLD_CBZ_STUB_SIZE    (1 + 1 + (4 + 2 + 1) * 2)
+#define EXIT_FSPACE     ((3 + COLD_STUB_SIZE) * 4)
+#define MODE_STUB_SIZE  6  // in instructions
 
 //#define DEBUG
 #ifdef DEBUG
@@ -164,6 +172,153 @@ void a64_copy_to_reg_64bits(uint32_t **write_p, enum reg reg, uint64_t value)
   }
 }
 
+/*
+ * Hot / cold splitting of exit stubs
+ *
+ * The exit stubs of basic blocks only run until the exit is linked, so they are
+ * emitted in the cold area at the end of the fragment (growing down from data_p)
+ * and the fragment body only contains the link slots and a branch to the stub.
+ * When o_data_p is NULL (e.g. trace fragments), the stub is emitted inline.
+ *
+ * a64_begin_cold_stub() returns the address at which hot code continues, or NULL
+ * for inline stubs, and moves *write_p to the start of the cold stub. size is
+ * the worst case size of the stub in instructions, checked before any of it is
+ * emitted.
+ */
+uint32_t *a64_begin_cold_stub(uint32_t **write_p, uint32_t **o_data_p, size_t size) {
+  uint32_t *hot_p;
+  uint32_t *stub;
+
+  if (o_data_p == NULL) {
+    return NULL;
+  }
+
+  // The free space checks before exits only reserve COLD_STUB_SIZE
+  assert(size <= COLD_STUB_SIZE);
+  stub = *o_data_p - size;
+  assert(stub > *write_p);
+  a64_b_helper(*write_p, (uint64_t)stub);
+  hot_p = *write_p + 1;
+
+  *o_data_p = stub;
+  *write_p = stub;
+
+  return hot_p;
+}
+
+void a64_end_cold_stub(uint32_t **write_p, uint32_t *hot_p, uint32_t **o_data_p, size_t size) {
+  if (hot_p == NULL) {
+    return;
+  }
+
+  assert(*write_p <= (*o_data_p + size));
+  // scan() only flushes the caches up to the end of the hot code
+  __clear_cache((char *)*o_data_p, (char *)*write_p);
+
+  *write_p = hot_p;
+}
+
+#ifdef PLUGINS_NEW
+/*
+ * With dual-mode translation, basic blocks check on entry that they were
+ * translated in the current instrumentation mode of the thread. Otherwise,
+ * they return to the dispatcher with no source block, which looks up or
+ * scans the other variant without linking. The check follows the entry
+ * prologue emitted by scan_a64(), see a64_poll_signals():
+ *
+ *   LDR  X0, =&thread_data->instrument
+ *   LDR  W0, [X0]
+ *   CBZ  W0, switch    // CBNZ in bare blocks
+ *   (LDP X0, X1, [SP], #16 emitted by the caller)
+ *   ...
+ * switch:              // in the data area of the block
+ *   MOV  X0, #read_address
+ *   MOV  X1, #0
+ *   B    dispatcher
+ */
+void a64_check_cc_mode(dbm_thread *thread_data, uint32_t **o_write_p,
+                       uint32_t **o_data_p, uint32_t *read_address) {
+  uint32_t *write_p = *o_write_p;
+  uint32_t *data_p = *o_data_p;
+  uint32_t *stub;
+
+  data_p -= 2;
+  *(uint64_t *)data_p = (uint64_t)&thread_data->instrument;
+  a64_LDR_lit(&write_p, 1, 0, (data_p - write_p) & 0x7FFFF, x0);
+  write_p++;
+  a64_LDR_STR_unsigned_immed(&write_p, 2, 0, 1, 0, x0, x0);
+  write_p++;
+
+  data_p -= MODE_STUB_SIZE;
+  stub = data_p;
+  a64_cbz_cbnz_helper(write_p, thread_data->bare, (uint64_t)stub, 0, x0);
+  write_p++;
+
+  a64_copy_to_reg_64bits(&stub, x0, (uint64_t)read_address);
+  a64_copy_to_reg_64bits(&stub, x1, 0);
+  a64_b_helper(stub, thread_data->dispatcher_addr);
+  stub++;
+  assert(stub <= (data_p + MODE_STUB_SIZE));
+  __clear_cache((char *)data_p, (char *)stub);
+
+  *o_write_p = write_p;
+  *o_data_p = data_p;
+}
+#endif
+
+/*
+ * With MAMBO_SIGNAL_POLL set, asynchronous signals received while a thread
+ * runs in the code cache are delivered at the next fragment entry, instead of
+ * unlinking the current fragment. Only basic blocks and trace entries are
+ * checked, not the other trace fragments, and a trace can loop back to itself
+ * without passing a check, so signal_dispatcher() still unlinks the current
+ * fragment when it's part of a trace. Both the dispatcher entry (with X0 and
+ * X1 pushed) and the entry used by direct links (at +4) are checked:
+ *
+ *   B    check
+ *   STP  X0, X1, [SP, #-16]!
+ * check:
+ *   <mode check, see a64_check_cc_mode()>
+ *   LDR  X0, poll
+ *   LDR  W0, [X0]
+ *   CBZ  W0, done
+ *   MOV  X0, #read_address
+ *   MOV  X1, #0
+ *   B    dispatcher          // delivers the signal before returning here
+ * poll:
+ *   .quad &thread_data->signal_poll
+ * done:
+ *   (LDP X0, X1, [SP], #16 emitted by the caller)
+ *
+ * The stub is inline because trace heads don't have a data area. The flag is
+ * cleared by deliver_signals(), even if the pending signals are blocked.
+ */
+void a64_poll_signals(dbm_thread *thread_data, uint32_t **o_write_p, uint32_t *read_address) {
+  uint32_t *write_p = *o_write_p;
+  uint32_t *ldr, *cbz;
+
+  ldr = write_p++;
+  a64_LDR_STR_unsigned_immed(&write_p, 2, 0, 1, 0, x0, x0);
+  write_p++;
+  cbz = write_p++;
+
+  a64_copy_to_reg_64bits(&write_p, x0, (uint64_t)read_address);
+  a64_copy_to_reg_64bits(&write_p, x1, 0);
+  a64_b_helper(write_p, thread_data->dispatcher_addr);
+  write_p++;
+
+  if ((uintptr_t)write_p & 7) {
+    *write_p++ = NOP_INSTRUCTION;
+  }
+  *(uint64_t *)write_p = (uint64_t)&thread_data->signal_poll;
+  a64_LDR_lit(&ldr, 1, 0, (write_p - ldr) & 0x7FFFF, x0);
+  write_p += 2;
+
+  a64_cbz_cbnz_helper(cbz, false, (uint64_t)write_p, 0, x0);
+
+  *o_write_p = write_p;
+}
+
 void a64_branch_save_context (uint32_t **o_write_p)
 {
   uint32_t *write_p = *o_write_p;
@@ -197,14 +352,16 @@ void a64_branch_jump(dbm_thread *thread_data, uint32_t **o_write_p,
   *o_write_p = write_p;
 }
 
-void a64_branch_jump_cond(dbm_thread *thread_data, uint32_t **o_write_p, int basic_block,
-                          uint64_t target, uint32_t *read_address, uint32_t cond) {
+void a64_branch_jump_cond(dbm_thread *thread_data, uint32_t **o_write_p, uint32_t **o_data_p,
+                          int basic_block, uint64_t target, uint32_t *read_address, uint32_t cond) {
    /*
    *                   +-------------------------------+
    * branch_cond    -> |          NOP                  |
    * branch_1       -> |          NOP                  |
    *                   |                               |
-   * branch_2       -> |          STP                  |
+   * branch_2       -> |          [B        COLD]      |
+   *                   |                               |
+   *             COLD: |          STP                  |
    *                   |          MOV       X1, BB_ID  |
    *                   |                               |
    *                   |          B.op_cond SKIPPED    |
@@ -218,6 +375,7 @@ void a64_branch_jump_cond(dbm_thread *thread_data, uint32_t **o_write_p, int bas
    */
   uint32_t *write_p = *o_write_p;
   uint32_t *cond_branch;
+  uint32_t *hot_p;
 
   debug("A64 branch: read_addr: %p, target: 0x%lx\n", read_address, target);
 
@@ -226,6 +384,8 @@ void a64_branch_jump_cond(dbm_thread *thread_data, uint32_t **o_write_p, int bas
   *write_p = NOP_INSTRUCTION;
   write_p++;
 
+  hot_p = a64_begin_cold_stub(&write_p, o_data_p, COLD_COND_STUB_SIZE);
+
   a64_branch_save_context(&write_p);
   a64_copy_to_reg_64bits(&write_p, x1, basic_block);
 
@@ -241,17 +401,21 @@ void a64_branch_jump_cond(dbm_thread *thread_data, uint32_t **o_write_p, int bas
   a64_b_helper(write_p, thread_data->dispatcher_addr);
   write_p++;
 
+  a64_end_cold_stub(&write_p, hot_p, o_data_p, COLD_COND_STUB_SIZE);
+
   *o_write_p = write_p;
 }
 
-void a64_branch_imm_reg(dbm_thread *thread_data, uint32_t **o_write_p,
+void a64_branch_imm_reg(dbm_thread *thread_data, uint32_t **o_write_p, uint32_t **o_data_p,
                         int basic_block, a64_instruction inst, uint32_t *read_address) {
   /*
    *                   +------------------------------+
    * cb(n)z_branch     |          NOP                 |
    * b taken/not taken |          NOP                 |
    *                   |                              |
-   * b not taken/taken |          STP                 |
+   * b not taken/taken |          [B       COLD]      |
+   *                   |                              |
+   *             COLD: |          STP                 |
    *                   |                              |
    *                   | TAKEN:   [C/T](N)BZ SKIPPED  |
    *                   |                              |
@@ -266,6 +430,7 @@ void a64_branch_imm_reg(dbm_thread *thread_data, uint32_t **o_write_p,
    */
   uint32_t *write_p = *o_write_p;
   uint32_t *cbz_branch;
+  uint32_t *hot_p;
   uint32_t sf, op, b5, b40, imm, rt, bit;
   uint64_t branch_offset, target;
 
@@ -303,6 +468,8 @@ void a64_branch_imm_reg(dbm_thread *thread_data, uint32_t **o_write_p,
   *write_p = NOP_INSTRUCTION;
   write_p++;
 
+  hot_p = a64_begin_cold_stub(&write_p, o_data_p, COLD_CBZ_STUB_SIZE);
+
   a64_branch_save_context(&write_p);
 
   cbz_branch = write_p++;
@@ -326,6 +493,8 @@ void a64_branch_imm_reg(dbm_thread *thread_data, uint32_t **o_write_p,
   a64_branch_jump(thread_data, &write_p, basic_block, (uint64_t)read_address + 4,
                   REPLACE_TARGET | INSERT_BRANCH);
 
+  a64_end_cold_stub(&write_p, hot_p, o_data_p, COLD_CBZ_STUB_SIZE);
+
   *o_write_p = write_p;
 }
 
@@ -345,113 +514,1070 @@ void a64_check_free_space(dbm_thread *thread_data, uint32_t **write_p,
   }
 }
 
-void pass1_a64(uint32_t *read_address, branch_type *bb_type) {
+#ifdef PLUGINS_NEW
+/*
+  Register liveness
+
+  Backward pass over the instructions of a basic block, up to its first
+  branch. All registers and NZCV are considered live after the block, as
+  well as before any instruction which isn't modelled below. Writes to W
+  registers clear the upper half, so they kill the whole X register.
+  SP and XZR (register number 31) are never tracked.
+*/
+#define A64_ALL_REGS  (A64_LIVE_NZCV - 1)
+#define a64_reg_bit(inst, shift) ((1U << (((inst) >> (shift)) & 0x1F)) & A64_ALL_REGS)
+#define a64_rd(inst)  a64_reg_bit(inst, 0)
+#define a64_rn(inst)  a64_reg_bit(inst, 5)
+#define a64_ra(inst)  a64_reg_bit(inst, 10)
+#define a64_rm(inst)  a64_reg_bit(inst, 16)
+#define A64_NZCV_SYSREG 0xDA10
+
+// Returns true if the instruction ends the liveness window
+static bool a64_inst_liveness(uint32_t *read_address, uint32_t *use, uint32_t *def) {
+  uint32_t inst = *read_address;
+  uint32_t sf_op_s = inst >> 29;
+  uint32_t v = (inst >> 26) & 1;
+  uint32_t size = inst >> 30;
+  uint32_t opc = (inst >> 22) & 3;
+  bool is_load;
+
+  *use = 0;
+  *def = 0;
+
+  switch (a64_decode(read_address)) {
+    case A64_ADR:
+      *def = a64_rd(inst);
+      break;
+    case A64_ADD_SUB_IMMED:
+      *use = a64_rn(inst);
+      *def = a64_rd(inst) | ((sf_op_s & 1) ? A64_LIVE_NZCV : 0);
+      break;
+    case A64_LOGICAL_IMMED:
+      *use = a64_rn(inst);
+      *def = a64_rd(inst) | (((sf_op_s & 3) == 3) ? A64_LIVE_NZCV : 0);
+      break;
+    case A64_BFM:
+      *use = a64_rn(inst);
+      *def = a64_rd(inst);
+      // BFM inserts into the destination register
+      if ((sf_op_s & 3) == 1) {
+        *use |= a64_rd(inst);
+      }
+      break;
+    case A64_MOV_WIDE:
+      *def = a64_rd(inst);
+      // MOVK
+      if ((sf_op_s & 3) == 3) {
+        *use = a64_rd(inst);
+      }
+      break;
+    case A64_ADD_SUB_SHIFT_REG:
+    case A64_ADD_SUB_EXT_REG:
+      *use = a64_rn(inst) | a64_rm(inst);
+      *def = a64_rd(inst) | ((sf_op_s & 1) ? A64_LIVE_NZCV : 0);
+      break;
+    case A64_LOGICAL_REG:
+      *use = a64_rn(inst) | a64_rm(inst);
+      *def = a64_rd(inst) | (((sf_op_s & 3) == 3) ? A64_LIVE_NZCV : 0);
+      break;
+    case A64_EXTR:
+    case A64_DATA_PROC_REG2:
+      *use = a64_rn(inst) | a64_rm(inst);
+      *def = a64_rd(inst);
+      break;
+    case A64_DATA_PROC_REG1:
+      // PAC* and AUT* also read the destination register
+      *use = a64_rn(inst) | a64_rd(inst);
+      *def = a64_rd(inst);
+      break;
+    case A64_DATA_PROC_REG3:
+      *use = a64_rn(inst) | a64_rm(inst) | a64_ra(inst);
+      *def = a64_rd(inst);
+      break;
+    case A64_ADC_SBC:
+    case A64_COND_SELECT:
+      *use = a64_rn(inst) | a64_rm(inst) | A64_LIVE_NZCV;
+      *def = a64_rd(inst);
+      break;
+    case A64_CCMP_CCMN_REG:
+    case A64_CCMP_CCMN_IMMED:
+      *use = a64_rn(inst) | a64_rm(inst) | A64_LIVE_NZCV;
+      break;
+
+    case A64_LDR_LIT:
+      // PRFM (literal) doesn't write Rt
+      if (v == 0 && size != 3) {
+        *def = a64_rd(inst);
+      }
+      break;
+    case A64_LDP_STP:
+      *use = a64_rn(inst);
+      if (v == 0) {
+        if ((inst >> 22) & 1) {
+          *def = a64_rd(inst) | a64_ra(inst);
+        } else {
+          *use |= a64_rd(inst) | a64_ra(inst);
+        }
+      }
+      break;
+    case A64_LDR_STR_REG:
+      *use = a64_rm(inst);
+      // fall through
+    case A64_LDR_STR_IMMED:
+    case A64_LDR_STR_UNSIGNED_IMMED:
+      *use |= a64_rn(inst);
+      if (v == 0) {
+        // PRFM doesn't write Rt
+        is_load = (opc == 1) || (opc == 2 && size != 3) || (opc == 3 && size < 2);
+        if (is_load) {
+          *def = a64_rd(inst);
+        } else {
+          *use |= a64_rd(inst);
+        }
+      }
+      break;
+    case A64_LDX_STX:
+      /* The status register of store exclusives isn't treated as written,
+         CASP also reads Rs + 1 and Rt + 1 */
+      *use = a64_rd(inst) | a64_ra(inst) | a64_rn(inst) | a64_rm(inst);
+      *use |= ((a64_rd(inst) | a64_rm(inst)) << 1) & A64_ALL_REGS;
+      break;
+    case A64_LDX_STX_MULTIPLE:
+    case A64_LDX_STX_SINGLE:
+      *use = a64_rn(inst);
+      break;
+    case A64_LDX_STX_MULTIPLE_POST:
+    case A64_LDX_STX_SINGLE_POST:
+      *use = a64_rn(inst) | a64_rm(inst);
+      break;
+
+    case A64_MRS_MSR_REG:
+      if ((inst >> 21) & 1) { // MRS
+        *def = a64_rd(inst);
+        if (((inst >> 5) & 0xFFFF) == A64_NZCV_SYSREG) {
+          *use = A64_LIVE_NZCV;
+        }
+      } else {
+        *use = a64_rd(inst);
+        if (((inst >> 5) & 0xFFFF) == A64_NZCV_SYSREG) {
+          *def = A64_LIVE_NZCV;
+        }
+      }
+      break;
+    case A64_HINT:
+      // Pointer authentication hints use X16, X17 and X30
+      if (inst != NOP_INSTRUCTION) {
+        *use = (1 << x16) | (1 << x17) | (1 << x30);
+      }
+      break;
+    case A64_SYS:
+      *use = a64_rd(inst);
+      break;
+    case A64_CLREX:
+    case A64_DMB:
+    case A64_DSB:
+    case A64_ISB:
+      break;
+
+    case A64_FCMP:
+      *def = A64_LIVE_NZCV;
+      break;
+    case A64_FCCMP:
+    case A64_FCSEL:
+      *use = A64_LIVE_NZCV;
+      break;
+    // Conversions and moves to and from general purpose registers
+    case A64_FLOAT_CVT_INT:
+    case A64_FLOAT_CVT_FIXED:
+    case A64_SIMD_COPY:
+      *use = a64_rn(inst);
+      break;
+    case A64_FMOV_IMMED:
+    case A64_FLOAT_REG1:
+    case A64_FLOAT_REG2:
+    case A64_FLOAT_REG3:
+    case A64_SIMD_X_INDEXED:
+    case A64_SIMD_TWO_REG:
+    case A64_SIMD_THREE_SAME:
+    case A64_SIMD_THREE_DIFF:
+    case A64_SIMD_TABLE_LOOKUP:
+    case A64_SIMD_SHIFT_IMMED:
+    case A64_SIMD_SCALAR_X_INDEXED:
+    case A64_SIMD_SCALAR_TWO_REG:
+    case A64_SIMD_SCALAR_THREE_SAME:
+    case A64_SIMD_SCALAR_THREE_DIFF:
+    case A64_SIMD_SCALAR_SHIFT_IMMED:
+    case A64_SIMD_SCALAR_PAIRWISE:
+    case A64_SIMD_SCALAR_COPY:
+    case A64_SIMD_PERMUTE:
+    case A64_SIMD_MODIFIED_IMMED:
+    case A64_SIMD_EXTRACT:
+    case A64_SIMD_ACROSS_LANE:
+    case A64_CRYPTO_AES:
+    case A64_CRYPTO_SHA_REG2:
+    case A64_CRYPTO_SHA_REG3:
+      break;
+
+    case A64_B_BL:
+    case A64_B_COND:
+    case A64_CBZ_CBNZ:
+    case A64_TBZ_TBNZ:
+    case A64_BR:
+    case A64_BLR:
+    case A64_RET:
+    case A64_SVC:
+    case A64_HVC:
+    case A64_BRK:
+    case A64_INVALID:
+      *use = A64_ALL_REGS | A64_LIVE_NZCV;
+      return true;
+
+    default:
+      *use = A64_ALL_REGS | A64_LIVE_NZCV;
+      break;
+  }
+
+  return false;
+}
+
+static void a64_scan_liveness(dbm_thread *thread_data, uint32_t *read_address) {
+  a64_liveness *lv = &thread_data->liveness;
+  uint32_t use[MAX_LIVENESS_INSTS];
+  uint32_t def[MAX_LIVENESS_INSTS];
+  bool end = false;
+  int count;
+
+  for (count = 0; count < MAX_LIVENESS_INSTS && !end; count++) {
+    end = a64_inst_liveness(&read_address[count], &use[count], &def[count]);
+  }
+
+  uint32_t live = A64_ALL_REGS | A64_LIVE_NZCV;
+  lv->live[count] = live;
+  for (int i = count - 1; i >= 0; i--) {
+    live = (live & ~def[i]) | use[i];
+    lv->live[i] = live;
+  }
+  lv->start = read_address;
+  lv->count = count;
+}
+
+/* Registers which can stay spilled across the instruction at read_address,
+   see emit_a64_flush_spills(). SP is treated as used by any instruction with
+   a register number 31 in the Rd or Rn field */
+static uint32_t a64_coalesce_regs(uint32_t *read_address) {
+  uint32_t inst = *read_address;
+  uint32_t use, def;
+
+  if (a64_inst_liveness(read_address, &use, &def)) return 0;
+  if ((use & A64_ALL_REGS) == A64_ALL_REGS) return 0;
+  if (((inst >> 5) & 0x1F) == 31 || (inst & 0x1F) == 31) return 0;
+
+  return A64_ALL_REGS & ~(use | def);
+}
+
+/* Sets the registers and flags which are dead before the instruction at
+   read_address or, if after is set, after it */
+static void a64_get_liveness(dbm_thread *thread_data, uint32_t *read_address, bool after,
+                             uint32_t *dead_regs, bool *nzcv_dead) {
+  a64_liveness *lv = &thread_data->liveness;
+
+  if (lv->count == 0 || read_address < lv->start || read_address >= (lv->start + lv->count)) {
+    a64_scan_liveness(thread_data, read_address);
+  }
+  uint32_t live = lv->live[(read_address - lv->start) + (after ? 1 : 0)];
+
+  *dead_regs = ~live & A64_ALL_REGS;
+  *nzcv_dead = (live & A64_LIVE_NZCV) == 0;
+}
+
+/* Sets the general purpose registers which may be written by the instruction
+   at read_address, including the base register of loads and stores with
+   writeback. Unlike a64_inst_liveness(), which must not report a register as
+   written unless it always is, this is an over-approximation. Returns false if
+   the instruction isn't modelled */
+static bool a64_inst_may_def(uint32_t *read_address, uint32_t *def) {
+  uint32_t inst = *read_address;
+  uint32_t v = (inst >> 26) & 1;
+  uint32_t opc = (inst >> 22) & 3;
+  uint32_t use;
+
+  *def = 0;
+
+  switch (a64_decode(read_address)) {
+    case A64_ADR:
+    case A64_ADD_SUB_IMMED:
+    case A64_LOGICAL_IMMED:
+    case A64_BFM:
+    case A64_MOV_WIDE:
+    case A64_ADD_SUB_SHIFT_REG:
+    case A64_ADD_SUB_EXT_REG:
+    case A64_LOGICAL_REG:
+    case A64_EXTR:
+    case A64_DATA_PROC_REG1:
+    case A64_DATA_PROC_REG2:
+    case A64_DATA_PROC_REG3:
+    case A64_ADC_SBC:
+    case A64_COND_SELECT:
+    case A64_CCMP_CCMN_REG:
+    case A64_CCMP_CCMN_IMMED:
+    case A64_MRS_MSR_REG:
+    case A64_LDR_LIT:
+      a64_inst_liveness(read_address, &use, def);
+      break;
+    // SYSL writes Rt
+    case A64_SYS:
+      *def = a64_rd(inst);
+      break;
+    // PACIA1716, AUTIA1716, PACIASP, XPACLRI, etc
+    case A64_HINT:
+      if (inst != NOP_INSTRUCTION) {
+        *def = (1 << x17) | (1 << x30);
+      }
+      break;
+    case A64_CLREX:
+    case A64_DMB:
+    case A64_DSB:
+    case A64_ISB:
+      break;
+
+    case A64_LDP_STP:
+      if (v == 0 && ((inst >> 22) & 1)) {
+        *def = a64_rd(inst) | a64_ra(inst);
+      }
+      // Pre- and post-indexed
+      if ((inst >> 23) & 1) {
+        *def |= a64_rn(inst);
+      }
+      break;
+    case A64_LDR_STR_IMMED:
+      // Pre- and post-indexed
+      if ((inst >> 10) & 1) {
+        *def = a64_rn(inst);
+      }
+      // fall through
+    case A64_LDR_STR_UNSIGNED_IMMED:
+    case A64_LDR_STR_REG:
+      if (v == 0 && opc != 0) {
+        *def |= a64_rd(inst);
+      }
+      break;
+    // Status register, loaded registers and the compared registers of CAS(P)
+    case A64_LDX_STX:
+      *def = a64_rd(inst) | a64_ra(inst) | a64_rm(inst);
+      *def |= ((a64_rd(inst) | a64_rm(inst)) << 1) & A64_ALL_REGS;
+      break;
+    case A64_LDX_STX_MULTIPLE:
+    case A64_LDX_STX_SINGLE:
+      break;
+    case A64_LDX_STX_MULTIPLE_POST:
+    case A64_LDX_STX_SINGLE_POST:
+      *def = a64_rn(inst);
+      break;
+
+    // Conversions and moves to general purpose registers, e.g. FMOV X0, D1
+    case A64_FLOAT_CVT_INT:
+    case A64_FLOAT_CVT_FIXED:
+    case A64_SIMD_COPY:
+      *def = a64_rd(inst);
+      break;
+    case A64_FCMP:
+    case A64_FCCMP:
+    case A64_FCSEL:
+    case A64_FMOV_IMMED:
+    case A64_FLOAT_REG1:
+    case A64_FLOAT_REG2:
+    case A64_FLOAT_REG3:
+    case A64_SIMD_X_INDEXED:
+    case A64_SIMD_TWO_REG:
+    case A64_SIMD_THREE_SAME:
+    case A64_SIMD_THREE_DIFF:
+    case A64_SIMD_TABLE_LOOKUP:
+    case A64_SIMD_SHIFT_IMMED:
+    case A64_SIMD_SCALAR_X_INDEXED:
+    case A64_SIMD_SCALAR_TWO_REG:
+    case A64_SIMD_SCALAR_THREE_SAME:
+    case A64_SIMD_SCALAR_THREE_DIFF:
+    case A64_SIMD_SCALAR_SHIFT_IMMED:
+    case A64_SIMD_SCALAR_PAIRWISE:
+    case A64_SIMD_SCALAR_COPY:
+    case A64_SIMD_PERMUTE:
+    case A64_SIMD_MODIFIED_IMMED:
+    case A64_SIMD_EXTRACT:
+    case A64_SIMD_ACROSS_LANE:
+    case A64_CRYPTO_AES:
+    case A64_CRYPTO_SHA_REG2:
+    case A64_CRYPTO_SHA_REG3:
+      break;
+
+    default:
+      return false;
+  }
+
+  return true;
+}
+
+#define A64_TPIDR_EL0_SYSREG 0xDE82
+
+/* Finds where the value of reg before the instruction at read_address comes
+   from, by following its definitions backwards through ADD and SUB (immediate)
+   within the current liveness window, which is straight-line code. Any other
+   instruction which may write reg, or which isn't modelled by
+   a64_inst_may_def(), stops the search with A64_ORIGIN_UNKNOWN. For
+   A64_ORIGIN_CONST, the value of the register is returned in *value */
+a64_reg_origin a64_trace_reg_origin(dbm_thread *thread_data, uint32_t *read_address,
+                                    enum reg reg, uintptr_t *value) {
+  a64_liveness *lv = &thread_data->liveness;
+  intptr_t offset = 0;
+
+  if (lv->count == 0 || read_address < lv->start || read_address > (lv->start + lv->count)) {
+    return A64_ORIGIN_UNKNOWN;
+  }
+
+  for (uint32_t *addr = read_address - 1; addr >= lv->start; addr--) {
+    if (reg == sp) return A64_ORIGIN_SP;
+
+    uint32_t def;
+    if (!a64_inst_may_def(addr, &def)) return A64_ORIGIN_UNKNOWN;
+    if ((def & (1 << reg)) == 0) continue;
+
+    uint32_t inst = *addr;
+    switch (a64_decode(addr)) {
+      case A64_ADD_SUB_IMMED: {
+        uint32_t sf = inst >> 31;
+        uint32_t op = (inst >> 30) & 1;
+        uint32_t shift = (inst >> 22) & 1;
+        intptr_t imm = ((inst >> 10) & 0xFFF) << (shift * 12);
+        if (sf == 0) return A64_ORIGIN_UNKNOWN;
+        offset += op ? -imm : imm;
+        reg = (inst >> 5) & 0x1F;
+        break;
+      }
+      case A64_ADR: {
+        uint32_t op = inst >> 31;
+        intptr_t imm = sign_extend64(21, (((inst >> 5) & 0x7FFFF) << 2) | ((inst >> 29) & 3));
+        uintptr_t pc = (uintptr_t)addr;
+        if (op) { // ADRP
+          pc &= ~0xFFFUL;
+          imm <<= 12;
+        }
+        *value = pc + imm + offset;
+        return A64_ORIGIN_CONST;
+      }
+      case A64_MRS_MSR_REG:
+        if (((inst >> 21) & 1) && ((inst >> 5) & 0xFFFF) == A64_TPIDR_EL0_SYSREG) {
+          return A64_ORIGIN_TPIDR;
+        }
+        return A64_ORIGIN_UNKNOWN;
+      default:
+        return A64_ORIGIN_UNKNOWN;
+    }
+  }
+
+  return (reg == sp) ? A64_ORIGIN_SP : A64_ORIGIN_UNKNOWN;
+}
+
+#define A64_SHARED_ADDR_REGS (0x3FF << x19) // X19 to X28
+
+/* Computes the effective address of the load or store into a register shared
+   by all the PRE_INST_C callbacks, see mambo_share_ld_st_addr(). Returns the
+   registers which have to be restored after the callbacks */
+static uint32_t a64_share_ld_st_addr(mambo_context *ctx, uint32_t *dead_regs) {
+  uint32_t use, def;
+  uint32_t to_push = 0;
+  int reg;
+
+  a64_inst_liveness(ctx->code.read_address, &use, &def);
+  uint32_t free_regs = A64_SHARED_ADDR_REGS & ~(use | def);
+  /* The highest registers are selected first because they are the least likely
+     to be used explicitly by the instrumentation */
+  if (free_regs & *dead_regs) {
+    reg = last_reg_in_list(free_regs & *dead_regs, x28);
+  } else {
+    // Pushed as a pair to keep the offset of SP-relative addresses a multiple of 16
+    if (count_bits(free_regs) < 2) return 0;
+    reg = last_reg_in_list(free_regs, x28);
+    int pair = last_reg_in_list(free_regs, reg - 1);
+    to_push = (1 << reg) | (1 << pair);
+  }
+
+  mambo_reserve_cc_space(ctx, 32);
+  if (to_push) {
+    emit_push(ctx, to_push);
+  }
+  if (mambo_calc_ld_st_addr(ctx, reg) != 0) {
+    if (to_push) {
+      emit_pop(ctx, to_push);
+    }
+    return 0;
+  }
+
+  *dead_regs &= ~(1 << reg);
+  ctx->code.ld_st_addr_reg = reg;
+
+  return to_push;
+}
+#endif
+
+/* Delivers the function callbacks for a function starting at read_address.
+   Bare fragments only get those which delimit the region of interest, while
+   code excluded by the module filter gets all of them */
+static void a64_function_cbs(dbm_thread *thread_data, mambo_context *ctx, uint32_t **read_address,
+                             uint32_t **write_p, uint32_t **data_p, int basic_block, bool bare) {
+  watched_functions_t *wf = &global_data.watched_functions;
+  bool direct_call = (*read_address == thread_data->post_fn_entry);
+  thread_data->post_fn_entry = NULL;
+
+  for (int i = 0; i < wf->funcp_count; i++) {
+    if (*read_address == wf->funcps[i].addr && (!bare || wf->funcps[i].func->in_bare)) {
+      ctx->code.write_p = *write_p;
+      ctx->code.data_p = *data_p;
+      _function_callback_wrapper(ctx, wf->funcps[i].func, direct_call);
+      if (ctx->code.replace) {
+        *read_address = ctx->code.read_address;
+      }
+      *write_p = ctx->code.write_p;
+      *data_p = ctx->code.data_p;
+      a64_check_free_space(thread_data, write_p, data_p, MIN_FSPACE, basic_block);
+    }
+  }
+}
+
+/* Returns true if the post-function callbacks of the function at addr can be
+   delivered at the return address of its direct calls, see POST_FN_RET_TAG.
+   The return stack is only checked by the inline hash lookup */
+static bool a64_post_fn_cbs_at_ret(uintptr_t addr, bool bare) {
+  watched_functions_t *wf = &global_data.watched_functions;
+  bool found = false;
+
+#ifndef DBM_INLINE_HASH
+  return false;
+#endif
+
+  for (int i = 0; i < wf->funcp_count; i++) {
+    watched_func_t *func = wf->funcps[i].func;
+    if ((uintptr_t)wf->funcps[i].addr == addr) {
+      if (func->replacement != NULL) return false;
+      if (func->post_callback != NULL && (!bare || func->in_bare)) {
+        found = true;
+      }
+    }
+  }
+
+  return found;
+}
+
+// Returns true if any direct call may push on the post_fn_ret_stack
+static bool a64_has_post_fn_cbs(void) {
+  watched_functions_t *wf = &global_data.watched_functions;
+
+  for (int i = 0; i < wf->funcp_count; i++) {
+    if (wf->funcps[i].func->post_callback != NULL) return true;
+  }
+  return false;
+}
+
+/* Delivers the post-function callbacks at the start of the fragment for the
+   tagged return address of the direct call at call_site, in reverse order
+   like nested return shims. LR already holds the untagged return address */
+static void a64_post_fn_cbs(dbm_thread *thread_data, uint32_t **write_p, uint32_t **data_p,
+                            uint32_t *call_site, int basic_block, cc_type type) {
+  watched_functions_t *wf = &global_data.watched_functions;
+  mambo_context ctx;
+  uint32_t op, imm26;
+
+  a64_B_BL_decode_fields(call_site, &op, &imm26);
+  assert(op == 1);
+  void *target = (void *)call_site + (sign_extend64(26, imm26) << 2);
+
+  for (int i = wf->funcp_count - 1; i >= 0; i--) {
+    watched_func_t *func = wf->funcps[i].func;
+    if (wf->funcps[i].addr == target && func->post_callback != NULL
+        && (!thread_data->bare || func->in_bare)) {
+      set_mambo_context_code(&ctx, thread_data, POST_FN_C, type, basic_block, A64_INST, A64_B_BL,
+                             AL, target, *write_p, *data_p, NULL);
+      ctx.plugin_id = func->plugin_id;
+      ctx.code.func_name = func->name;
+      func->post_callback(&ctx);
+      *write_p = ctx.code.write_p;
+      *data_p = ctx.code.data_p;
+      a64_check_free_space(thread_data, write_p, data_p, MIN_FSPACE, basic_block);
+    }
+  }
+}
+
+/*
+ * The region of interest markers switch the instrumentation of all threads,
+ * which the other threads see at their next fragment entry, and end the
+ * fragment, so that the following code runs in the new mode:
+ *   <safe fcall to mambo_roi_marker(on)>
+ *   STP  X0, X1, [SP, #-16]!
+ *   MOV  X0, #(read_address + 4)
+ *   MOV  X1, #basic_block
+ *   B    dispatcher
+ */
+#define ROI_MARKER_SZ 320
+
+static void a64_roi_marker(dbm_thread *thread_data, uint32_t **o_write_p, uint32_t **o_data_p,
+                           uint32_t *read_address, int basic_block, cc_type type) {
+  mambo_context ctx;
+  set_mambo_context_code(&ctx, thread_data, PRE_INST_C, type, basic_block, A64_INST, A64_HINT, AL,
+                         read_address, *o_write_p, *o_data_p, NULL);
+
+  emit_a64_flush_pending(&ctx);
+  mambo_reserve_cc_space(&ctx, ROI_MARKER_SZ);
+  int ret = emit_safe_fcall_static_args(&ctx, mambo_roi_marker, 1,
+                                        (uintptr_t)(*read_address == MAMBO_ROI_START_INST));
+  assert(ret == 0);
+
+  uint32_t *write_p = ctx.code.write_p;
+  a64_branch_save_context(&write_p);
+  a64_branch_jump(thread_data, &write_p, basic_block, (uint64_t)(read_address + 1),
+                  REPLACE_TARGET | INSERT_BRANCH);
+
+  *o_write_p = write_p;
+  *o_data_p = ctx.code.data_p;
+}
+
+/*
+ * With an instruction count region of interest, basic blocks subtract their
+ * number of instructions from the budget of the thread on entry and return to
+ * the dispatcher when it's exhausted, without modifying the flags:
+ *   LDR  X0, =&thread_data->roi_budget
+ *   LDR  X1, [X0]
+ *   SUB  X1, X1, #insts     // set at the end of the scan
+ *   STR  X1, [X0]
+ *   TBNZ X1, #63, expired
+ * expired:                  // in the data area of the block
+ *   MOV  X0, #read_address
+ *   MOV  X1, #0
+ *   B    dispatcher
+ * Returns the address of the SUB instruction.
+ */
+static uint32_t *a64_roi_count(dbm_thread *thread_data, uint32_t **o_write_p,
+                               uint32_t **o_data_p, uint32_t *read_address) {
+  uint32_t *write_p = *o_write_p;
+  uint32_t *data_p = *o_data_p;
+  uint32_t *stub, *sub;
+
+  data_p -= 2;
+  *(uint64_t *)data_p = (uint64_t)&thread_data->roi_budget;
+  a64_LDR_lit(&write_p, 1, 0, (data_p - write_p) & 0x7FFFF, x0);
+  write_p++;
+  a64_LDR_STR_unsigned_immed(&write_p, 3, 0, 1, 0, x0, x1);
+  write_p++;
+  sub = write_p;
+  a64_ADD_SUB_immed(&write_p, 1, 1, 0, 0, 0, x1, x1);
+  write_p++;
+  a64_LDR_STR_unsigned_immed(&write_p, 3, 0, 0, 0, x0, x1);
+  write_p++;
+
+  data_p -= MODE_STUB_SIZE;
+  stub = data_p;
+  a64_tbz_tbnz_helper(write_p, true, (uint64_t)stub, x1, 63);
+  write_p++;
+
+  a64_copy_to_reg_64bits(&stub, x0, (uint64_t)read_address);
+  a64_copy_to_reg_64bits(&stub, x1, 0);
+  a64_b_helper(stub, thread_data->dispatcher_addr);
+  stub++;
+  assert(stub <= (data_p + MODE_STUB_SIZE));
+  __clear_cache((char *)data_p, (char *)stub);
+
+  *o_write_p = write_p;
+  *o_data_p = data_p;
+
+  return sub;
+}
+
+bool a64_scanner_deliver_callbacks(dbm_thread *thread_data, mambo_cb_idx cb_id, uint32_t **o_read_address,
+                                   a64_instruction inst, uint32_t **o_write_p, uint32_t **o_data_p,
+                                   int basic_block, cc_type type, bool allow_write, bool *stop) {
+  bool replaced = false;
+#ifdef PLUGINS_NEW
+  thread_data->deferred_counters.closed = !allow_write;
+
+  /* Bare fragments and code excluded by the module filter are translated
+     without any instrumentation, other than some function callbacks */
+  bool filtered = !module_filter_allows(thread_data, (uintptr_t)*o_read_address);
+  if (global_data.free_plugin > 0 && !thread_data->bare && !filtered) {
+    uint32_t *write_p = *o_write_p;
+    uint32_t *data_p = *o_data_p;
+    uint32_t *read_address = *o_read_address;
+
+    mambo_cond cond = AL;
+    if (inst == A64_B_COND) {
+      uint32_t tmp;
+      a64_B_cond_decode_fields(read_address, &tmp, &cond);
+    }
+
+    uint32_t dead_regs = 0;
+    bool nzcv_dead = false;
+    if (cb_id == PRE_INST_C || cb_id == PRE_BB_C || cb_id == POST_INST_C) {
+      a64_get_liveness(thread_data, read_address, cb_id == POST_INST_C, &dead_regs, &nzcv_dead);
+    }
+    uint32_t coalesce_regs = 0;
+    if (cb_id == PRE_INST_C || cb_id == POST_INST_C) {
+      coalesce_regs = a64_coalesce_regs(read_address);
+    }
+
+    mambo_context ctx;
+    set_mambo_context_code(&ctx, thread_data, cb_id, type, basic_block, A64_INST, inst, cond, read_address, write_p, data_p, stop);
+
+    /* Restores the registers left spilled by the previous instrumentation
+       point if this instruction, or the instrumentation reading its
+       operands, need them */
+    if (allow_write && (thread_data->pending_spill & ~coalesce_regs) != 0) {
+      emit_a64_flush_spills(&ctx);
+      write_p = ctx.code.write_p;
+      data_p = ctx.code.data_p;
+    }
+
+    uint32_t shared_regs = 0;
+    if (cb_id == PRE_INST_C && allow_write && global_data.share_ld_st_addr
+        && mambo_is_load_or_store(&ctx)) {
+      ctx.code.write_p = write_p;
+      ctx.code.data_p = data_p;
+      shared_regs = a64_share_ld_st_addr(&ctx, &dead_regs);
+      write_p = ctx.code.write_p;
+      data_p = ctx.code.data_p;
+    }
+
+    for (int i = 0; i < global_data.free_plugin; i++) {
+      if (global_data.plugins[i].cbs[cb_id] != NULL) {
+        ctx.code.write_p = write_p;
+        ctx.code.data_p = data_p;
+        ctx.plugin_id = i;
+        ctx.code.replace = false;
+        ctx.code.available_regs = ctx.code.pushed_regs;
+        ctx.code.dead_regs = dead_regs & ~ctx.code.pushed_regs;
+        ctx.code.nzcv_dead = nzcv_dead;
+        ctx.code.dead_scratch_regs = 0;
+        ctx.code.elided_regs = 0;
+        ctx.code.coalesce_regs = coalesce_regs;
+        global_data.plugins[i].cbs[cb_id](&ctx);
+        if (allow_write) {
+          if (replaced && (write_p != ctx.code.write_p || ctx.code.replace)) {
+            fprintf(stderr, "MAMBO API WARNING: plugin %d added code for overridden"
+                            "instruction (%p).\n", i, read_address);
+          }
+          if (ctx.code.replace) {
+            if (cb_id == PRE_INST_C) {
+              replaced = true;
+            } else {
+              fprintf(stderr, "MAMBO API WARNING: plugin %d set replace_inst for "
+                              "a disallowed event (at %p).\n", i, read_address);
+            }
+          }
+          assert(count_bits(ctx.code.pushed_regs | shared_regs) == ctx.code.plugin_pushed_reg_count);
+          if (allow_write && ctx.code.pushed_regs) {
+            emit_pop(&ctx, ctx.code.pushed_regs);
+            ctx.code.pushed_regs = 0;
+          }
+          write_p = ctx.code.write_p;
+          data_p = ctx.code.data_p;
+          a64_check_free_space(thread_data, &write_p, &data_p, MIN_FSPACE, basic_block);
+        } else {
+          assert(ctx.code.write_p == write_p);
+          assert(ctx.code.data_p == data_p);
+        }
+      }
+    }
+
+    if (ctx.code.ld_st_addr_reg != reg_invalid) {
+      ctx.code.ld_st_addr_reg = reg_invalid;
+      if (shared_regs) {
+        ctx.code.write_p = write_p;
+        ctx.code.data_p = data_p;
+        ctx.code.dead_regs = 0;
+        ctx.code.elided_regs = 0;
+        ctx.code.coalesce_regs = coalesce_regs;
+        emit_pop(&ctx, shared_regs);
+        write_p = ctx.code.write_p;
+        data_p = ctx.code.data_p;
+      }
+    }
+
+    if (cb_id == PRE_INST_C) {
+      ctx.code.write_p = write_p;
+      ctx.code.data_p = data_p;
+      emit_a64_deferred_counters(&ctx);
+      write_p = ctx.code.write_p;
+      data_p = ctx.code.data_p;
+    }
+
+    if (cb_id == PRE_BB_C) {
+      a64_function_cbs(thread_data, &ctx, &read_address, &write_p, &data_p, basic_block, false);
+    }
+
+    *o_write_p = write_p;
+    *o_data_p = data_p;
+    *o_read_address = read_address;
+  } else if (global_data.free_plugin > 0 && cb_id == PRE_BB_C && allow_write) {
+    mambo_context ctx;
+    set_mambo_context_code(&ctx, thread_data, cb_id, type, basic_block, A64_INST, inst, AL,
+                           *o_read_address, *o_write_p, *o_data_p, stop);
+    a64_function_cbs(thread_data, &ctx, o_read_address, o_write_p, o_data_p, basic_block, thread_data->bare);
+  } else if (cb_id == PRE_INST_C && allow_write
+             && (thread_data->pending_spill != 0 || thread_data->deferred_counters.count != 0)) {
+    // Neither can be carried across uninstrumented code, which may leave the fragment
+    mambo_context ctx;
+    set_mambo_context_code(&ctx, thread_data, cb_id, type, basic_block, A64_INST, inst, AL,
+                           *o_read_address, *o_write_p, *o_data_p, stop);
+    emit_a64_flush_pending(&ctx);
+    *o_write_p = ctx.code.write_p;
+    *o_data_p = ctx.code.data_p;
+  }
+#endif
+  return replaced;
+}
+
+#ifdef DBM_INLINE_UNCOND_IMM
+/*
+  Continues scanning at the target of an unconditional direct branch (B / BL)
+  instead of ending the fragment. Backward targets are followed at most
+  MAX_BACK_INLINE times to avoid unrolling loops, and at most MAX_UNCOND_INLINE
+  branches are followed in total to bound the size of the fragment.
+  Returns false when the limit has been reached and the caller must emit an exit.
+*/
+bool a64_inline_uncond_imm(dbm_thread *thread_data, bool insert_branch, uint32_t **write_p,
+                           uint32_t **data_p, uint32_t **read_addr, uint32_t **bb_entry,
+                           uint64_t target, int *inlined_count, int *inlined_back_count,
+                           int basic_block, cc_type type, bool *stop) {
+  if (*inlined_count >= MAX_UNCOND_INLINE) {
+    return false;
+  }
+  if (target <= (uint64_t)*read_addr) {
+    if (*inlined_back_count >= MAX_BACK_INLINE) {
+      return false;
+    }
+    *inlined_back_count += 1;
+  }
+  *inlined_count += 1;
+
+  if (insert_branch) {
+    a64_scanner_deliver_callbacks(thread_data, POST_BB_C, bb_entry, -1,
+                                  write_p, data_p, basic_block, type, false, stop);
+  }
+  *read_addr = (uint32_t *)target;
+  if (insert_branch) {
+    *bb_entry = *read_addr;
+    a64_scanner_deliver_callbacks(thread_data, PRE_BB_C, read_addr, -1,
+                                  write_p, data_p, basic_block, type, true, stop);
+  }
+
+  // Assumes the read pointer is incremented at the end of the current scanner iteration
+  *read_addr -= 1;
+
+  return true;
+}
+#endif
+
+void pass1_a64(uint32_t *read_address, branch_type *bb_type) {
+#ifdef DBM_INLINE_UNCOND_IMM
+  uint32_t op, imm26;
+  int inlined_count = 0;
+  int inlined_back_count = 0;
+#endif
+
+  *bb_type = unknown;
+
+  while(*bb_type == unknown) {
+    a64_instruction instruction = a64_decode(read_address);
+
+    switch(instruction) {
+      case A64_B_BL:
+#ifdef DBM_INLINE_UNCOND_IMM
+        a64_B_BL_decode_fields(read_address, &op, &imm26);
+        uint64_t target = (uint64_t)read_address + (sign_extend64(26, imm26) << 2);
+        if (!a64_inline_uncond_imm(NULL, false, NULL, NULL, &read_address, NULL, target,
+                                   &inlined_count, &inlined_back_count, -1, -1, NULL)) {
+          *bb_type = uncond_imm_a64;
+        }
+#else
+        *bb_type = uncond_imm_a64;
+#endif
+        break;
+      case A64_CBZ_CBNZ:
+        *bb_type = cbz_a64;
+        break;
+      case A64_B_COND:
+        *bb_type = cond_imm_a64;
+        break;
+      case A64_TBZ_TBNZ:
+        *bb_type = tbz_a64;
+        break;
+      case A64_BR:
+      case A64_BLR:
+      case A64_RET:
+        *bb_type = uncond_branch_reg;
+        break;
+      case A64_INVALID:
+        return;
+    }
+    read_address++;
+  }
+}
+
+#ifdef DBM_LINK_PLT
+/*
+ * Calls into shared libraries go through PLT stubs, which end with an
+ * indirect branch to the address loaded from the GOT:
+ *   ADRP X16, page(GOT entry)
+ *   LDR  X17, [X16, #pageoff(GOT entry)]
+ *   ADD  X16, X16, #pageoff(GOT entry)
+ *   BR   X17
+ * Returns the address of the GOT entry if the BR at read_address ends a PLT
+ * stub scanned as part of the current basic block, or NULL otherwise.
+ */
+static uintptr_t *a64_plt_got_entry(uint32_t *read_address, uint32_t *bb_entry) {
+  uint32_t *stub = read_address - 3;
+  uint32_t op, immlo, immhi, Rd;
+  uint32_t size, V, opc, imm12, Rn, Rt;
+  uint32_t sf, S, shift, add_imm12;
+
+  a64_BR_decode_fields(read_address, &Rn);
+  if (stub < bb_entry || Rn != x17
+      || a64_decode(&stub[0]) != A64_ADR
+      || a64_decode(&stub[1]) != A64_LDR_STR_UNSIGNED_IMMED
+      || a64_decode(&stub[2]) != A64_ADD_SUB_IMMED) {
+    return NULL;
+  }
+
+  a64_ADR_decode_fields(&stub[0], &op, &immlo, &immhi, &Rd);
+  if (op != 1 || Rd != x16) return NULL;
+
+  a64_LDR_STR_unsigned_immed_decode_fields(&stub[1], &size, &V, &opc, &imm12, &Rn, &Rt);
+  if (size != 3 || V != 0 || opc != 1 || Rn != x16 || Rt != x17) return NULL;
+
+  a64_ADD_SUB_immed_decode_fields(&stub[2], &sf, &op, &S, &shift, &add_imm12, &Rn, &Rd);
+  if (sf != 1 || op != 0 || S != 0 || shift != 0 || Rn != x16 || Rd != x16
+      || add_imm12 != (imm12 << 3)) {
+    return NULL;
+  }
+
+  uintptr_t page = ((uintptr_t)stub & ~0xFFFUL) + (sign_extend64(21, (immhi << 2) | immlo) << 12);
+  return (uintptr_t *)(page + (imm12 << 3));
+}
+
+#define A64_BTI_C 0xD503245F
+#define A64_PLT0_STP 0xA9BF7BF0 // STP X16, X30, [SP, #-16]!
+
+/* Before lazy binding, GOT entries point to the resolver stub at the start of
+   the PLT, PLT0 */
+static bool a64_is_plt(uint32_t *target) {
+  if (*target == A64_BTI_C) {
+    target++;
+  }
+  return *target == A64_PLT0_STP
+         || (a64_decode(&target[3]) == A64_BR && a64_plt_got_entry(&target[3], target) != NULL);
+}
+
+/*
+ * The target found in the GOT entry at scan time is linked directly, guarded
+ * by a check that the entry hasn't been updated since. The first time the
+ * check fails, e.g. after lazy binding, the fragment is retranslated through
+ * the dispatcher to link the new value. Targets in the PLT aren't linked, the
+ * inline hash lookup of the BR follows instead:
+ *   STP  X0, X1, [SP, #-16]!
+ *   MOV  X0, #got_value
+ *   SUB  X0, X0, X17
+ *   CBZ  X0, hit
+ *   MOV  X0, X17
+ *   MOV  X1, #(basic_block | PLT_RELINK_SOURCE)
+ *   B    dispatcher
+ * hit:
+ *   LDP  X0, X1, [SP], #16
+ *   B    <translation of got_value>     // unless got_value is in the PLT
+ * The B is recorded in plt_link_addr, so that unlinking the fragment for
+ * signal delivery redirects it to the inline hash lookup.
+ */
+#define PLT_LINK_SIZE (16 * 4)
+
+static void a64_link_plt(dbm_thread *thread_data, uint32_t **o_write_p, uintptr_t *got_entry,
+                         int basic_block) {
+  uint32_t *write_p = *o_write_p;
+  uintptr_t target = *got_entry;
+  uint32_t *branch_hit;
+
+  a64_push_pair_reg(x0, x1);
+  a64_copy_to_reg_64bits(&write_p, x0, target);
+  a64_ADD_SUB_shift_reg(&write_p, 1, 1, 0, 0, x17, 0, x0, x0);
+  write_p++;
+  branch_hit = write_p++;
+
+  // MOV X0, X17 (Alias of ORR X0, X17, XZR)
+  a64_logical_reg(&write_p, 1, 1, 0, 0, x17, 0, xzr, x0);
+  write_p++;
+  a64_copy_to_reg_64bits(&write_p, x1, (uint32_t)basic_block | PLT_RELINK_SOURCE);
+  a64_b_helper(write_p, thread_data->dispatcher_addr);
+  write_p++;
+
+  a64_cbz_cbnz_helper(branch_hit, false, (uint64_t)write_p, 1, x0);
+  a64_pop_pair_reg(x0, x1);
+  if (!a64_is_plt((uint32_t *)target)) {
+    thread_data->code_cache_meta_cold[basic_block].plt_link_addr = write_p;
+    a64_cc_branch(thread_data, write_p, lookup_or_stub(thread_data, target) + 4);
+    write_p++;
+  }
+
+  *o_write_p = write_p;
+}
+#endif
+
+/* The lookup part of a64_inline_hash_lookup(), from MOV X0, #hash_table. X0
+   and X1, and X2 if use_x2 is set, must have been pushed */
+static void a64_ihl_lookup(dbm_thread *thread_data, int basic_block, uint32_t **o_write_p,
+                           uint32_t reg_spc, uint32_t reg_tmp, bool use_x2) {
+  uint32_t *write_p = *o_write_p;
+  uint32_t *loop;
+  uint32_t *branch_to_not_found;
+
+  a64_copy_to_reg_64bits(&write_p, x0,
+                         (uint64_t)active_entry_address(thread_data)->entries);
+
+  a64_logical_immed(&write_p, 1, 0, 1, 62, 18, reg_spc, reg_tmp);
+  write_p++;
+
+  a64_ADD_SUB_shift_reg(&write_p, 1, 0, 0, 0, reg_tmp, 0x2, x0, x0);
+  write_p++;
+
+  loop = write_p;
+  a64_LDR_STR_immed(&write_p, 3, 0, 1, 16, 1, x0, reg_tmp);
+  write_p++;
 
-  *bb_type = unknown;
+  branch_to_not_found = write_p++;
 
-  while(*bb_type == unknown) {
-    a64_instruction instruction = a64_decode(read_address);
+  a64_ADD_SUB_shift_reg(&write_p, 1, 1, 0, 0, reg_spc, 0, reg_tmp, reg_tmp);
+  write_p++;
 
-    switch(instruction) {
-      case A64_B_BL:
-        *bb_type = uncond_imm_a64;
-        break;
-      case A64_CBZ_CBNZ:
-        *bb_type = cbz_a64;
-        break;
-      case A64_B_COND:
-        *bb_type = cond_imm_a64;
-        break;
-      case A64_TBZ_TBNZ:
-        *bb_type = tbz_a64;
-        break;
-      case A64_BR:
-      case A64_BLR:
-      case A64_RET:
-        *bb_type = uncond_branch_reg;
-        break;
-      case A64_INVALID:
-        return;
-    }
-    read_address++;
-  }
-}
+  a64_cbnz_helper(write_p, (uint64_t)loop, 1, reg_tmp);
+  write_p++;
 
-bool a64_scanner_deliver_callbacks(dbm_thread *thread_data, mambo_cb_idx cb_id, uint32_t **o_read_address,
-                                   a64_instruction inst, uint32_t **o_write_p, uint32_t **o_data_p,
-                                   int basic_block, cc_type type, bool allow_write, bool *stop) {
-  bool replaced = false;
-#ifdef PLUGINS_NEW
-  if (global_data.free_plugin > 0) {
-    uint32_t *write_p = *o_write_p;
-    uint32_t *data_p = *o_data_p;
-    uint32_t *read_address = *o_read_address;
+  a64_LDR_STR_immed(&write_p, 3, 0, 1, -8, 0, x0, x0);
+  write_p++;
 
-    mambo_cond cond = AL;
-    if (inst == A64_B_COND) {
-      uint32_t tmp;
-      a64_B_cond_decode_fields(read_address, &tmp, &cond);
-    }
+  if (use_x2) {
+    a64_pop_reg(x2);
+  }
 
-    mambo_context ctx;
-    set_mambo_context_code(&ctx, thread_data, cb_id, type, basic_block, A64_INST, inst, cond, read_address, write_p, data_p, stop);
+  a64_BR(&write_p, x0);
+  write_p++;
 
-    for (int i = 0; i < global_data.free_plugin; i++) {
-      if (global_data.plugins[i].cbs[cb_id] != NULL) {
-        ctx.code.write_p = write_p;
-        ctx.code.data_p = data_p;
-        ctx.plugin_id = i;
-        ctx.code.replace = false;
-        ctx.code.available_regs = ctx.code.pushed_regs;
-        global_data.plugins[i].cbs[cb_id](&ctx);
-        if (allow_write) {
-          if (replaced && (write_p != ctx.code.write_p || ctx.code.replace)) {
-            fprintf(stderr, "MAMBO API WARNING: plugin %d added code for overridden"
-                            "instruction (%p).\n", i, read_address);
-          }
-          if (ctx.code.replace) {
-            if (cb_id == PRE_INST_C) {
-              replaced = true;
-            } else {
-              fprintf(stderr, "MAMBO API WARNING: plugin %d set replace_inst for "
-                              "a disallowed event (at %p).\n", i, read_address);
-            }
-          }
-          assert(count_bits(ctx.code.pushed_regs) == ctx.code.plugin_pushed_reg_count);
-          if (allow_write && ctx.code.pushed_regs) {
-            emit_pop(&ctx, ctx.code.pushed_regs);
-          }
-          write_p = ctx.code.write_p;
-          data_p = ctx.code.data_p;
-          a64_check_free_space(thread_data, &write_p, &data_p, MIN_FSPACE, basic_block);
-        } else {
-          assert(ctx.code.write_p == write_p);
-          assert(ctx.code.data_p == data_p);
-        }
-      }
-    }
+  a64_cbz_helper(branch_to_not_found, (uint64_t)write_p, 1, reg_tmp);
 
-    if (cb_id == PRE_BB_C) {
-      watched_functions_t *wf = &global_data.watched_functions;
-      for (int i = 0; i < wf->funcp_count; i++) {
-        if (read_address == wf->funcps[i].addr) {
-          _function_callback_wrapper(&ctx, wf->funcps[i].func);
-          if (ctx.code.replace) {
-            read_address = ctx.code.read_address;
-          }
-          write_p = ctx.code.write_p;
-          data_p = ctx.code.data_p;
-          a64_check_free_space(thread_data, &write_p, &data_p, MIN_FSPACE, basic_block);
-        }
-      }
-    }
+  a64_logical_reg(&write_p, 1, 1, 0, 0, reg_spc, 0, xzr, x0);
+  write_p++;
 
-    *o_write_p = write_p;
-    *o_data_p = data_p;
-    *o_read_address = read_address;
+  a64_copy_to_reg_64bits(&write_p, x1, basic_block);
+
+  if (use_x2) {
+    a64_pop_reg(x2);
   }
-#endif
-  return replaced;
+
+  a64_b_helper(write_p, (uint64_t)thread_data->dispatcher_addr);
+  write_p++;
+
+  *o_write_p = write_p;
 }
 
 void a64_inline_hash_lookup(dbm_thread *thread_data, int basic_block, uint32_t **o_write_p,
@@ -486,8 +1612,6 @@ void a64_inline_hash_lookup(dbm_thread *thread_data, int basic_block, uint32_t *
    */
 
   uint32_t *write_p = *o_write_p;
-  uint32_t *loop;
-  uint32_t *branch_to_not_found;
   uint32_t reg_spc, reg_tmp;
   bool use_x2 = false;
 
@@ -519,53 +1643,177 @@ void a64_inline_hash_lookup(dbm_thread *thread_data, int basic_block, uint32_t *
     a64_copy_to_reg_64bits(&write_p, lr, (uint64_t)read_address + 4);
   }
 
-  a64_copy_to_reg_64bits(&write_p, x0,
-                         (uint64_t)&thread_data->entry_address.entries);
+  a64_ihl_lookup(thread_data, basic_block, &write_p, reg_spc, reg_tmp, use_x2);
+  *o_write_p = write_p;
+}
 
-  a64_logical_immed(&write_p, 1, 0, 1, 62, 18, reg_spc, reg_tmp);
-  write_p++;
+// Extra space used by a64_post_fn_ret_lookup() over a64_inline_hash_lookup()
+#define POST_FN_RET_CHECK_SIZE (32 * 4)
 
-  a64_ADD_SUB_shift_reg(&write_p, 1, 0, 0, 0, reg_tmp, 0x2, x0, x0);
-  write_p++;
+#ifdef PLUGINS_NEW
+/*
+ * Direct calls to functions with post-function callbacks push their return
+ * address, already in LR, and the stack pointer on the post_fn_ret_stack of
+ * the thread. If it's full, the call goes through the dispatcher to the
+ * untagged entry of the function, which delivers the post-function callbacks
+ * with the return shim instead, so none are lost:
+ *   STP  X0, X1, [SP, #-16]!
+ *   MOV  X0, #&post_fn_ret_stack
+ *   LDR  X1, [X0]
+ *   TBZ  X1, #POST_FN_RET_STACK_BITS, push
+ *   MOV  X0, #target
+ *   MOV  X1, #0
+ *   B    dispatcher
+ * push:
+ *   ADD  X1, X1, #1
+ *   STR  X1, [X0]
+ *   ADD  X0, X0, X1, LSL #4
+ *   STR  LR, [X0]
+ *   ADD  X1, SP, #16
+ *   STR  X1, [X0, #8]
+ *   LDP  X0, X1, [SP], #16
+ */
+#define POST_FN_RET_PUSH_SIZE (20 * 4)
+static void a64_post_fn_ret_push(dbm_thread *thread_data, uint32_t **o_write_p, uint64_t target) {
+  uint32_t *write_p = *o_write_p;
+  uint32_t *branch_to_push;
 
-  loop = write_p;
-  a64_LDR_STR_immed(&write_p, 3, 0, 1, 16, 1, x0, reg_tmp);
+  a64_push_pair_reg(x0, x1);
+  a64_copy_to_reg_64bits(&write_p, x0, (uint64_t)&thread_data->post_fn_ret_stack);
+  a64_LDR_STR_unsigned_immed(&write_p, 3, 0, 1, 0, x0, x1);
   write_p++;
+  branch_to_push = write_p++;
 
-  branch_to_not_found = write_p++;
-
-  a64_ADD_SUB_shift_reg(&write_p, 1, 1, 0, 0, reg_spc, 0, reg_tmp, reg_tmp);
+  a64_copy_to_reg_64bits(&write_p, x0, target);
+  a64_copy_to_reg_64bits(&write_p, x1, 0);
+  a64_b_helper(write_p, thread_data->dispatcher_addr);
   write_p++;
 
-  a64_cbnz_helper(write_p, (uint64_t)loop, 1, reg_tmp);
+  a64_tbz_helper(branch_to_push, (uint64_t)write_p, x1, POST_FN_RET_STACK_BITS);
+  a64_ADD_SUB_immed(&write_p, 1, 0, 0, 0, 1, x1, x1);
   write_p++;
-
-  a64_LDR_STR_immed(&write_p, 3, 0, 1, -8, 0, x0, x0);
+  a64_LDR_STR_unsigned_immed(&write_p, 3, 0, 0, 0, x0, x1);
+  write_p++;
+  a64_ADD_SUB_shift_reg(&write_p, 1, 0, 0, 0, x1, 4, x0, x0);
   write_p++;
+  a64_LDR_STR_unsigned_immed(&write_p, 3, 0, 0, 0, x0, lr);
+  write_p++;
+  a64_ADD_SUB_immed(&write_p, 1, 0, 0, 0, 16, sp, x1);
+  write_p++;
+  a64_LDR_STR_unsigned_immed(&write_p, 3, 0, 0, 1, x0, x1);
+  write_p++;
+  a64_pop_pair_reg(x0, x1);
 
-  if (use_x2) {
-    a64_pop_reg(x2);
-  }
+  *o_write_p = write_p;
+}
 
-  a64_BR(&write_p, x0);
+/*
+ * RET LR first discards the entries of the post_fn_ret_stack whose stack
+ * pointer is below the current one, left by returns which skipped them, e.g.
+ * with longjmp(). If the top entry then matches both the return address and
+ * the stack pointer, it's popped and the IHL looks up the return address
+ * tagged with POST_FN_RET_TAG instead, LR itself isn't changed:
+ *   STP  X0, X1, [SP, #-16]!
+ *   STP  X2, X3, [SP, #-16]!
+ *   MOV  X0, #&post_fn_ret_stack
+ *   LDR  X2, [X0]
+ *   ADD  X0, X0, X2, LSL #4
+ *   ADD  X3, SP, #32
+ * loop:
+ *   CBZ  X2, no_match
+ *   LDR  X1, [X0, #8]
+ *   SUB  X1, X1, X3
+ *   TBZ  X1, #63, check
+ *   SUB  X2, X2, #1
+ *   SUB  X0, X0, #16
+ *   B    loop
+ * check:
+ *   CBNZ X1, no_match
+ *   LDR  X1, [X0]
+ *   SUB  X1, X1, LR
+ *   CBNZ X1, no_match
+ *   SUB  X2, X2, #1
+ *   MOV  X1, LR
+ *   ORR  X1, X1, #POST_FN_RET_TAG
+ *   B    store
+ * no_match:
+ *   MOV  X1, LR
+ * store:
+ *   MOV  X0, #&post_fn_ret_stack
+ *   STR  X2, [X0]
+ *   LDR  X3, [SP, #8]
+ *   <IHL lookup of X1>
+ */
+static void a64_post_fn_ret_lookup(dbm_thread *thread_data, int basic_block, uint32_t **o_write_p) {
+  uint32_t *write_p = *o_write_p;
+  uint64_t stack = (uint64_t)&thread_data->post_fn_ret_stack;
+  uint32_t *loop, *branch_to_check, *branch_to_no_match[3], *branch_to_store;
+
+  // The signal handler reads the target of the IHL from this register
+  thread_data->code_cache_meta[basic_block].rn = x1;
+
+  a64_push_pair_reg(x0, x1);
+  a64_LDP_STP(&write_p, 2, 0, 3, 0, -2, x3, sp, x2);
   write_p++;
 
-  a64_cbz_helper(branch_to_not_found, (uint64_t)write_p, 1, reg_tmp);
+  a64_copy_to_reg_64bits(&write_p, x0, stack);
+  a64_LDR_STR_unsigned_immed(&write_p, 3, 0, 1, 0, x0, x2);
+  write_p++;
+  a64_ADD_SUB_shift_reg(&write_p, 1, 0, 0, 0, x2, 4, x0, x0);
+  write_p++;
+  a64_ADD_SUB_immed(&write_p, 1, 0, 0, 0, 32, sp, x3);
+  write_p++;
 
-  a64_logical_reg(&write_p, 1, 1, 0, 0, reg_spc, 0, xzr, x0);
+  // Discard the stale entries
+  loop = write_p;
+  branch_to_no_match[0] = write_p++;
+  a64_LDR_STR_unsigned_immed(&write_p, 3, 0, 1, 1, x0, x1);
+  write_p++;
+  a64_ADD_SUB_shift_reg(&write_p, 1, 1, 0, 0, x3, 0, x1, x1);
+  write_p++;
+  branch_to_check = write_p++;
+  a64_ADD_SUB_immed(&write_p, 1, 1, 0, 0, 1, x2, x2);
+  write_p++;
+  a64_ADD_SUB_immed(&write_p, 1, 1, 0, 0, 16, x0, x0);
+  write_p++;
+  a64_b_helper(write_p, (uint64_t)loop);
   write_p++;
 
-  a64_copy_to_reg_64bits(&write_p, x1, basic_block);
+  // Match the top entry
+  a64_tbz_helper(branch_to_check, (uint64_t)write_p, x1, 63);
+  branch_to_no_match[1] = write_p++;
+  a64_LDR_STR_unsigned_immed(&write_p, 3, 0, 1, 0, x0, x1);
+  write_p++;
+  a64_ADD_SUB_shift_reg(&write_p, 1, 1, 0, 0, lr, 0, x1, x1);
+  write_p++;
+  branch_to_no_match[2] = write_p++;
+  a64_ADD_SUB_immed(&write_p, 1, 1, 0, 0, 1, x2, x2);
+  write_p++;
+  a64_logical_reg(&write_p, 1, 1, 0, 0, lr, 0, xzr, x1);
+  write_p++;
+  // ORR X1, X1, #POST_FN_RET_TAG
+  a64_logical_immed(&write_p, 1, 1, 1, 63, 0, x1, x1);
+  write_p++;
+  branch_to_store = write_p++;
 
-  if (use_x2) {
-    a64_pop_reg(x2);
-  }
+  a64_cbz_helper(branch_to_no_match[0], (uint64_t)write_p, 1, x2);
+  a64_cbnz_helper(branch_to_no_match[1], (uint64_t)write_p, 1, x1);
+  a64_cbnz_helper(branch_to_no_match[2], (uint64_t)write_p, 1, x1);
+  a64_logical_reg(&write_p, 1, 1, 0, 0, lr, 0, xzr, x1);
+  write_p++;
 
-  a64_b_helper(write_p, (uint64_t)thread_data->dispatcher_addr);
+  a64_b_helper(branch_to_store, (uint64_t)write_p);
+  a64_copy_to_reg_64bits(&write_p, x0, stack);
+  a64_LDR_STR_unsigned_immed(&write_p, 3, 0, 0, 0, x0, x2);
   write_p++;
+  a64_LDR_STR_unsigned_immed(&write_p, 3, 0, 1, 1, sp, x3);
+  write_p++;
+
+  a64_ihl_lookup(thread_data, basic_block, &write_p, x1, x2, true);
 
   *o_write_p = write_p;
 }
+#endif
 
 size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
                 int basic_block, cc_type type, uint32_t *write_p) {
@@ -573,6 +1821,8 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
 
   uint32_t *start_scan = read_address, *bb_entry = read_address;
   uint32_t *data_p;
+  uint32_t **cold_data_p;
+  uint32_t *hot_p;
   uint32_t *start_address;
   enum reg spilled_reg;
 
@@ -588,6 +1838,15 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
 
   bool TPIDR_EL0;
 
+#ifdef DBM_INLINE_UNCOND_IMM
+  int inlined_count = 0;
+  int inlined_back_count = 0;
+#endif
+#ifdef PLUGINS_NEW
+  uint32_t *roi_count_p = NULL;
+  int roi_insts = 0;
+#endif
+
   if (write_p == NULL) {
     write_p = (uint32_t *) &thread_data->code_cache->blocks[basic_block];
   }
@@ -596,10 +1855,38 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
 
   if (type == mambo_bb) {
     data_p = write_p + BASIC_BLOCK_SIZE;
+    cold_data_p = &data_p;
   } else { // mambo_trace
     data_p = (uint32_t *)&thread_data->code_cache->traces + (TRACE_CACHE_SIZE / 4);
     thread_data->code_cache_meta[basic_block].free_b = 0;
+    // trace exits are rewritten by install_trace(), keep their stubs inline
+    cold_data_p = NULL;
+  }
+#ifdef PLUGINS_NEW
+  // Literals emitted by plugins are only shared within a fragment
+  thread_data->lit_pool.count = 0;
+  // Emitted before the exit of the previous fragment
+  assert(thread_data->deferred_counters.count == 0);
+  thread_data->deferred_counters.in_exclusive = false;
+  thread_data->deferred_counters.closed = false;
+  thread_data->liveness.count = 0;
+  // Restored before the exit of the previous fragment
+  assert(thread_data->pending_spill == 0);
+  thread_data->post_fn_entry = NULL;
+
+  /* Tagged addresses of direct calls to functions with post-function callbacks,
+     the mode switch stubs must dispatch to the tagged address */
+  uint32_t *tagged_address = read_address;
+  uint32_t *post_fn_call_site = NULL;
+  if ((uintptr_t)read_address & POST_FN_ENTRY_TAG) {
+    read_address = (uint32_t *)((uintptr_t)read_address & ~POST_FN_ENTRY_TAG);
+    thread_data->post_fn_entry = read_address;
+  } else if ((uintptr_t)read_address & POST_FN_RET_TAG) {
+    read_address = (uint32_t *)((uintptr_t)read_address & ~POST_FN_RET_TAG);
+    post_fn_call_site = read_address - 1;
   }
+  start_scan = bb_entry = read_address;
+#endif
 
   /*
    * On context switches registers X0 and X1 are used to store the target
@@ -610,6 +1897,30 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
    * trace fragments do not need a pop instruction.
    */
   if (type != mambo_trace) {
+    bool entry_checks = global_data.poll_signals;
+#ifdef PLUGINS_NEW
+    entry_checks = entry_checks || global_data.dual_mode;
+#endif
+    if (entry_checks) {
+      a64_b_helper(write_p, (uint64_t)(write_p + 2));
+      write_p++;
+      a64_push_pair_reg(x0, x1);
+    }
+#ifdef PLUGINS_NEW
+    if (global_data.dual_mode) {
+      a64_check_cc_mode(thread_data, &write_p, &data_p, tagged_address);
+    }
+    if (global_data.poll_signals) {
+      a64_poll_signals(thread_data, &write_p, tagged_address);
+    }
+    if (global_data.roi.inst_count) {
+      roi_count_p = a64_roi_count(thread_data, &write_p, &data_p, tagged_address);
+    }
+#else
+    if (global_data.poll_signals) {
+      a64_poll_signals(thread_data, &write_p, read_address);
+    }
+#endif
     a64_pop_pair_reg(x0, x1);
   }
 
@@ -617,15 +1928,61 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
   branch_type bb_type;
   pass1_a64(read_address, &bb_type);
 
-  if (type == mambo_bb && bb_type != uncond_branch_reg && bb_type != unknown) {
-    a64_push_pair_reg(x1, x30);
+  /* Traces are not built with dual-mode translation, their fragments would
+     skip the mode checks */
+  if (type == mambo_bb && bb_type != uncond_branch_reg && bb_type != unknown
+#ifdef PLUGINS_NEW
+      && !global_data.dual_mode
+#endif
+     ) {
+    /*
+     * Inline execution counter. The common path only uses X2 and X3 and
+     * doesn't modify the flags. When the counter reaches zero, the stack
+     * layout expected by create_trace_trampoline is completed:
+     *   STP  X2, X3, [SP, #-32]!
+     *   MOV  X2, #&exec_count[basic_block]
+     *   LDRB W3, [X2]
+     *   SUB  W3, W3, #1
+     *   STRB W3, [X2]
+     *   CBNZ W3, counted
+     *   STP  X1, X30, [SP, #16]
+     *   MOV  X1, #basic_block
+     *   B    create_trace_trampoline
+     * counted:
+     *   LDP  X2, X3, [SP], #32
+     */
+    uint32_t *cbnz_branch;
+
+    a64_LDP_STP(&write_p, 2, 0, 3, 0, -4, x3, sp, x2);
+    write_p++;
+
+    a64_copy_to_reg_64bits(&write_p, x2, (uintptr_t)&thread_data->exec_count[basic_block]);
+
+    a64_LDR_STR_unsigned_immed(&write_p, 0, 0, 1, 0, x2, x3);
+    write_p++;
+    a64_ADD_SUB_immed(&write_p, 0, 1, 0, 0, 1, x3, x3);
+    write_p++;
+    a64_LDR_STR_unsigned_immed(&write_p, 0, 0, 0, 0, x2, x3);
+    write_p++;
+
+    cbnz_branch = write_p++;
 
+    a64_LDP_STP(&write_p, 2, 0, 2, 0, 2, x30, sp, x1);
+    write_p++;
     a64_copy_to_reg_64bits(&write_p, x1, (int)basic_block);
+    a64_b_helper(write_p, thread_data->create_trace_trampoline_addr);
+    write_p++;
 
-    a64_bl_helper(write_p, thread_data->trace_head_incr_addr);
+    a64_cbz_cbnz_helper(cbnz_branch, true, (uint64_t)write_p, 0, x3);
+
+    a64_LDP_STP(&write_p, 2, 0, 1, 1, 4, x3, sp, x2);
     write_p++;
+  }
+#endif
 
-    a64_pop_pair_reg(x1, x30);
+#ifdef PLUGINS_NEW
+  if (post_fn_call_site != NULL) {
+    a64_post_fn_cbs(thread_data, &write_p, &data_p, post_fn_call_site, basic_block, type);
   }
 #endif
 
@@ -649,11 +2006,13 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
 
     switch (inst){
       case A64_CBZ_CBNZ:
-        a64_branch_imm_reg(thread_data, &write_p, basic_block, inst, read_address);
+        a64_check_free_space(thread_data, &write_p, &data_p, EXIT_FSPACE, basic_block);
+        a64_branch_imm_reg(thread_data, &write_p, cold_data_p, basic_block, inst, read_address);
         stop = true;
         break;
 
       case A64_B_COND:
+        a64_check_free_space(thread_data, &write_p, &data_p, EXIT_FSPACE, basic_block);
         a64_B_cond_decode_fields(read_address, &imm19, &cond);
 
         branch_offset = sign_extend64(19, imm19) << 2;
@@ -668,7 +2027,7 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
         thread_data->code_cache_meta[basic_block].branch_condition = cond;
         thread_data->code_cache_meta[basic_block].branch_cache_status = 0;
 #endif
-        a64_branch_jump_cond(thread_data, &write_p, basic_block, target, read_address, cond);
+        a64_branch_jump_cond(thread_data, &write_p, cold_data_p, basic_block, target, read_address, cond);
         stop = true;
         break;
 
@@ -743,30 +2102,54 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
         break;
 
       case A64_TBZ_TBNZ:
-        a64_branch_imm_reg(thread_data, &write_p, basic_block, inst, read_address);
+        a64_check_free_space(thread_data, &write_p, &data_p, EXIT_FSPACE, basic_block);
+        a64_branch_imm_reg(thread_data, &write_p, cold_data_p, basic_block, inst, read_address);
         stop = true;
         break;
 
       case A64_B_BL:
         a64_B_BL_decode_fields(read_address, &op, &imm26);
 
+        branch_offset = sign_extend64(26, imm26) << 2;
+        target = (uint64_t)read_address + branch_offset;
+
         if (op == 1) { // Branch Link
           a64_copy_to_reg_64bits(&write_p, lr, (uint64_t)read_address + 4);
+#ifdef PLUGINS_NEW
+          if (a64_post_fn_cbs_at_ret(target, thread_data->bare)) {
+            a64_check_free_space(thread_data, &write_p, &data_p, POST_FN_RET_PUSH_SIZE, basic_block);
+            a64_post_fn_ret_push(thread_data, &write_p, target);
+            target |= POST_FN_ENTRY_TAG;
+          }
+#endif
         }
 
-        branch_offset = sign_extend64(26, imm26) << 2;
-        target = (uint64_t)read_address + branch_offset;
+#ifdef DBM_INLINE_UNCOND_IMM
+        // Direct calls to the tagged entry of a function are never inlined
+        if (!(target & POST_FN_ENTRY_TAG)
+            && a64_inline_uncond_imm(thread_data, true, &write_p, &data_p, &read_address, &bb_entry,
+                                     target, &inlined_count, &inlined_back_count, basic_block,
+                                     type, &stop)) {
+          break;
+        }
+#endif
 
 #ifdef DBM_LINK_UNCOND_IMM
+        a64_check_free_space(thread_data, &write_p, &data_p, EXIT_FSPACE, basic_block);
         thread_data->code_cache_meta[basic_block].exit_branch_type = uncond_imm_a64;
         thread_data->code_cache_meta[basic_block].exit_branch_addr = write_p;
         thread_data->code_cache_meta[basic_block].branch_taken_addr = target;
         *write_p = NOP_INSTRUCTION; // Reserves space for linking branch.
         write_p++;
+
+        hot_p = a64_begin_cold_stub(&write_p, cold_data_p, COLD_UNCOND_STUB_SIZE);
 #endif
         a64_branch_save_context(&write_p);
         a64_branch_jump(thread_data, &write_p, basic_block, target,
                         REPLACE_TARGET | INSERT_BRANCH);
+#ifdef DBM_LINK_UNCOND_IMM
+        a64_end_cold_stub(&write_p, hot_p, cold_data_p, COLD_UNCOND_STUB_SIZE);
+#endif
         stop = true;
         //while(1);
         break;
@@ -776,8 +2159,19 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
       case A64_RET:
         a64_BR_decode_fields(read_address, &Rn);
 
+#ifdef DBM_LINK_PLT
+        // The dispatcher can only retranslate basic blocks
+        if (inst == A64_BR && type == mambo_bb) {
+          uintptr_t *got_entry = a64_plt_got_entry(read_address, bb_entry);
+          if (got_entry != NULL && *got_entry != 0) {
+            a64_check_free_space(thread_data, &write_p, &data_p, PLT_LINK_SIZE, basic_block);
+            a64_link_plt(thread_data, &write_p, got_entry, basic_block);
+          }
+        }
+#endif
+
 #ifdef DBM_INLINE_HASH
-        a64_check_free_space(thread_data, &write_p, &data_p, 88, basic_block);
+        a64_check_free_space(thread_data, &write_p, &data_p, 88 + POST_FN_RET_CHECK_SIZE, basic_block);
 #endif
 
         thread_data->code_cache_meta[basic_block].exit_branch_type = uncond_branch_reg;
@@ -798,6 +2192,11 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
 
         a64_branch_jump(thread_data, &write_p, basic_block, 0, INSERT_BRANCH);
 #else
+  #ifdef PLUGINS_NEW
+        if (inst == A64_RET && Rn == lr && a64_has_post_fn_cbs()) {
+          a64_post_fn_ret_lookup(thread_data, basic_block, &write_p);
+        } else
+  #endif
         a64_inline_hash_lookup(thread_data, basic_block, &write_p, read_address, Rn, (inst == A64_BLR), true);
 #endif
         stop = true;
@@ -899,9 +2298,20 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
         a64_copy_to_reg_64bits(&write_p, Rd, PC_relative_address);
         break;
 
+      case A64_HINT:
+#ifdef PLUGINS_NEW
+        if (global_data.roi.markers &&
+            (*read_address == MAMBO_ROI_START_INST || *read_address == MAMBO_ROI_STOP_INST)) {
+          a64_roi_marker(thread_data, &write_p, &data_p, read_address, basic_block, type);
+          stop = true;
+          break;
+        }
+#endif
+        a64_copy();
+        break;
+
       case A64_HVC:
       case A64_BRK:
-      case A64_HINT:
       case A64_CLREX:
       case A64_DSB:
       case A64_DMB:
@@ -1000,11 +2410,18 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
     }
 #ifdef PLUGINS_NEW
     a64_scanner_deliver_callbacks(thread_data, POST_INST_C, &read_address, inst, &write_p, &data_p, basic_block, type, !stop, &stop);
+    roi_insts++;
 #endif
 
     read_address++;
   } // while(!stop)
 
+#ifdef PLUGINS_NEW
+  if (roi_count_p != NULL) {
+    a64_ADD_SUB_immed(&roi_count_p, 1, 1, 0, 0, min(roi_insts, 0xFFF), x1, x1);
+  }
+#endif
+
   a64_scanner_deliver_callbacks(thread_data, POST_BB_C, &bb_entry, -1,
                                 &write_p, &data_p, basic_block, type, false, &stop);
   a64_scanner_deliver_callbacks(thread_data, POST_FRAGMENT_C, &start_scan, -1,
@@ -1012,4 +2429,23 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
 
   return ((write_p - start_address + 1) * sizeof(*write_p));
 }
+
+/*
+ * Stub blocks go to the dispatcher, which scans the target in their place.
+ * Like other blocks, they can be entered at +0 with X0 and X1 pushed
+ * or at +4 by direct links:
+ *   LDP  X0, X1, [SP], #16
+ *   STP  X0, X1, [SP, #-16]!
+ *   MOV  X1, #basic_block
+ *   MOV  X0, #target
+ *   B    dispatcher
+ */
+void a64_encode_stub_bb(dbm_thread *thread_data, int basic_block, uint64_t target) {
+  uint32_t *write_p = (uint32_t *)&thread_data->code_cache->blocks[basic_block];
+
+  a64_pop_pair_reg(x0, x1);
+  a64_branch_save_context(&write_p);
+  a64_branch_jump(thread_data, &write_p, basic_block, target,
+                  REPLACE_TARGET | INSERT_BRANCH);
+}
 #endif // __aarch64__
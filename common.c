@@ -169,10 +169,18 @@ int interval_map_delete_entry(interval_map *imap, ssize_t index) {
   return 0;
 }
 
+// The entries array is doubled when full, the caller must hold imap->mutex
 int interval_map_add_entry(interval_map *imap, uintptr_t start, uintptr_t end, int fd) {
-  if (imap->entry_count >= imap->mem_size || start >= end) {
+  if (start >= end) {
     return -1;
   }
+  if (imap->entry_count >= imap->mem_size) {
+    ssize_t size = imap->mem_size * 2;
+    interval_map_entry *entries = realloc(imap->entries, sizeof(interval_map_entry) * size);
+    if (entries == NULL) return -1;
+    imap->entries = entries;
+    imap->mem_size = size;
+  }
   ssize_t index = imap->entry_count++;
 
   imap->entries[index].start = start;
@@ -231,9 +239,12 @@ int interval_map_add(interval_map *imap, uintptr_t start, uintptr_t end, int fd)
   }
 
   // No overlapping region found
+  int status = 0;
   if (overlap_ind == -1) {
-    ret = interval_map_add_entry(imap, start, end, fd);
-    assert(ret == 0);
+    status = interval_map_add_entry(imap, start, end, fd);
+    if (status != 0 && fd >= 0) {
+      close(fd);
+    }
   }
 
 #ifdef DEBUG
@@ -244,7 +255,7 @@ int interval_map_add(interval_map *imap, uintptr_t start, uintptr_t end, int fd)
   ret = pthread_mutex_unlock(&imap->mutex);
   if (ret != 0) return -1;
 
-  return 0;
+  return status;
 }
 
 ssize_t interval_map_search(interval_map *imap, uintptr_t start, uintptr_t end) {
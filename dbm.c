@@ -63,16 +63,29 @@
 #define th_is_pending_ptr_offset      ((uintptr_t)&th_is_pending_ptr - (uintptr_t)&start_of_dispatcher_s)
 #define dispatcher_wrapper_offset     ((uintptr_t)dispatcher_trampoline - (uintptr_t)&start_of_dispatcher_s)
 #define syscall_wrapper_offset        ((uintptr_t)syscall_wrapper - (uintptr_t)&start_of_dispatcher_s)
+#ifdef __arm__
 #define trace_head_incr_offset        ((uintptr_t)trace_head_incr - (uintptr_t)&start_of_dispatcher_s)
+#elif __aarch64__
+#define create_trace_trampoline_offset ((uintptr_t)create_trace_trampoline - (uintptr_t)&start_of_dispatcher_s)
+#endif
 
 uintptr_t page_size;
 dbm_global global_data;
 __thread dbm_thread *current_thread;
+#ifdef PLUGINS_NEW
+__thread uintptr_t mambo_thread_slots[MAX_THREAD_SLOTS];
+#endif
 
 void flush_code_cache(dbm_thread *thread_data) {
   thread_data->was_flushed = true;
   thread_data->free_block = trampolines_size_bbs;
   hash_init(&thread_data->entry_address, CODE_CACHE_HASH_SIZE + CODE_CACHE_HASH_OVERP);
+#ifdef PLUGINS_NEW
+  if (thread_data->bare_entry_address != NULL) {
+    hash_init(thread_data->bare_entry_address, CODE_CACHE_HASH_SIZE + CODE_CACHE_HASH_OVERP);
+  }
+  mambo_one_shot_probes_flushed(thread_data);
+#endif
 #ifdef DBM_TRACES
   thread_data->trace_cache_next = thread_data->code_cache->traces;
   thread_data->trace_id = CODE_CACHE_SIZE;
@@ -81,7 +94,7 @@ void flush_code_cache(dbm_thread *thread_data) {
 
   for (int i = 0; i < CODE_CACHE_SIZE; i++) {
     thread_data->code_cache_meta[i].exit_branch_type = unknown;
-    thread_data->code_cache_meta[i].linked_from = NULL;
+    thread_data->code_cache_meta_cold[i].linked_from = NULL;
     thread_data->code_cache_meta[i].branch_cache_status = 0;
     thread_data->code_cache_meta[i].actual_id = 0;
 #ifdef DBM_TRACES
@@ -93,7 +106,7 @@ void flush_code_cache(dbm_thread *thread_data) {
 }
 
 uintptr_t cc_lookup(dbm_thread *thread_data, uintptr_t target) {
-  uintptr_t addr = hash_lookup(&thread_data->entry_address, target);
+  uintptr_t addr = hash_lookup(active_entry_address(thread_data), target);
   return adjust_cc_entry(addr);
 }
 
@@ -103,6 +116,27 @@ uintptr_t lookup_or_scan(dbm_thread *thread_data, uintptr_t target, bool *cached
   uintptr_t basic_block;
   
   debug("Thread_data: %p\n", thread_data);
+
+  if (thread_data->pending_inval_count != 0) {
+    process_pending_invalidations(thread_data);
+  }
+
+#ifdef PLUGINS_NEW
+  // The mode only changes here, so that all fragments scanned by a dispatcher call agree
+  if (global_data.dual_mode) {
+    if (global_data.roi.inst_count && thread_data->roi_budget < 0) {
+      roi_budget_expired(thread_data);
+    }
+    if (global_data.roi.markers) {
+      uint64_t generation = __atomic_load_n(&global_data.roi.generation, __ATOMIC_ACQUIRE);
+      if (generation != thread_data->roi_generation) {
+        thread_data->roi_generation = generation;
+        thread_data->instrument = global_data.instrument;
+      }
+    }
+    thread_data->bare = !thread_data->instrument;
+  }
+#endif
   
   block_address = cc_lookup(thread_data, target);
 
@@ -153,7 +187,11 @@ uintptr_t stub_bb(dbm_thread *thread_data, uintptr_t target) {
   debug("Stub BB: 0x%x\n", block_address + thumb);
   
   thread_data->code_cache_meta[basic_block].exit_branch_type = stub;
-  if (!hash_add(&thread_data->entry_address, target, block_address + thumb)) {
+  thread_data->code_cache_meta[basic_block].source_addr = (uint16_t *)target;
+#ifdef PLUGINS_NEW
+  thread_data->code_cache_meta[basic_block].bare = thread_data->bare;
+#endif
+  if (!hash_add(active_entry_address(thread_data), target, block_address + thumb)) {
     fprintf(stderr, "Failed to add hash table entry for newly created stub basic block\n");
     while(1);
   }
@@ -166,7 +204,7 @@ uintptr_t stub_bb(dbm_thread *thread_data, uintptr_t target) {
   }
 #endif
 #ifdef __aarch64__
-  assert(0); // TODO
+  a64_encode_stub_bb(thread_data, basic_block, target);
 #endif
   
   return adjust_cc_entry(block_address + thumb);
@@ -205,6 +243,13 @@ uintptr_t scan(dbm_thread *thread_data, uint16_t *address, int basic_block) {
   block_address = (uintptr_t)&thread_data->code_cache->blocks[basic_block];
   thread_data->code_cache_meta[basic_block].source_addr = address;
   thread_data->code_cache_meta[basic_block].tpc = block_address;
+#ifdef PLUGINS_NEW
+  thread_data->code_cache_meta[basic_block].bare = thread_data->bare;
+#endif
+#ifdef DBM_LINK_PLT
+  thread_data->code_cache_meta_cold[basic_block].plt_link_addr = NULL;
+  thread_data->code_cache_meta_cold[basic_block].plt_link_saved = 0;
+#endif
   //fprintf(stderr, "scan(%p): 0x%x (bb %d)\n", address, block_address, basic_block);
 
   // Add entry into the code cache hash table
@@ -212,7 +257,7 @@ uintptr_t scan(dbm_thread *thread_data, uint16_t *address, int basic_block) {
   // from scan_x could result in duplicate BBS or an infinite recursive call
   block_address |= thumb;
   if (!stub) {
-    if (!hash_add(&thread_data->entry_address, (uintptr_t)address, block_address)) {
+    if (!hash_add(active_entry_address(thread_data), (uintptr_t)address, block_address)) {
       fprintf(stderr, "Failed to add hash table entry for newly created basic block\n");
       while(1);
     }
@@ -272,6 +317,9 @@ int register_thread(dbm_thread *thread_data, bool caller_has_lock) {
   thread_data->next_thread = global_data.threads;
   global_data.threads = thread_data;
 
+#ifdef PLUGINS_NEW
+  mambo_counters_thread_init(thread_data);
+#endif
   mambo_deliver_callbacks(PRE_THREAD_C, thread_data);
 
   if (!caller_has_lock) {
@@ -306,6 +354,9 @@ int unregister_thread(dbm_thread *thread_data, bool caller_has_lock) {
 
   if (status == 0) {
     mambo_deliver_callbacks(POST_THREAD_C, thread_data);
+#ifdef PLUGINS_NEW
+    mambo_counters_thread_exit(thread_data);
+#endif
   }
 
   if (!caller_has_lock) {
@@ -345,8 +396,10 @@ void dbm_exit(dbm_thread *thread_data, uint32_t code) {
 
   for (dbm_thread *thread = global_data.threads; thread != NULL; thread = thread->next_thread) {
     mambo_deliver_callbacks(POST_THREAD_C, thread);
+    mambo_counters_thread_exit(thread);
   }
 
+  mambo_stop_helper_threads();
   mambo_deliver_callbacks(EXIT_C, thread_data);
 #endif
 
@@ -368,6 +421,16 @@ bool allocate_thread_data(dbm_thread **thread_data) {
 }
 
 int free_thread_data(dbm_thread *thread_data) {
+#ifdef PLUGINS_NEW
+  mambo_free_one_shot_probes(thread_data, true);
+  mambo_arena_retire(thread_data->arena);
+  if (thread_data->bare_entry_address != NULL) {
+    if (munmap(thread_data->bare_entry_address, METADATA_SZ_ROUND(sizeof(hash_table))) != 0) {
+      fprintf(stderr, "Error freeing the bare fragments hash table on exit()\n");
+      while(1);
+    }
+  }
+#endif
   if (munmap(thread_data->code_cache, CC_SZ_ROUND(sizeof(dbm_code_cache))) != 0) {
     fprintf(stderr, "Error freeing code cache on exit()\n");
     while(1);
@@ -397,6 +460,24 @@ void init_thread(dbm_thread *thread_data) {
   thread_data->cc_links = mmap(NULL, sizeof(ll) + sizeof(ll_entry) * MAX_CC_LINKS, PROT_READ | PROT_WRITE, METADATA_MMAP_OPTS, -1, 0);
   assert(thread_data->cc_links != MAP_FAILED);
 
+#ifdef PLUGINS_NEW
+  // Uninstrumented fragments are looked up in a separate table
+  if (global_data.dual_mode) {
+    thread_data->bare_entry_address = mmap(NULL, sizeof(hash_table), PROT_READ | PROT_WRITE, METADATA_MMAP_OPTS, -1, 0);
+    assert(thread_data->bare_entry_address != MAP_FAILED);
+  }
+  thread_data->arena = mambo_arena_acquire();
+  assert(thread_data->arena != NULL);
+  thread_data->roi_generation = __atomic_load_n(&global_data.roi.generation, __ATOMIC_ACQUIRE);
+  thread_data->instrument = global_data.instrument;
+  thread_data->bare = false;
+  thread_data->module_filter_cache.start = 0;
+  thread_data->module_filter_cache.end = 0;
+  thread_data->roi_budget = global_data.roi.skip;
+  thread_data->roi_phase = 0;
+  thread_data->roi_depth = 0;
+#endif
+
   // Initialize the hash table and basic block allocator, mark all BBs as unknown type
   flush_code_cache(thread_data);
 
@@ -414,15 +495,16 @@ void init_thread(dbm_thread *thread_data) {
   debug("*thread_data in dispatcher at: %p\n", dispatcher_thread_data);
 
 #ifdef DBM_TRACES
+  #ifdef __arm__
   thread_data->trace_head_incr_addr = (uintptr_t)&thread_data->code_cache[0] + trace_head_incr_offset;
 
-  #ifdef __arm__
   uint16_t *write_p = (uint16_t *)(thread_data->trace_head_incr_addr + 4 - 1);
   copy_to_reg_32bit(&write_p, r1, (uint32_t)thread_data->exec_count);
   #endif
   #ifdef __aarch64__
-  uint32_t *write_p = (uint32_t *)(thread_data->trace_head_incr_addr + 4);
-  a64_copy_to_reg_64bits(&write_p, x2, (uintptr_t)thread_data->exec_count);
+  // The trace head counters are inlined, only the slow path is shared
+  thread_data->create_trace_trampoline_addr = (uintptr_t)&thread_data->code_cache[0]
+                                              + create_trace_trampoline_offset;
   #endif
 
   info("Traces start at: %p\n", &thread_data->code_cache->traces);
@@ -456,6 +538,10 @@ void reset_process(dbm_thread *thread_data) {
 
   int ret = pthread_mutex_init(&global_data.thread_list_mutex, NULL);
   assert(ret == 0);
+  ret = pthread_mutex_init(&global_data.pending_inval_mutex, NULL);
+  assert(ret == 0);
+  ret = pthread_mutex_init(&global_data.helper_thread_mutex, NULL);
+  assert(ret == 0);
 
   current_thread = thread_data;
   free_all_other_threads(thread_data);
@@ -471,6 +557,12 @@ void reset_process(dbm_thread *thread_data) {
   stdout = fdopen(1, "a");
   stderr = fdopen(2, "a");
 
+#ifdef PLUGINS_NEW
+  // Helper threads are not duplicated by fork
+  global_data.helper_thread_count = 0;
+  mambo_counters_reset_process(thread_data);
+#endif
+
   mambo_deliver_callbacks(PRE_THREAD_C, thread_data);
 }
 
@@ -541,11 +633,308 @@ void record_cc_link(dbm_thread *thread_data, uintptr_t linked_from, uintptr_t li
   assert(entry != NULL);
 
   entry->data = linked_from;
-  entry->next = thread_data->code_cache_meta[linked_to].linked_from;
-  thread_data->code_cache_meta[linked_to].linked_from = entry;
+  entry->next = thread_data->code_cache_meta_cold[linked_to].linked_from;
+  thread_data->code_cache_meta_cold[linked_to].linked_from = entry;
+}
+
+// Redirects the recorded direct branches to fragment bb to the fragment at tpc
+void patch_cc_links(dbm_thread *thread_data, int bb, uintptr_t tpc) {
+  ll_entry *cc_link;
+  uintptr_t orig_branch;
+  uintptr_t tpc_direct = adjust_cc_entry(tpc);
+
+  cc_link = thread_data->code_cache_meta_cold[bb].linked_from;
+  while(cc_link != NULL) {
+    debug("Link from: 0x%lx, update to: 0x%lx\n", cc_link->data, tpc);
+    orig_branch = cc_link->data;
+#ifdef __arm__
+    orig_branch &= 0xFFFFFFFE;
+    if (cc_link->data & THUMB) {
+      thumb_adjust_b_bl_target(thread_data, (uint16_t *)orig_branch, tpc_direct);
+    } else if ((cc_link->data & 3) == FULLADDR) {
+      *(uint32_t *)(orig_branch & (~FULLADDR)) = tpc_direct;
+    } else {
+      arm_adjust_b_bl_target((uintptr_t *)orig_branch, tpc_direct);
+    }
+#elif __aarch64__
+  #ifdef DBM_TRACES
+    if (orig_branch >= (uintptr_t)thread_data->code_cache->traces) {
+      patch_trace_branches(thread_data, (uint32_t *)orig_branch, tpc + 4);
+    } else
+  #endif
+    a64_b_helper((uint32_t *)orig_branch, tpc + 4);
+#endif
+    cc_link = cc_link->next;
+    __clear_cache((void *)orig_branch, (void *)orig_branch + 4);
+  }
 }
 
+/*
+  Targeted retranslation
+
+  The fragment translated from spc is replaced by a stub block, which scans
+  spc again in place the next time it's executed. The direct branches to the
+  old fragment are moved over to the stub. Code copied into the middle of
+  traces isn't retranslated. Returns false if the code cache was flushed.
+*/
+static bool invalidate_fragment(dbm_thread *thread_data, uintptr_t spc) {
+  uintptr_t old_tpc = hash_lookup(active_entry_address(thread_data), spc);
+  if (old_tpc == UINT_MAX) return true;
+
+  int old_bb = addr_to_bb_id(thread_data, old_tpc);
+  if (old_bb >= 0 && old_bb < CODE_CACHE_SIZE
+      && thread_data->code_cache_meta[old_bb].exit_branch_type == stub) {
+    return true;
+  }
+
+  int free_block = thread_data->free_block;
+  stub_bb(thread_data, spc);
+  if (thread_data->free_block <= free_block) {
+    return false;
+  }
+  int bb = thread_data->free_block - 1;
+  uintptr_t block_address = (uintptr_t)&thread_data->code_cache->blocks[bb] | (spc & THUMB);
+  __clear_cache((char *)block_address, (char *)(block_address + BASIC_BLOCK_SIZE * 4 + 1));
+
+  if (old_bb >= 0) {
+    patch_cc_links(thread_data, old_bb, block_address);
+    thread_data->code_cache_meta_cold[bb].linked_from = thread_data->code_cache_meta_cold[old_bb].linked_from;
+    thread_data->code_cache_meta_cold[old_bb].linked_from = NULL;
+  }
+#ifdef __aarch64__
+  // Catch any direct branches which weren't recorded
+  a64_b_helper((uint32_t *)(old_tpc + 4), block_address + 4);
+  __clear_cache((char *)(old_tpc + 4), (char *)(old_tpc + 8));
+#endif
+
+  return true;
+}
+
+static bool invalidate_fragments_in_table(dbm_thread *thread_data, uintptr_t start, uintptr_t end) {
+  hash_table *table = active_entry_address(thread_data);
+
+  if (end - start == 1) {
+    return invalidate_fragment(thread_data, start)
+           && invalidate_fragment(thread_data, start | THUMB)
+#ifdef __aarch64__
+           && invalidate_fragment(thread_data, start | POST_FN_ENTRY_TAG)
+           && invalidate_fragment(thread_data, start | POST_FN_RET_TAG)
+#endif
+           ;
+  }
+
+  // hash_add() updates the existing entries in place, so we can scan the table directly
+  for (int i = 0; i < table->size; i++) {
+    uintptr_t spc = table->entries[i].key;
+    if (spc != 0 && (spc & ~SPC_TAGS) >= start && (spc & ~SPC_TAGS) < end) {
+      if (!invalidate_fragment(thread_data, spc)) return false;
+    }
+  }
+  return true;
+}
+
+// Must be called by the thread which owns thread_data, when it isn't scanning
+void invalidate_fragments(dbm_thread *thread_data, uintptr_t start, uintptr_t end) {
+  bool was_flushed = thread_data->was_flushed;
+  bool flushed = !invalidate_fragments_in_table(thread_data, start, end);
+
+#ifdef PLUGINS_NEW
+  if (!flushed && thread_data->bare_entry_address != NULL) {
+    bool bare = thread_data->bare;
+    thread_data->bare = !bare;
+    flushed = !invalidate_fragments_in_table(thread_data, start, end);
+    thread_data->bare = bare;
+  }
+#endif
+
+  thread_data->was_flushed = was_flushed || flushed;
+}
+
+// Requests the retranslation of [start, end) by the thread which owns thread_data
+void queue_invalidation(dbm_thread *thread_data, uintptr_t start, uintptr_t end) {
+  int ret = pthread_mutex_lock(&global_data.pending_inval_mutex);
+  assert(ret == 0);
+
+  int index = thread_data->pending_inval_count;
+  if (index < MAX_PENDING_INVALIDATIONS) {
+    thread_data->pending_inval[index].start = start;
+    thread_data->pending_inval[index].end = end;
+  }
+  if (index <= MAX_PENDING_INVALIDATIONS) {
+    thread_data->pending_inval_count = index + 1;
+  }
+
+  ret = pthread_mutex_unlock(&global_data.pending_inval_mutex);
+  assert(ret == 0);
+}
+
+void process_pending_invalidations(dbm_thread *thread_data) {
+  cc_range ranges[MAX_PENDING_INVALIDATIONS];
+
+  int ret = pthread_mutex_lock(&global_data.pending_inval_mutex);
+  assert(ret == 0);
+  int count = thread_data->pending_inval_count;
+  memcpy(ranges, thread_data->pending_inval, sizeof(ranges));
+  thread_data->pending_inval_count = 0;
+  ret = pthread_mutex_unlock(&global_data.pending_inval_mutex);
+  assert(ret == 0);
+
+  if (count > MAX_PENDING_INVALIDATIONS) {
+    flush_code_cache(thread_data);
+    return;
+  }
+  for (int i = 0; i < count; i++) {
+    invalidate_fragments(thread_data, ranges[i].start, ranges[i].end);
+  }
+}
+
+#ifdef PLUGINS_NEW
+// Tracks the readable mappings without write permissions, see mambo_classify_ld_st()
+static void update_read_only_allocs(vm_op_t op, uintptr_t addr, size_t size, int prot) {
+  ssize_t ret = interval_map_delete(&global_data.read_only_allocs, addr, addr + size);
+  assert(ret >= 0);
+  // If the map can't grow, the mapping is simply not classified as read-only
+  if (op != VM_UNMAP && (prot & PROT_READ) && !(prot & PROT_WRITE)) {
+    interval_map_add(&global_data.read_only_allocs, addr, addr + size, -1);
+  }
+}
+
+/* Per-module filter
+   When enabled, plugin callbacks are only delivered for code in the selected
+   modules and address ranges. A module is selected if the file name of its
+   executable mappings matches one of the names, either exactly or up to a dot,
+   e.g. "libc" matches libc.so.6. Names can also be set with the MAMBO_MODULES
+   environment variable, as a colon-separated list. */
+static void module_filter_enable(void) {
+  if (!global_data.module_filter.enabled) {
+    int ret = interval_map_init(&global_data.module_filter.ranges, 64);
+    assert(ret == 0);
+    global_data.module_filter.enabled = true;
+  }
+}
+
+static bool module_filter_match(int fd) {
+  char path[PATH_MAX];
+  char fd_path[32];
+
+  snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+  ssize_t len = readlink(fd_path, path, sizeof(path) - 1);
+  if (len <= 0) return false;
+  path[len] = '\0';
+
+  char *file = strrchr(path, '/');
+  file = (file != NULL) ? file + 1 : path;
+  for (int i = 0; i < global_data.module_filter.name_count; i++) {
+    char *name = global_data.module_filter.names[i];
+    size_t name_len = strlen(name);
+    if (strncmp(file, name, name_len) == 0 && (file[name_len] == '\0' || file[name_len] == '.')) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int module_filter_add_name(char *name) {
+  if (global_data.module_filter.name_count >= MAX_FILTER_MODULES) return -1;
+  module_filter_enable();
+  global_data.module_filter.names[global_data.module_filter.name_count++] = name;
+
+  // Modules which are already mapped
+  interval_map *exec = &global_data.exec_allocs;
+  if (exec->entries == NULL) return 0;
+  int ret = pthread_mutex_lock(&exec->mutex);
+  assert(ret == 0);
+  for (ssize_t i = 0; i < exec->entry_count; i++) {
+    if (exec->entries[i].fd >= 0 && module_filter_match(exec->entries[i].fd)) {
+      module_filter_add_range(exec->entries[i].start, exec->entries[i].end);
+    }
+  }
+  ret = pthread_mutex_unlock(&exec->mutex);
+  assert(ret == 0);
+
+  return 0;
+}
+
+int module_filter_add_range(uintptr_t start, uintptr_t end) {
+  module_filter_enable();
+  int ret = interval_map_add(&global_data.module_filter.ranges, start, end, -1);
+  __atomic_fetch_add(&global_data.module_filter.generation, 1, __ATOMIC_RELEASE);
+  return ret;
+}
+
+static void module_filter_init(void) {
+  char *names = getenv("MAMBO_MODULES");
+  if (names == NULL) return;
+
+  names = strdup(names);
+  assert(names != NULL);
+  for (char *name = strtok(names, ":"); name != NULL; name = strtok(NULL, ":")) {
+    int ret = module_filter_add_name(name);
+    assert(ret == 0);
+  }
+}
+
+/* The scanners query the filter for every instruction, so the result is cached
+   per thread for the whole interval around addr which is either entirely inside
+   a selected range or entirely outside of all of them. Typically, this means a
+   single lookup per fragment, or even per module. */
+bool module_filter_allows(dbm_thread *thread_data, uintptr_t addr) {
+  if (!global_data.module_filter.enabled) return true;
+
+  module_filter_cache_t *cache = &thread_data->module_filter_cache;
+  uint64_t generation = __atomic_load_n(&global_data.module_filter.generation, __ATOMIC_ACQUIRE);
+  if (cache->generation == generation && addr >= cache->start && addr < cache->end) {
+    return cache->allowed;
+  }
+
+  interval_map *imap = &global_data.module_filter.ranges;
+  uintptr_t start = 0;
+  uintptr_t end = UINTPTR_MAX;
+  bool allowed = false;
+
+  int ret = pthread_mutex_lock(&imap->mutex);
+  assert(ret == 0);
+  for (ssize_t i = 0; i < imap->entry_count && !allowed; i++) {
+    interval_map_entry *entry = &imap->entries[i];
+    if (addr >= entry->start && addr < entry->end) {
+      start = entry->start;
+      end = entry->end;
+      allowed = true;
+    } else if (entry->end <= addr && entry->end > start) {
+      start = entry->end;
+    } else if (entry->start > addr && entry->start < end) {
+      end = entry->start;
+    }
+  }
+  ret = pthread_mutex_unlock(&imap->mutex);
+  assert(ret == 0);
+
+  cache->start = start;
+  cache->end = end;
+  cache->allowed = allowed;
+  cache->generation = generation;
+
+  return allowed;
+}
+#endif
+
 void notify_vm_op(vm_op_t op, uintptr_t addr, size_t size, int prot, int flags, int fd, off_t off) {
+#ifdef PLUGINS_NEW
+  update_read_only_allocs(op, addr, size, prot);
+  if (global_data.module_filter.enabled) {
+    if (op == VM_UNMAP) {
+      ssize_t ret = interval_map_delete(&global_data.module_filter.ranges, addr, addr + size);
+      assert(ret >= 0);
+      __atomic_fetch_add(&global_data.module_filter.generation, 1, __ATOMIC_RELEASE);
+    } else if (op == VM_MAP && (prot & PROT_EXEC) && fd >= 0 && module_filter_match(fd)) {
+      // On failure, the module's code is translated without instrumentation
+      if (module_filter_add_range(addr, addr + size) != 0) {
+        fprintf(stderr, "MAMBO: failed to add module filter range %p-%p\n",
+                (void *)addr, (void *)(addr + size));
+      }
+    }
+  }
+#endif
   switch(op) {
     case VM_MAP: {
       if (prot & PROT_EXEC) {
@@ -618,13 +1007,27 @@ void main(int argc, char **argv, char **envp) {
   int ret = pthread_mutex_init(&global_data.thread_list_mutex, NULL);
   assert(ret == 0);
 
+  ret = pthread_mutex_init(&global_data.pending_inval_mutex, NULL);
+  assert(ret == 0);
+  ret = pthread_mutex_init(&global_data.helper_thread_mutex, NULL);
+  assert(ret == 0);
+
   ret = interval_map_init(&global_data.exec_allocs, 512);
   assert(ret == 0);
 
+#ifdef PLUGINS_NEW
+  ret = interval_map_init(&global_data.read_only_allocs, 2048);
+  assert(ret == 0);
+  module_filter_init();
+#endif
+
   ret = pthread_mutex_init(&global_data.signal_handlers_mutex, NULL);
   assert(ret == 0);
 
   install_system_sig_handlers();
+#ifdef __aarch64__
+  global_data.poll_signals = (getenv("MAMBO_SIGNAL_POLL") != NULL);
+#endif
 
   global_data.brk = 0;
   struct elf_loader_auxv auxv;
@@ -23,6 +23,7 @@
 
 #include <stdbool.h>
 #include <signal.h>
+#include <pthread.h>
 #include <limits.h>
 #include <stdint.h>
 #include <sys/auxv.h>
@@ -61,6 +62,7 @@
 #define TB_CACHE_SIZE 32
 
 #define MAX_BACK_INLINE 5
+#define MAX_UNCOND_INLINE 16
 #define MAX_TRACE_FRAGMENTS 20
 
 #define RAS_SIZE (4096*5)
@@ -68,10 +70,15 @@
 
 #define MAX_CC_LINKS 100000
 
+#define PENDING_SIGNALS_MAP_WORDS ((_NSIG + 31) / 32)
+
 #define THUMB 0x1
 #define FULLADDR 0x2
 
 #define MAX_PLUGIN_NO (10)
+#define MAX_THREAD_SLOTS (32)
+#define MAX_HELPER_THREADS (16)
+#define MAX_MAMBO_COUNTERS (128)
 
 typedef enum {
   mambo_bb = 0,
@@ -132,7 +139,14 @@ typedef struct {
 #define BRANCH_LINKED (1 << 1)
 #define BOTH_LINKED (1 << 2)
 
+// Set in the source index by linked PLT stubs when their GOT entry has changed
+#define PLT_RELINK_SOURCE (1U << 31)
+
 #define MAX_SAVED_EXIT_SZ 12
+/* The fragment metadata is split in two arrays: the fields used for scanning,
+   linking and address lookups are kept together in dbm_code_cache_meta, while
+   the ones only needed to install traces and to unlink fragments for signal
+   delivery are in dbm_code_cache_meta_cold */
 typedef struct {
   uint16_t *source_addr;
   uintptr_t tpc;
@@ -146,13 +160,26 @@ typedef struct {
 #endif // __arch64__
   uintptr_t branch_taken_addr;
   uintptr_t branch_skipped_addr;
-  uintptr_t branch_condition;
-  uintptr_t branch_cache_status;
+  uint32_t branch_condition : 31;
+  // set for the fragments translated without instrumentation in dual-mode
+  uint32_t bare : 1;
+  uint32_t branch_cache_status;
   uint32_t rn;
   uint32_t free_b;
+} dbm_code_cache_meta;
+#ifdef __aarch64__
+_Static_assert(sizeof(dbm_code_cache_meta) == 64, "dbm_code_cache_meta must fit in a cache line");
+#endif
+
+typedef struct {
   ll_entry *linked_from;
   uint8_t saved_exit[MAX_SAVED_EXIT_SZ];
-} dbm_code_cache_meta;
+#ifdef DBM_LINK_PLT
+  // the direct branch to the linked PLT target, see unlink_plt_link()
+  uint32_t *plt_link_addr;
+  uint32_t plt_link_saved;
+#endif
+} dbm_code_cache_meta_cold;
 
 typedef struct {
   unsigned long flags;
@@ -181,12 +208,106 @@ typedef struct {
   struct trace_exits exits[MAX_TRACE_REC_EXITS];
 } trace_in_prog;
 
+#define ARENA_SIZE_CLASSES 8
+typedef struct {
+  size_t bytes_in_use;
+  size_t peak_bytes_in_use;
+  size_t bytes_mapped;
+  uint64_t alloc_count;
+  uint64_t free_count;
+} mambo_alloc_stats;
+
+typedef struct arena_obj_hdr_s arena_obj_hdr;
+typedef struct arena_chunk_s arena_chunk;
+typedef struct arena_large_s arena_large;
+typedef struct mambo_arena_s {
+  arena_obj_hdr *free_lists[ARENA_SIZE_CLASSES];
+  arena_obj_hdr * volatile remote_free;
+  arena_chunk *chunks;
+  arena_large *large;
+  uint8_t *bump;
+  uint8_t *bump_end;
+  mambo_alloc_stats stats;
+  struct mambo_arena_s *next_retired;
+} mambo_arena;
+
+typedef struct {
+  pthread_t thread;
+  void (*stop)(void *arg);
+  void *arg;
+} mambo_helper_thread;
+
+// Per-thread values of the counters registered with mambo_counter_register()
+typedef struct mambo_counter_shard {
+  uint64_t values[MAX_MAMBO_COUNTERS];
+  struct mambo_counter_shard *next;
+} __attribute__((aligned(64))) mambo_counter_shard;
+
+#define MAX_LITERAL_POOL 16
+typedef struct {
+  int count;
+  uint64_t values[MAX_LITERAL_POOL];
+  uint64_t *addrs[MAX_LITERAL_POOL];
+} a64_literal_pool;
+
+#define MAX_DEFERRED_COUNTERS 8
+typedef struct {
+  int count;
+  bool in_exclusive;
+  // Set while delivering callbacks which can't emit code
+  bool closed;
+  uint64_t *counters[MAX_DEFERRED_COUNTERS];
+  uint64_t incrs[MAX_DEFERRED_COUNTERS];
+} a64_deferred_counters;
+
+/* Registers live before each instruction of the current basic block, bit 31
+   stands for NZCV. live[count] holds the state after the last instruction */
+#define MAX_LIVENESS_INSTS 64
+#define A64_LIVE_NZCV (1U << 31)
+typedef struct {
+  uint32_t *start;
+  int count;
+  uint32_t live[MAX_LIVENESS_INSTS + 1];
+} a64_liveness;
+
+/* Return addresses and stack pointers of the direct calls to functions with
+   post-function callbacks, see POST_FN_RET_TAG. count is the number of
+   entries, entries[count - 1] is at offset count * 16. When the stack is
+   full, the calls use the untagged function entry instead */
+#define POST_FN_RET_STACK_BITS 8
+#define POST_FN_RET_STACK_SIZE (1 << POST_FN_RET_STACK_BITS)
+typedef struct {
+  uintptr_t ret;
+  uintptr_t sp;
+} a64_post_fn_ret_entry;
+
+typedef struct {
+  uint64_t count;
+  uint64_t pad;
+  a64_post_fn_ret_entry entries[POST_FN_RET_STACK_SIZE];
+} a64_post_fn_ret_stack;
+
+#define MAX_PENDING_INVALIDATIONS 16
+typedef struct {
+  uintptr_t start;
+  uintptr_t end;
+} cc_range;
+
 enum dbm_thread_status {
   THREAD_RUNNING = 0,
   THREAD_SYSCALL,
   THREAD_EXIT
 };
 
+/* The last interval looked up in the module filter, in which all addresses
+   are either allowed or excluded */
+typedef struct {
+  uintptr_t start;
+  uintptr_t end;
+  bool allowed;
+  uint64_t generation;
+} module_filter_cache_t;
+
 typedef struct dbm_thread_s dbm_thread;
 struct dbm_thread_s {
   dbm_thread *next_thread;
@@ -200,10 +321,15 @@ struct dbm_thread_s {
 
   dbm_code_cache *code_cache;
   dbm_code_cache_meta code_cache_meta[CODE_CACHE_SIZE + TRACE_FRAGMENT_NO];
+  dbm_code_cache_meta_cold code_cache_meta_cold[CODE_CACHE_SIZE + TRACE_FRAGMENT_NO];
   hash_table entry_address;
 #ifdef DBM_TRACES
   uint8_t   exec_count[CODE_CACHE_SIZE];
+#ifdef __arm__
   uintptr_t trace_head_incr_addr;
+#elif __aarch64__
+  uintptr_t create_trace_trampoline_addr;
+#endif
   uint8_t  *trace_cache_next;
   int       trace_id;
   int       trace_fragment_count;
@@ -211,12 +337,42 @@ struct dbm_thread_s {
 #endif
 
   ll *cc_links;
+  /* Source ranges to retranslate, queued by other threads. Overflowing
+     the queue requests a flush of the whole code cache instead */
+  volatile int pending_inval_count;
+  cc_range pending_inval[MAX_PENDING_INVALIDATIONS];
 
   uintptr_t tls;
   uintptr_t child_tls;
 
 #ifdef PLUGINS_NEW
   void *plugin_priv[MAX_PLUGIN_NO];
+  mambo_arena *arena;
+  /* Dual-mode translation: instrument is the requested mode, checked by the
+     generated code at every fragment entry, while bare is the mode in which
+     the dispatcher currently looks up and scans fragments */
+  volatile uint32_t instrument;
+  bool bare;
+  hash_table *bare_entry_address;
+  // Temporal region of interest, see mambo_set_roi_inst_count() and mambo_set_roi_function()
+  int64_t roi_budget;
+  int roi_phase;
+  int roi_depth;
+  uint64_t roi_generation;
+  module_filter_cache_t module_filter_cache;
+  // Translated one-shot probes, see emit_one_shot_probe()
+  void *one_shot_probes;
+  mambo_counter_shard counter_shard;
+#ifdef __aarch64__
+  a64_literal_pool lit_pool;
+  a64_deferred_counters deferred_counters;
+  a64_liveness liveness;
+  // Registers left on the stack by the last instrumentation, see emit_a64_pop()
+  uint32_t pending_spill;
+  // Function entry being scanned for a direct call, see POST_FN_ENTRY_TAG
+  uint32_t *post_fn_entry;
+  a64_post_fn_ret_stack post_fn_ret_stack;
+#endif
 #endif
   void *clone_ret_addr;
   pid_t tid;
@@ -224,7 +380,10 @@ struct dbm_thread_s {
   sys_clone_args *clone_args;
   bool clone_vm;
   int pending_signals[_NSIG];
+  uint32_t pending_signals_map[PENDING_SIGNALS_MAP_WORDS];
   uint32_t is_signal_pending;
+  // Polled at fragment entries if poll_signals is set, see a64_poll_signals()
+  uint32_t signal_poll;
   void *mambo_sp;
 };
 
@@ -247,6 +406,12 @@ typedef struct {
   int plugin_id;
   mambo_callback pre_callback;
   mambo_callback post_callback;
+  bool in_bare; // also delivered in bare fragments
+  // Set by mambo_replace_function(), instead of the callbacks
+  void *replacement;
+  int replace_flags;
+  void *orig_alias;
+  uintptr_t *orig_addr;
 } watched_func_t;
 
 typedef struct {
@@ -254,6 +419,22 @@ typedef struct {
   watched_func_t *func;
 } watched_funcp_t;
 
+#ifdef __aarch64__
+/* Direct calls to functions with post-function callbacks branch to the entry
+   address tagged with POST_FN_ENTRY_TAG, which is translated without the return
+   shim. LR is set to the untagged return address, which is also pushed on the
+   post_fn_ret_stack of the thread with SP. A RET to the address and SP on the
+   top of the stack pops it and continues at the return address tagged with
+   POST_FN_RET_TAG, which is translated with the post-function callbacks
+   inserted at its start.
+   The tags are only used in the keys of the code cache */
+#define POST_FN_ENTRY_TAG (1ULL << 63)
+#define POST_FN_RET_TAG   (0x2)
+#define SPC_TAGS          (THUMB | POST_FN_ENTRY_TAG | POST_FN_RET_TAG)
+#else
+#define SPC_TAGS          (THUMB)
+#endif
+
 #define MAX_WATCHED_FUNCS 40
 #define MAX_WATCHED_FUNC_PTRS 80
 typedef struct {
@@ -266,6 +447,25 @@ typedef struct {
   watched_funcp_t funcps[MAX_WATCHED_FUNC_PTRS];
 } watched_functions_t;
 
+#define MAX_FILTER_MODULES 16
+typedef struct {
+  bool enabled;
+  int name_count;
+  char *names[MAX_FILTER_MODULES];
+  interval_map ranges;
+  // Incremented when ranges change, invalidates the per-thread caches
+  uint64_t generation;
+} module_filter_t;
+
+typedef struct {
+  bool markers;
+  // Incremented by every marker, see mambo_roi_marker()
+  uint64_t generation;
+  bool inst_count;
+  int64_t skip;
+  int64_t length;
+} roi_config_t;
+
 typedef struct {
   int argc;
   char **argv;
@@ -280,12 +480,25 @@ typedef struct {
 
   dbm_thread *threads;
   pthread_mutex_t thread_list_mutex;
+  pthread_mutex_t pending_inval_mutex;
+  pthread_mutex_t helper_thread_mutex;
 
   volatile int exit_group;
+  // Deliver signals at polled safe points instead of unlinking, MAMBO_SIGNAL_POLL
+  bool poll_signals;
 
 #ifdef PLUGINS_NEW
   int free_plugin;
   mambo_plugin plugins[MAX_PLUGIN_NO];
+  int free_thread_slot;
+  int helper_thread_count;
+  mambo_helper_thread helper_threads[MAX_HELPER_THREADS];
+  bool dual_mode;
+  roi_config_t roi;
+  module_filter_t module_filter;
+  bool share_ld_st_addr;
+  interval_map read_only_allocs;
+  volatile uint32_t instrument;
   watched_functions_t watched_functions;
 #endif
 } dbm_global;
@@ -301,6 +514,7 @@ void thread_abort(dbm_thread *thread_data);
 extern void dispatcher_trampoline();
 extern void syscall_wrapper();
 extern void trace_head_incr();
+extern void create_trace_trampoline();
 extern void* start_of_dispatcher_s;
 extern void* end_of_dispatcher_s;
 extern void th_to_arm();
@@ -314,6 +528,8 @@ int register_thread(dbm_thread *thread_data, bool caller_has_lock);
 int unregister_thread(dbm_thread *thread_data, bool caller_has_lock);
 bool allocate_thread_data(dbm_thread **thread_data);
 int free_thread_data(dbm_thread *thread_data);
+mambo_arena *mambo_arena_acquire(void);
+void mambo_arena_retire(mambo_arena *arena);
 void init_thread(dbm_thread *thread_data);
 void reset_process(dbm_thread *thread_data);
 
@@ -332,10 +548,18 @@ void sigret_dispatcher_call(dbm_thread *thread_data, ucontext_t *cont, uintptr_t
 
 void thumb_encode_stub_bb(dbm_thread *thread_data, int basic_block, uint32_t target);
 void arm_encode_stub_bb(dbm_thread *thread_data, int basic_block, uint32_t target);
+void a64_encode_stub_bb(dbm_thread *thread_data, int basic_block, uint64_t target);
+#if defined(DBM_TRACES) && defined(__aarch64__)
+void patch_trace_branches(dbm_thread *thread_data, uint32_t *orig_branch, uintptr_t tpc);
+#endif
 
 int addr_to_bb_id(dbm_thread *thread_data, uintptr_t addr);
 int addr_to_fragment_id(dbm_thread *thread_data, uintptr_t addr);
 void record_cc_link(dbm_thread *thread_data, uintptr_t linked_from, uintptr_t linked_to_addr);
+void patch_cc_links(dbm_thread *thread_data, int bb, uintptr_t tpc);
+void invalidate_fragments(dbm_thread *thread_data, uintptr_t start, uintptr_t end);
+void queue_invalidation(dbm_thread *thread_data, uintptr_t start, uintptr_t end);
+void process_pending_invalidations(dbm_thread *thread_data);
 bool is_bb(dbm_thread *thread_data, uintptr_t addr);
 void install_system_sig_handlers();
 
@@ -359,10 +583,22 @@ inline static uintptr_t adjust_cc_entry(uintptr_t addr) {
 }
 
 extern dbm_global global_data;
+
+inline static hash_table *active_entry_address(dbm_thread *thread_data) {
+#ifdef PLUGINS_NEW
+  if (thread_data->bare) {
+    return thread_data->bare_entry_address;
+  }
+#endif
+  return &thread_data->entry_address;
+}
 extern uintptr_t page_size;
 extern dbm_thread *disp_thread_data;
 extern uint32_t *th_is_pending_ptr;
 extern __thread dbm_thread *current_thread;
+#ifdef PLUGINS_NEW
+extern __thread uintptr_t mambo_thread_slots[MAX_THREAD_SLOTS];
+#endif
 
 /* API-related functions */
 #ifdef PLUGINS_NEW
@@ -378,10 +614,25 @@ void mambo_deliver_callbacks(unsigned cb_id, dbm_thread *thread_data);
 void mambo_deliver_callbacks_code(unsigned cb_id, dbm_thread *thread_data, cc_type fragment_type,
                                   int fragment_id, inst_set inst_type, int inst, mambo_cond cond,
                                   void *read_address, void *write_p, void *data_p, bool *stop);
-void _function_callback_wrapper(mambo_context *ctx, watched_func_t *func);
+void mambo_stop_helper_threads(void);
+void mambo_counters_thread_init(dbm_thread *thread_data);
+void mambo_counters_thread_exit(dbm_thread *thread_data);
+void mambo_counters_reset_process(dbm_thread *thread_data);
+void _function_callback_wrapper(mambo_context *ctx, watched_func_t *func, bool direct_call);
 int function_watch_parse_elf(watched_functions_t *self, Elf *elf, void *base_addr);
 int function_watch_add(watched_functions_t *self, char *name, int plugin_id,
-                       mambo_callback pre_callback, mambo_callback post_callback);
+                       mambo_callback pre_callback, mambo_callback post_callback, bool in_bare);
+int function_watch_add_replacement(watched_functions_t *self, char *name, int plugin_id,
+                                   void *replacement, int flags, void *orig_alias, uintptr_t *orig_addr);
+void function_watch_lock_funcs(watched_functions_t *self);
+void function_watch_unlock_funcs(watched_functions_t *self);
+void mambo_roi_marker(uintptr_t on);
+int module_filter_add_name(char *name);
+int module_filter_add_range(uintptr_t start, uintptr_t end);
+bool module_filter_allows(dbm_thread *thread_data, uintptr_t addr);
+void roi_budget_expired(dbm_thread *thread_data);
+void mambo_one_shot_probes_flushed(dbm_thread *thread_data);
+void mambo_free_one_shot_probes(dbm_thread *thread_data, bool all);
 
 #define min(a, b) (((a) < (b)) ? (a) : (b))
 #define max(a, b) (((a) > (b)) ? (a) : (b))
@@ -51,6 +51,25 @@ void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, d
   uint32_t *branch_addr;
 #endif // __arch64__
 
+#ifdef PLUGINS_NEW
+  // No fragment of this thread is running, see emit_one_shot_probe()
+  if (thread_data->one_shot_probes != NULL) {
+    mambo_free_one_shot_probes(thread_data, false);
+  }
+#endif
+
+#ifdef DBM_LINK_PLT
+  /* The source fragment linked a PLT stub to a value of its GOT entry which
+     has since changed, e.g. after lazy binding. It's retranslated with the
+     current value on its next execution. */
+  if (source_index & PLT_RELINK_SOURCE) {
+    source_index &= ~PLT_RELINK_SOURCE;
+    uintptr_t spc = (uintptr_t)thread_data->code_cache_meta[source_index].source_addr;
+    invalidate_fragments(thread_data, spc, spc + 1);
+    source_index = 0;
+  }
+#endif
+
 /* It's essential to copy exit_branch_type before calling lookup_or_scan
      because when scanning a stub basic block the source block and its
      meta-information get overwritten */
@@ -83,6 +102,13 @@ void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, d
     return;
   }
 
+#ifdef PLUGINS_NEW
+  // Don't link fragments translated in different instrumentation modes
+  if (thread_data->code_cache_meta[source_index].bare != thread_data->bare) {
+    return;
+  }
+#endif
+
 #ifdef __arm__
   dispatcher_aarch32(thread_data, source_index, source_branch_type, target, block_address);
 #endif
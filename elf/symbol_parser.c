@@ -183,23 +183,47 @@ int function_watch_search(watched_functions_t *self, char *name) {
   return 0;
 }
 
-int function_watch_add(watched_functions_t *self, char *name, int plugin_id,
-                       mambo_callback pre_callback, mambo_callback post_callback) {
-  function_watch_lock_funcs(self);
+// Must be called with funcs_lock held, returns the new entry or NULL
+static watched_func_t *function_watch_new(watched_functions_t *self, char *name, int plugin_id, int *err) {
+  if (function_watch_search(self, name) > 0) {
+    *err = -101;
+    return NULL;
+  }
+  if (self->func_count >= MAX_WATCHED_FUNCS) {
+    *err = -102;
+    return NULL;
+  }
+
+  watched_func_t *func = &self->funcs[self->func_count++];
+  func->name = name;
+  func->plugin_id = plugin_id;
+  func->pre_callback = NULL;
+  func->post_callback = NULL;
+  func->in_bare = false;
+  func->replacement = NULL;
+  func->replace_flags = 0;
+  func->orig_alias = NULL;
+  func->orig_addr = NULL;
+
+  return func;
+}
 
-  if (function_watch_search(self, name) > 0) return -101;
+int function_watch_add(watched_functions_t *self, char *name, int plugin_id,
+                       mambo_callback pre_callback, mambo_callback post_callback, bool in_bare) {
+  int err = 0;
 
-  int idx = self->func_count++;
-  if (idx >= MAX_WATCHED_FUNCS) return -102;
+  function_watch_lock_funcs(self);
 
-  self->funcs[idx].name = name;
-  self->funcs[idx].plugin_id = plugin_id;
-  self->funcs[idx].pre_callback = pre_callback;
-  self->funcs[idx].post_callback = post_callback;
+  watched_func_t *func = function_watch_new(self, name, plugin_id, &err);
+  if (func != NULL) {
+    func->pre_callback = pre_callback;
+    func->post_callback = post_callback;
+    func->in_bare = in_bare;
+  }
 
   function_watch_unlock_funcs(self);
 
-  return 0;
+  return err;
 }
 
 /* Memory barriers used in function modifying funcps because the
@@ -226,12 +250,44 @@ int function_watch_addp(watched_functions_t *self, watched_func_t *func, void *a
   asm volatile("DMB SY" ::: "memory");
   self->funcp_count++;
 
+  if (func->orig_addr != NULL && addr != func->orig_alias) {
+    *func->orig_addr = (uintptr_t)addr;
+  }
+
 ret:
   function_watch_unlock_funcps(self);
 
   return err;
 }
 
+/* Replacements apply to all the code, including bare fragments. Calls to
+   orig_alias, if set, run the original function, whose address is stored at
+   orig_addr by function_watch_addp(). Must be called with funcs_lock held, so
+   that the caller can allocate and release the alias under the same lock. On
+   failure, no replacement is registered. */
+int function_watch_add_replacement(watched_functions_t *self, char *name, int plugin_id,
+                                   void *replacement, int flags, void *orig_alias, uintptr_t *orig_addr) {
+  int err = 0;
+
+  watched_func_t *func = function_watch_new(self, name, plugin_id, &err);
+  if (func != NULL) {
+    func->in_bare = true;
+    func->replacement = replacement;
+    func->replace_flags = flags;
+    func->orig_alias = orig_alias;
+    func->orig_addr = orig_addr;
+    if (orig_alias != NULL) {
+      err = function_watch_addp(self, func, orig_alias);
+      if (err != 0) {
+        // The entry was the last one added and isn't referenced by any funcps
+        self->func_count--;
+      }
+    }
+  }
+
+  return err;
+}
+
 int function_watch_try_addp(watched_functions_t *self, char *name, void *addr) {
   function_watch_lock_funcs(self);
 
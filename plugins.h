@@ -34,3 +34,5 @@
 #include "api/helpers.h"
 #include "scanner_common.h"
 #include "api/hash_table.h"
+#include "api/trace_buf.h"
+#include "api/counters.h"
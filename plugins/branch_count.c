@@ -26,64 +26,48 @@
 #include <inttypes.h>
 #include "../plugins.h"
 
-struct br_count {
-  uint64_t direct_branch_count;
-  uint64_t indirect_branch_count;
-  uint64_t return_branch_count;
+enum {
+  DIRECT,
+  INDIRECT,
+  RETURN,
+  BR_COUNTERS,
 };
 
-struct br_count global_counters;
+char *counter_names[BR_COUNTERS] = {"direct branches", "indirect branches", "returns"};
+int counters[BR_COUNTERS];
 
-int branch_count_pre_thread_handler(mambo_context *ctx) {
-  struct br_count *counters = mambo_alloc(ctx, sizeof(struct br_count));
-  assert(counters != NULL);
-  mambo_set_thread_plugin_data(ctx, counters);
+typedef uint64_t (*get_counter_fn)(mambo_context *ctx, int counter);
 
-  counters->direct_branch_count = 0;
-  counters->indirect_branch_count = 0;
-  counters->return_branch_count = 0;
-}
-
-void print_counters(struct br_count *counters) {
-  fprintf(stderr, "  direct branches: %'" PRIu64 "\n", counters->direct_branch_count);
-  fprintf(stderr, "  indirect branches: %'" PRIu64 "\n", counters->indirect_branch_count);
-  fprintf(stderr, "  returns: %'" PRIu64 "\n", counters->return_branch_count);
+void print_counters(mambo_context *ctx, get_counter_fn get_counter) {
+  for (int i = 0; i < BR_COUNTERS; i++) {
+    fprintf(stderr, "  %s: %'" PRIu64 "\n", counter_names[i], get_counter(ctx, counters[i]));
+  }
 }
 
 int branch_count_post_thread_handler(mambo_context *ctx) {
-  struct br_count *counters = mambo_get_thread_plugin_data(ctx);
-
   fprintf(stderr, "Thread: %d\n", mambo_get_thread_id(ctx));
-  print_counters(counters);
-  atomic_increment_u64(&global_counters.direct_branch_count,
-                       counters->direct_branch_count);
-  atomic_increment_u64(&global_counters.indirect_branch_count,
-                       counters->indirect_branch_count);
-  atomic_increment_u64(&global_counters.return_branch_count,
-                       counters->return_branch_count);
-  mambo_free(ctx, counters);
+  print_counters(ctx, mambo_counter_get_thread);
 }
 
 int branch_count_exit_handler(mambo_context *ctx) {
   fprintf(stderr, "Total:\n");
-  print_counters(&global_counters);
+  print_counters(ctx, mambo_counter_get);
 }
 
 int branch_count_pre_inst_handler(mambo_context *ctx) {
-  struct br_count *counters = mambo_get_thread_plugin_data(ctx);
-  uint64_t *counter = NULL;
+  int counter = -1;
 
   mambo_branch_type type = mambo_get_branch_type(ctx);
   if (type & BRANCH_RETURN) {
-    counter = &counters->return_branch_count;
+    counter = counters[RETURN];
   } else if (type & BRANCH_DIRECT) {
-    counter = &counters->direct_branch_count;
+    counter = counters[DIRECT];
   } else if (type & BRANCH_INDIRECT) {
-    counter = &counters->indirect_branch_count;
+    counter = counters[INDIRECT];
   }
  
-  if (counter != NULL) {
-    emit_counter64_incr(ctx, counter, 1);
+  if (counter >= 0) {
+    emit_counter_incr(ctx, counter, 1);
   }
 }
 
@@ -91,8 +75,12 @@ __attribute__((constructor)) void branch_count_init_plugin() {
   mambo_context *ctx = mambo_register_plugin();
   assert(ctx != NULL);
 
+  for (int i = 0; i < BR_COUNTERS; i++) {
+    counters[i] = mambo_counter_register(ctx, counter_names[i]);
+    assert(counters[i] >= 0);
+  }
+
   mambo_register_pre_inst_cb(ctx, &branch_count_pre_inst_handler);
-  mambo_register_pre_thread_cb(ctx, &branch_count_pre_thread_handler);
   mambo_register_post_thread_cb(ctx, &branch_count_post_thread_handler);
   mambo_register_exit_cb(ctx, &branch_count_exit_handler);
   
@@ -29,78 +29,64 @@
 #include <inttypes.h>
 #include "../plugins.h"
 
-struct instructions {
-  uint64_t integer;
-  uint64_t floating;
-  uint64_t load;
-  uint64_t store;
-  uint64_t branch;
+enum {
+  INTEGER,
+  FLOATING,
+  LOAD,
+  STORE,
+  BRANCH,
 #ifdef COUNT_PRFM
-  uint64_t prefetch;
+  PREFETCH,
 #endif
+  INST_COUNTERS,
 };
 
-struct instructions global_counters = {0};
+char *counter_names[INST_COUNTERS] = {
+  "integer",
+  "floating",
+  "load",
+  "store",
+  "branch",
+#ifdef COUNT_PRFM
+  "prefetch",
+#endif
+};
+int counters[INST_COUNTERS];
 
 // Callback function prototypes
-int instruction_count_pre_thread_handler(mambo_context *ctx);
 int instruction_count_pre_inst_handler(mambo_context *ctx);
 int instruction_count_post_thread_handler(mambo_context *ctx);
 int instruction_count_exit_handler(mambo_context *ctx);
 
 // Auxiliary function to print the counters
-void print_counters(struct instructions *counters);
+typedef uint64_t (*get_counter_fn)(mambo_context *ctx, int counter);
+void print_counters(mambo_context *ctx, get_counter_fn get_counter);
 
 // Plugin registration and event callbacks function
 __attribute__((constructor)) void branch_count_init_plugin() {
   mambo_context *ctx = mambo_register_plugin();
   assert(ctx != NULL);
 
-  mambo_register_pre_thread_cb(ctx, &instruction_count_pre_thread_handler);
+  // Thread private counters, added up by MAMBO when the threads exit
+  for (int i = 0; i < INST_COUNTERS; i++) {
+    counters[i] = mambo_counter_register(ctx, counter_names[i]);
+    assert(counters[i] >= 0);
+  }
+
   mambo_register_pre_inst_cb(ctx, &instruction_count_pre_inst_handler);
   mambo_register_post_thread_cb(ctx, &instruction_count_post_thread_handler);
   mambo_register_exit_cb(ctx, &instruction_count_exit_handler);
 }
 
-int instruction_count_pre_thread_handler(mambo_context *ctx) {
-  // Thread private counters initialisation
-  struct instructions *counters = mambo_alloc(ctx, sizeof(struct instructions));
-  assert(counters != NULL);
-  mambo_set_thread_plugin_data(ctx, counters);
-
-  counters->integer = 0;
-  counters->floating = 0;
-  counters->load = 0;
-  counters->store = 0;
-  counters->branch = 0;
-#ifdef COUNT_PRFM
-  counters->prefetch = 0;
-#endif
-}
-
 int instruction_count_post_thread_handler(mambo_context *ctx) {
-  // On thread exit, the counters are added to the global counters
-  struct instructions *counters = mambo_get_thread_plugin_data(ctx);
-
   fprintf(stderr, "Thread: %d\n", mambo_get_thread_id(ctx));
 
   // Prints thread private counters
-  print_counters(counters); // comment this out if not needed
-
-  atomic_increment_u64(&global_counters.integer, counters->integer);
-  atomic_increment_u64(&global_counters.floating, counters->floating);
-  atomic_increment_u64(&global_counters.load, counters->load);
-  atomic_increment_u64(&global_counters.store, counters->store);
-  atomic_increment_u64(&global_counters.branch, counters->branch);
-#ifdef COUNT_PRFM
-  atomic_increment_u64(&global_counters.prefetch, counters->prefetch);
-#endif
-  mambo_free(ctx, counters);
+  print_counters(ctx, mambo_counter_get_thread); // comment this out if not needed
 }
 
 int instruction_count_pre_inst_handler(mambo_context *ctx) {
-  struct instructions *counters = mambo_get_thread_plugin_data(ctx);
-  uint64_t *inst_counter = NULL;
+  int inst_counter = -1;
 
 #ifdef __aarch64__
   // Variables are used for decoding the fields of intructions
@@ -117,7 +103,7 @@ int instruction_count_pre_inst_handler(mambo_context *ctx) {
   case A64_BR:
   case A64_BLR:
   case A64_RET:
-    inst_counter = &counters->branch;
+    inst_counter = BRANCH;
     break;
 
       // * Exception Generating
@@ -143,7 +129,7 @@ int instruction_count_pre_inst_handler(mambo_context *ctx) {
   case A64_ADR:
   case A64_EXTR:
   case A64_MOV_WIDE:
-    inst_counter = &counters->integer;
+    inst_counter = INTEGER;
     break;
 
   // Loads and Stores
@@ -158,12 +144,12 @@ int instruction_count_pre_inst_handler(mambo_context *ctx) {
   case A64_LDX_STX_SINGLE:
   case A64_LDX_STX_SINGLE_POST:
     if (mambo_is_load(ctx)) {
-      inst_counter = &counters->load;
+      inst_counter = LOAD;
     } else if (mambo_is_store(ctx)) {
-      inst_counter = &counters->store;
+      inst_counter = STORE;
     } else {
 #ifdef COUNT_PRFM
-      inst_counter = &counters->prefetch;
+      inst_counter = PREFETCH;
 #endif
     }
     break;
@@ -172,7 +158,7 @@ int instruction_count_pre_inst_handler(mambo_context *ctx) {
   case A64_ADD_SUB_EXT_REG:
   case A64_ADD_SUB_SHIFT_REG:
   case A64_ADC_SBC:
-    inst_counter = &counters->integer;
+    inst_counter = INTEGER;
     break;
 
   case A64_DATA_PROC_REG1:
@@ -181,13 +167,13 @@ int instruction_count_pre_inst_handler(mambo_context *ctx) {
   case A64_COND_SELECT:
   case A64_LOGICAL_REG:
   case A64_DATA_PROC_REG3:
-    inst_counter = &counters->integer;
+    inst_counter = INTEGER;
     break;
 
   case A64_DATA_PROC_REG2:
     a64_data_proc_reg2_decode_fields(ctx->code.read_address, &sf, &rm, &opcode, &rn, &rd);
     if ((opcode == 2) || (opcode == 3)) { // UDIV or SDIV
-      inst_counter = &counters->integer;
+      inst_counter = INTEGER;
     }
     break;
 
@@ -203,7 +189,7 @@ int instruction_count_pre_inst_handler(mambo_context *ctx) {
   case A64_FMOV_IMMED:
   case A64_FLOAT_CVT_FIXED:
   case A64_FLOAT_CVT_INT:
-    inst_counter = &counters->floating;
+    inst_counter = FLOATING;
     break;
 
     // *SIMD
@@ -237,26 +223,21 @@ int instruction_count_pre_inst_handler(mambo_context *ctx) {
 #else
   #error Unsupported architecture
 #endif
-  if (inst_counter != NULL) {
-    emit_counter64_incr(ctx, inst_counter, 1);
+  if (inst_counter >= 0) {
+    emit_counter_incr(ctx, counters[inst_counter], 1);
   }
 }
 
 int instruction_count_exit_handler(mambo_context *ctx) {
   // On application exit prints the global counters
   fprintf(stderr, "Total:\n");
-  print_counters(&global_counters);
+  print_counters(ctx, mambo_counter_get);
 }
 
-void print_counters(struct instructions *counters) {
+void print_counters(mambo_context *ctx, get_counter_fn get_counter) {
   // Auxiliary function to print the counters
-  fprintf(stderr, "  integer : %'" PRIu64 "\n", counters->integer);
-  fprintf(stderr, "  floating: %'" PRIu64 "\n", counters->floating);
-  fprintf(stderr, "  load    : %'" PRIu64 "\n", counters->load);
-  fprintf(stderr, "  store   : %'" PRIu64 "\n", counters->store);
-  fprintf(stderr, "  branch  : %'" PRIu64 "\n", counters->branch);
-#ifdef COUNT_PRFM
-  fprintf(stderr, "  prefetch: %'" PRIu64 "\n", counters->prefetch);
-#endif
+  for (int i = 0; i < INST_COUNTERS; i++) {
+    fprintf(stderr, "  %-8s: %'" PRIu64 "\n", counter_names[i], get_counter(ctx, counters[i]));
+  }
 }
 #endif
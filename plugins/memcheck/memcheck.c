@@ -563,14 +563,6 @@ size_t memcheck_malloc_usable_size(uintptr_t ptr) {
   return alloc_size;
 }
 
-extern void memcheck_ret();
-int memcheck_replace_malloc_usable_size(mambo_context *ctx) {
-  int ret = emit_safe_fcall(ctx, memcheck_malloc_usable_size, MAX_FCALL_ARGS);
-  assert(ret == 0);
-  ret = mambo_set_source_addr(ctx, memcheck_ret);
-  assert(ret == 0);
-}
-
 __attribute__((constructor)) void memcheck_init_plugin() {
   int ret;
 
@@ -663,7 +655,8 @@ __attribute__((constructor)) void memcheck_init_plugin() {
   ret = mambo_register_function_cb(ctx, "__malloc_arena_thread_freeres", &memcheck_inst_ignored_fn, &memcheck_inst_ignored_fn_post, 1);
   assert(ret == MAMBO_SUCCESS);
 
-  ret = mambo_register_function_cb(ctx, "malloc_usable_size", &memcheck_replace_malloc_usable_size, NULL, 1);
+  ret = mambo_replace_function(ctx, "malloc_usable_size", memcheck_malloc_usable_size,
+                               MAMBO_REPLACE_NATIVE, NULL);
   assert(ret == MAMBO_SUCCESS);
 #ifdef MC_REPLACE_FNS
   memcheck_install_naive_stdlib(ctx);
@@ -153,119 +153,49 @@ size_t memcheck_strcspn(const char *s, const char *reject) {
   return len;
 }
 
-int memcheck_replace_strlen(mambo_context *ctx) {
-  int ret = mambo_set_source_addr(ctx, memcheck_strlen);
-  assert(ret == 0);
-}
-
-int memcheck_replace_bcmp(mambo_context *ctx) {
-  int ret = mambo_set_source_addr(ctx, memcheck_bcmp);
-  assert(ret == 0);
-}
-
-int memcheck_replace_index(mambo_context *ctx) {
-  int ret = mambo_set_source_addr(ctx, memcheck_index);
-  assert(ret == 0);
-}
-
-int memcheck_replace_memchr(mambo_context *ctx) {
-  int ret = mambo_set_source_addr(ctx, memcheck_memchr);
-  assert(ret == 0);
-}
-
-int memcheck_replace_rawmemchr(mambo_context *ctx) {
-  int ret = mambo_set_source_addr(ctx, memcheck_rawmemchr);
-  assert(ret == 0);
-}
-
-int memcheck_replace_rindex(mambo_context *ctx) {
-  int ret = mambo_set_source_addr(ctx, memcheck_rindex);
-  assert(ret == 0);
-}
-
-int memcheck_replace_stpcpy(mambo_context *ctx) {
-  int ret = mambo_set_source_addr(ctx, memcheck_stpcpy);
-  assert(ret == 0);
-}
-
-int memcheck_replace_strcmp(mambo_context *ctx) {
-  int ret = mambo_set_source_addr(ctx, memcheck_strcmp);
-  assert(ret == 0);
-}
-
-int memcheck_replace_strcpy(mambo_context *ctx) {
-  int ret = mambo_set_source_addr(ctx, memcheck_strcpy);
-  assert(ret == 0);
-}
-
-int memcheck_replace_strncmp(mambo_context *ctx) {
-  int ret = mambo_set_source_addr(ctx, memcheck_strncmp);
-  assert(ret == 0);
-}
-
-int memcheck_replace_strnlen(mambo_context *ctx) {
-  int ret = mambo_set_source_addr(ctx, memcheck_strnlen);
-  assert(ret == 0);
-}
-
-int memcheck_replace_strchrnul(mambo_context *ctx) {
-  int ret = mambo_set_source_addr(ctx, memcheck_strchrnul);
-  assert(ret == 0);
-}
-
-int memcheck_replace_strspn(mambo_context *ctx) {
-  int ret = mambo_set_source_addr(ctx, memcheck_strspn);
-  assert(ret == 0);
-}
-
-int memcheck_replace_strcspn(mambo_context *ctx) {
-  int ret = mambo_set_source_addr(ctx, memcheck_strcspn);
-  assert(ret == 0);
-}
-
 void memcheck_install_naive_stdlib(mambo_context *ctx) {
   int ret;
   /* Replace the stdlib functions which use hand-optimised assembly with
      deliberate out-of-bounds accesses with naive versions*/ 
-  ret = mambo_register_function_cb(ctx, "bcmp", &memcheck_replace_bcmp, NULL, 1);
+  ret = mambo_replace_function(ctx, "bcmp", memcheck_bcmp, 0, NULL);
   assert(ret == MAMBO_SUCCESS);
 
-  ret = mambo_register_function_cb(ctx, "index", &memcheck_replace_index, NULL, 1);
+  ret = mambo_replace_function(ctx, "index", memcheck_index, 0, NULL);
   assert(ret == MAMBO_SUCCESS);
 
-  ret = mambo_register_function_cb(ctx, "memchr", &memcheck_replace_memchr, NULL, 1);
+  ret = mambo_replace_function(ctx, "memchr", memcheck_memchr, 0, NULL);
   assert(ret == MAMBO_SUCCESS);
 
-  ret = mambo_register_function_cb(ctx, "rawmemchr", &memcheck_replace_rawmemchr, NULL, 1);
+  ret = mambo_replace_function(ctx, "rawmemchr", memcheck_rawmemchr, 0, NULL);
   assert(ret == MAMBO_SUCCESS);
 
-  ret = mambo_register_function_cb(ctx, "rindex", &memcheck_replace_rindex, NULL, 1);
+  ret = mambo_replace_function(ctx, "rindex", memcheck_rindex, 0, NULL);
   assert(ret == MAMBO_SUCCESS);
 
-  ret = mambo_register_function_cb(ctx, "stpcpy", &memcheck_replace_stpcpy, NULL, 1);
+  ret = mambo_replace_function(ctx, "stpcpy", memcheck_stpcpy, 0, NULL);
   assert(ret == MAMBO_SUCCESS);
 
-  ret = mambo_register_function_cb(ctx, "strchrnul", &memcheck_replace_strchrnul, NULL, 1);
+  ret = mambo_replace_function(ctx, "strchrnul", memcheck_strchrnul, 0, NULL);
   assert(ret == MAMBO_SUCCESS);
 
-  ret = mambo_register_function_cb(ctx, "strcmp", &memcheck_replace_strcmp, NULL, 1);
+  ret = mambo_replace_function(ctx, "strcmp", memcheck_strcmp, 0, NULL);
   assert(ret == MAMBO_SUCCESS);
 
-  ret = mambo_register_function_cb(ctx, "strcpy", &memcheck_replace_strcpy, NULL, 1);
+  ret = mambo_replace_function(ctx, "strcpy", memcheck_strcpy, 0, NULL);
   assert(ret == MAMBO_SUCCESS);
 
-  ret = mambo_register_function_cb(ctx, "strlen", &memcheck_replace_strlen, NULL, 1);
+  ret = mambo_replace_function(ctx, "strlen", memcheck_strlen, 0, NULL);
   assert(ret == MAMBO_SUCCESS);
 
-  ret = mambo_register_function_cb(ctx, "strncmp", &memcheck_replace_strncmp, NULL, 1);
+  ret = mambo_replace_function(ctx, "strncmp", memcheck_strncmp, 0, NULL);
   assert(ret == MAMBO_SUCCESS);
 
-  ret = mambo_register_function_cb(ctx, "strnlen", &memcheck_replace_strnlen, NULL, 1);
+  ret = mambo_replace_function(ctx, "strnlen", memcheck_strnlen, 0, NULL);
   assert(ret == MAMBO_SUCCESS);
 
-  ret = mambo_register_function_cb(ctx, "strspn", &memcheck_replace_strspn, NULL, 1);
+  ret = mambo_replace_function(ctx, "strspn", memcheck_strspn, 0, NULL);
   assert(ret == MAMBO_SUCCESS);
 
-  ret = mambo_register_function_cb(ctx, "strcspn", &memcheck_replace_strcspn, NULL, 1);
+  ret = mambo_replace_function(ctx, "strcspn", memcheck_strcspn, 0, NULL);
   assert(ret == MAMBO_SUCCESS);
 }
@@ -86,6 +86,17 @@ void a64_tbnz_helper(uint32_t *write_p, uint64_t target, enum reg reg, uint32_t
 void a64_cc_branch(dbm_thread *thread_data, uint32_t *write_p, uint64_t target);
 void a64_inline_hash_lookup(dbm_thread *thread_data, int basic_block, uint32_t **o_write_p,
                             uint32_t *read_address, enum reg rn, bool link, bool set_meta);
+#ifdef PLUGINS_NEW
+typedef enum {
+  A64_ORIGIN_UNKNOWN,
+  A64_ORIGIN_SP,
+  A64_ORIGIN_TPIDR,
+  A64_ORIGIN_CONST,
+} a64_reg_origin;
+
+a64_reg_origin a64_trace_reg_origin(dbm_thread *thread_data, uint32_t *read_address,
+                                    enum reg reg, uintptr_t *value);
+#endif
 #endif
 
 extern void inline_hash_lookup();
@@ -76,17 +76,37 @@ int deliver_signals(uintptr_t spc, self_signal *s) {
     thread_abort(current_thread);
   }
 
+  // A signal received after this point sets the flag again
+  current_thread->signal_poll = 0;
+
   int ret = syscall(__NR_rt_sigprocmask, 0, NULL, &sigmask, sizeof(sigmask));
   assert (ret == 0);
 
-  for (int i = 0; i < _NSIG; i++) {
-    if ((sigmask & (1 << i)) == 0
-        && atomic_decrement_if_positive_i32(&current_thread->pending_signals[i], 1) >= 0) {
-      s->pid = syscall(__NR_getpid);
-      s->tid = syscall(__NR_gettid);
-      s->signo = i;
-      atomic_increment_u32(&current_thread->is_signal_pending, -1);
-      return 1;
+  /* Only visit the signals which have their bit set in the pending map. A bit is
+     cleared once the counter is found to be zero, then the counter is checked again
+     in case the signal was received in between. */
+  for (int w = 0; w < PENDING_SIGNALS_MAP_WORDS; w++) {
+    uint32_t map = current_thread->pending_signals_map[w];
+    while (map != 0) {
+      int bit = __builtin_ctz(map);
+      int i = w * 32 + bit;
+      map &= ~(1U << bit);
+
+      // the kernel's signal mask uses bit (signo - 1) for each signal
+      if (i == 0 || (sigmask & (1ULL << (i - 1))) != 0) continue;
+
+      if (atomic_decrement_if_positive_i32(&current_thread->pending_signals[i], 1) >= 0) {
+        s->pid = syscall(__NR_getpid);
+        s->tid = syscall(__NR_gettid);
+        s->signo = i;
+        atomic_increment_u32(&current_thread->is_signal_pending, -1);
+        return 1;
+      }
+
+      atomic_and_u32(&current_thread->pending_signals_map[w], ~(1U << bit));
+      if (current_thread->pending_signals[i] > 0) {
+        atomic_or_u32(&current_thread->pending_signals_map[w], 1U << bit);
+      }
     }
   }
 
@@ -145,6 +165,56 @@ bool unlink_indirect_branch(dbm_code_cache_meta *bb_meta, void **o_write_p) {
   return true;
 }
 
+#ifdef DBM_LINK_PLT
+/* A linked PLT stub branches directly to the translation of the GOT value,
+   bypassing the indirect branch of the inline hash lookup. Its hit path is
+   redirected to the inline hash lookup, which is unlinked as usual. On A64 the
+   B is replaced, on A32 the POP {R4-R6} is replaced by a branch over the B,
+   leaving the target in R5 for the inline hash lookup */
+void unlink_fragment(int fragment_id, uintptr_t pc);
+
+void unlink_plt_link(int fragment_id, uintptr_t pc) {
+  if (fragment_id >= CODE_CACHE_SIZE) return;
+
+  dbm_code_cache_meta_cold *cold_meta = &current_thread->code_cache_meta_cold[fragment_id];
+  uint32_t *write_p = cold_meta->plt_link_addr;
+  if (write_p == NULL || cold_meta->plt_link_saved != 0) return;
+
+#ifdef __arm__
+  // The POP has already executed, unlink the fragment the B jumps to
+  if (pc == (uintptr_t)(write_p + 1)) {
+    uint32_t offset;
+    arm_b_decode_fields(write_p + 1, &offset);
+    uint32_t branch_offset = (offset & 0x800000) ? 0xFC000000 : 0;
+    branch_offset |= (offset << 2);
+    uintptr_t target = (uintptr_t)(write_p + 1) + 8 + branch_offset;
+    unlink_fragment(addr_to_fragment_id(current_thread, target), target);
+    return;
+  }
+#endif
+
+  cold_meta->plt_link_saved = *write_p;
+#ifdef __arm__
+  arm_b32_helper(write_p, (uint32_t)(write_p + 2), AL);
+#elif __aarch64__
+  a64_b_helper(write_p, (uint64_t)current_thread->code_cache_meta[fragment_id].exit_branch_addr);
+#endif
+  __clear_cache(write_p, write_p + 1);
+}
+
+void restore_plt_link(dbm_thread *thread_data, int fragment_id) {
+  if (fragment_id >= CODE_CACHE_SIZE) return;
+
+  dbm_code_cache_meta_cold *cold_meta = &thread_data->code_cache_meta_cold[fragment_id];
+  uint32_t *write_p = cold_meta->plt_link_addr;
+  if (write_p == NULL || cold_meta->plt_link_saved == 0) return;
+
+  *write_p = cold_meta->plt_link_saved;
+  cold_meta->plt_link_saved = 0;
+  __clear_cache(write_p, write_p + 1);
+}
+#endif
+
 int get_direct_branch_exit_trap_sz(dbm_code_cache_meta *bb_meta, int fragment_id) {
   int sz;
   switch(bb_meta->exit_branch_type) {
@@ -203,7 +273,7 @@ bool unlink_direct_branch(dbm_code_cache_meta *bb_meta, void **o_write_p, int fr
       if (inst == TRAP_INST_TYPE) {
         return false;
       }
-      memcpy(&bb_meta->saved_exit, write_p, offset);
+      memcpy(&current_thread->code_cache_meta_cold[fragment_id].saved_exit, write_p, offset);
       for (int i = 0; i < offset; i += inst_size(TRAP_INST_TYPE, is_thumb)) {
         write_trap(SIGNAL_TRAP_DB);
       }
@@ -271,6 +341,9 @@ void unlink_fragment(int fragment_id, uintptr_t pc) {
     if (!unlink_indirect_branch(bb_meta, &write_p)) {
       return;
     }
+#ifdef DBM_LINK_PLT
+    unlink_plt_link(fragment_id, pc);
+#endif
   } else if (bb_meta->branch_cache_status != 0) {
     if (!unlink_direct_branch(bb_meta, &write_p, fragment_id, pc)) {
       return;
@@ -438,7 +511,7 @@ void restore_exit(dbm_thread *thread_data, int fragment_id, void **o_write_p) {
   dbm_code_cache_meta *bb_meta = &thread_data->code_cache_meta[fragment_id];
 
   int restore_sz = get_direct_branch_exit_trap_sz(bb_meta, fragment_id);
-  memcpy(write_p, &bb_meta->saved_exit, restore_sz);
+  memcpy(write_p, &thread_data->code_cache_meta_cold[fragment_id].saved_exit, restore_sz);
   write_p += restore_sz;
 
   *o_write_p = write_p;
@@ -560,6 +633,9 @@ uintptr_t signal_dispatcher(int i, siginfo_t *info, void *context) {
 #endif
         if (imm == SIGNAL_TRAP_IB) {
           restore_ihl_inst(pc);
+#ifdef DBM_LINK_PLT
+          restore_plt_link(current_thread, fragment_id);
+#endif
 
           int rn = current_thread->code_cache_meta[fragment_id].rn;
           uintptr_t target;
@@ -623,7 +699,12 @@ uintptr_t signal_dispatcher(int i, siginfo_t *info, void *context) {
         }
       } // i == UNLINK_SIGNAL
     } // if (pc >= (uintptr_t)bb_meta->exit_branch_addr)
-    unlink_fragment(fragment_id, pc);
+    /* With polling, the next basic block or trace entry returns to the
+       dispatcher. Trace fragments aren't checked and a trace can loop back to
+       itself without passing its entry, so they are still unlinked */
+    if (!global_data.poll_signals || fragment_id >= CODE_CACHE_SIZE) {
+      unlink_fragment(fragment_id, pc);
+    }
   }
 
   /* Call the handlers of synchronous signals immediately
@@ -660,7 +741,9 @@ uintptr_t signal_dispatcher(int i, siginfo_t *info, void *context) {
   }
 
   atomic_increment_int(&current_thread->pending_signals[i], 1);
+  atomic_or_u32(&current_thread->pending_signals_map[i / 32], 1U << (i % 32));
   atomic_increment_u32(&current_thread->is_signal_pending, 1);
+  current_thread->signal_poll = 1;
 
   return handler;
 }
@@ -0,0 +1,40 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Copyright 2017-2020 The University of Manchester
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include <stdio.h>
+#include <assert.h>
+
+#include "counters.h"
+
+void counted_roi(void);
+int counted_filtered(void);
+
+int main() {
+  asm volatile("hint #0x7e"); // ROI start
+  for (int i = 0; i < COUNTERS_ITERATIONS; i++) {
+    counted_roi();
+    int ret = counted_filtered();
+    assert(ret == 0);
+  }
+  asm volatile("hint #0x7f"); // ROI stop
+
+  printf("counters: done\n");
+
+  return 0;
+}
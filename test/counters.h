@@ -0,0 +1,32 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Copyright 2017-2020 The University of Manchester
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Shared by the counters test application and its plugin. The counted code is
+  placed at a fixed address, so that the plugin can restrict the module filter
+  to the first COUNTERS_ALLOWED_SZ bytes of it.
+*/
+#define COUNTERS_TEXT_ADDR 0x10000000
+#define COUNTERS_ALLOWED_SZ 64
+#define COUNTERS_ITERATIONS 1000
+
+// HINT #0x40, executes as a NOP. The plugin counts it in PRE_INST and POST_INST
+#define COUNTED_HINT_INST 0xD503281F
+// One execution in each of counted_roi and counted_filtered, counted twice
+#define COUNTED_PER_ITERATION 4
@@ -0,0 +1,78 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Copyright 2017-2020 The University of Manchester
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Plugin for the counters test, build MAMBO with:
+    make PLUGINS=test/counters_plugin.c
+  and run test/counters. The total of a coalesced counter is checked at exit,
+  and the application checks the registers spilled by the instrumentation.
+*/
+
+#ifdef PLUGINS_NEW
+
+#include <stdio.h>
+#include <assert.h>
+#include "../plugins.h"
+#include "counters.h"
+
+int counted;
+
+int counters_inst_handler(mambo_context *ctx) {
+  if (mambo_get_inst(ctx) == A64_HINT
+      && *(uint32_t *)mambo_get_source_addr(ctx) == COUNTED_HINT_INST) {
+    int ret = emit_counter_incr(ctx, counted, 1);
+    assert(ret == 0);
+
+    // The pop is left pending, see emit_a64_flush_spills()
+    emit_push(ctx, (1 << x0) | (1 << x1));
+    emit_set_reg(ctx, x0, 0xdead);
+    emit_set_reg(ctx, x1, 0xdead);
+    emit_pop(ctx, (1 << x0) | (1 << x1));
+  }
+  return 0;
+}
+
+int counters_exit_handler(mambo_context *ctx) {
+  unsigned long long count = mambo_counter_get(ctx, counted);
+  unsigned long long expected = COUNTERS_ITERATIONS * COUNTED_PER_ITERATION;
+
+  fprintf(stderr, "counters: %llu increments, expected %llu\n", count, expected);
+  assert(count == expected);
+
+  return 0;
+}
+
+__attribute__((constructor)) void counters_init_plugin() {
+  mambo_context *ctx = mambo_register_plugin();
+  assert(ctx != NULL);
+
+  counted = mambo_counter_register(ctx, "counted");
+  assert(counted >= 0);
+
+  int ret = mambo_set_roi_markers(ctx);
+  assert(ret == MAMBO_SUCCESS);
+  ret = mambo_filter_range(ctx, (void *)COUNTERS_TEXT_ADDR,
+                           (void *)(COUNTERS_TEXT_ADDR + COUNTERS_ALLOWED_SZ));
+  assert(ret == 0);
+
+  mambo_register_pre_inst_cb(ctx, &counters_inst_handler);
+  mambo_register_post_inst_cb(ctx, &counters_inst_handler);
+  mambo_register_exit_cb(ctx, &counters_exit_handler);
+}
+#endif
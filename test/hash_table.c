@@ -0,0 +1,131 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Copyright 2017-2020 The University of Manchester
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Concurrent mambo_ht_t test: the writers add and delete disjoint ranges of
+  keys while the table grows from a few entries, and the lock-free readers
+  look up keys from all the ranges. A lookup must never return the value of
+  another key, e.g. from a reused deleted slot or from a partially published
+  resize.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "../api/hash_table.h"
+
+#define WRITERS 4
+#define READERS 4
+#define KEYS_PER_WRITER 8192
+#define ROUNDS 4
+
+mambo_ht_t ht;
+volatile int writers_done = 0;
+
+static uintptr_t key_of(int writer, int i) {
+  return ((uintptr_t)writer * KEYS_PER_WRITER + i + 1) << 4;
+}
+
+static uintptr_t value_of(uintptr_t key) {
+  return key * 3 + 1;
+}
+
+void *writer(void *arg) {
+  int id = (int)(uintptr_t)arg;
+  uintptr_t value;
+  int ret;
+
+  for (int round = 0; round < ROUNDS; round++) {
+    for (int i = 0; i < KEYS_PER_WRITER; i++) {
+      ret = mambo_ht_add(&ht, key_of(id, i), value_of(key_of(id, i)));
+      assert(ret == 0);
+    }
+    for (int i = 0; i < KEYS_PER_WRITER; i++) {
+      ret = mambo_ht_get(&ht, key_of(id, i), &value);
+      assert(ret == 0 && value == value_of(key_of(id, i)));
+    }
+    // Delete the odd keys, their slots get reused by the next round
+    for (int i = 1; i < KEYS_PER_WRITER; i += 2) {
+      ret = mambo_ht_delete(&ht, key_of(id, i));
+      assert(ret == 0);
+    }
+  }
+
+  return NULL;
+}
+
+void *reader(void *arg) {
+  unsigned int seed = (unsigned int)(uintptr_t)arg;
+  uintptr_t value;
+
+  while (!__atomic_load_n(&writers_done, __ATOMIC_ACQUIRE)) {
+    uintptr_t key = key_of(rand_r(&seed) % WRITERS, rand_r(&seed) % KEYS_PER_WRITER);
+    if (mambo_ht_get(&ht, key, &value) == 0) {
+      assert(value == value_of(key));
+    }
+  }
+
+  return NULL;
+}
+
+int main() {
+  pthread_t writers[WRITERS];
+  pthread_t readers[READERS];
+  uintptr_t value;
+  int ret;
+
+  ret = mambo_ht_init(&ht, 16, 4, 70, true);
+  assert(ret == 0);
+
+  for (int i = 0; i < READERS; i++) {
+    ret = pthread_create(&readers[i], NULL, reader, (void *)(uintptr_t)(i + 1));
+    assert(ret == 0);
+  }
+  for (int i = 0; i < WRITERS; i++) {
+    ret = pthread_create(&writers[i], NULL, writer, (void *)(uintptr_t)i);
+    assert(ret == 0);
+  }
+
+  for (int i = 0; i < WRITERS; i++) {
+    pthread_join(writers[i], NULL);
+  }
+  __atomic_store_n(&writers_done, 1, __ATOMIC_RELEASE);
+  for (int i = 0; i < READERS; i++) {
+    pthread_join(readers[i], NULL);
+  }
+
+  for (int w = 0; w < WRITERS; w++) {
+    for (int i = 0; i < KEYS_PER_WRITER; i++) {
+      ret = mambo_ht_get(&ht, key_of(w, i), &value);
+      if (i & 1) {
+        assert(ret != 0);
+      } else {
+        assert(ret == 0 && value == value_of(key_of(w, i)));
+      }
+    }
+  }
+
+  mambo_ht_destroy(&ht);
+  printf("hash_table: OK\n");
+
+  return 0;
+}
@@ -0,0 +1,40 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Copyright 2017-2020 The University of Manchester
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include <stdio.h>
+
+void ld_st_stack(void);
+void ld_st_tls(void);
+void ld_st_read_only(void);
+void ld_st_tls_clobbered(void);
+void ld_st_read_only_clobbered(void);
+void ld_st_writeback(void);
+
+int main() {
+  ld_st_stack();
+  ld_st_tls();
+  ld_st_read_only();
+  ld_st_tls_clobbered();
+  ld_st_read_only_clobbered();
+  ld_st_writeback();
+
+  printf("ld_st_class: done\n");
+
+  return 0;
+}
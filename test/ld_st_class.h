@@ -0,0 +1,36 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Copyright 2017-2020 The University of Manchester
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Shared by the ld_st_class test application and its plugin. Each classified
+  load or store is immediately preceded by HINT #(LD_ST_CLASS_MARKER + case),
+  which executes as a NOP, and the plugin checks the result of
+  mambo_classify_ld_st() against the expected class of the case.
+*/
+#define LD_ST_CLASS_MARKER 0x50
+
+#define CASE_STACK               0
+#define CASE_TLS                 1
+#define CASE_READ_ONLY           2
+// The base register is overwritten by an instruction moving from a FP/SIMD register
+#define CASE_TLS_CLOBBERED       3
+#define CASE_READ_ONLY_CLOBBERED 4
+// The base register is overwritten by a load with writeback
+#define CASE_WRITEBACK           5
+#define LD_ST_CLASS_CASES        6
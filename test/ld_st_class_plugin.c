@@ -0,0 +1,83 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Copyright 2017-2020 The University of Manchester
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Plugin for the ld_st_class test, build MAMBO with:
+    make PLUGINS=test/ld_st_class_plugin.c
+  and run test/ld_st_class. Each marked load or store is checked when it's
+  scanned, and all the cases must have been checked at exit.
+*/
+
+#ifdef PLUGINS_NEW
+
+#include <stdio.h>
+#include <assert.h>
+#include "../plugins.h"
+#include "ld_st_class.h"
+
+static const mambo_ld_st_class expected[LD_ST_CLASS_CASES] = {
+  [CASE_STACK] = LD_ST_STACK,
+  [CASE_TLS] = LD_ST_TLS,
+  [CASE_READ_ONLY] = LD_ST_READ_ONLY,
+  [CASE_TLS_CLOBBERED] = 0,
+  [CASE_READ_ONLY_CLOBBERED] = 0,
+  [CASE_WRITEBACK] = 0,
+};
+
+// The application is single-threaded
+int next_case = -1;
+uint32_t checked_cases = 0;
+
+int ld_st_class_inst_handler(mambo_context *ctx) {
+  uint32_t inst = *(uint32_t *)mambo_get_source_addr(ctx);
+
+  if (next_case >= 0 && mambo_is_load_or_store(ctx)) {
+    mambo_ld_st_class cls = mambo_classify_ld_st(ctx);
+    if (cls != expected[next_case]) {
+      fprintf(stderr, "ld_st_class: case %d classified as 0x%x, expected 0x%x\n",
+              next_case, cls, expected[next_case]);
+    }
+    assert(cls == expected[next_case]);
+    checked_cases |= 1 << next_case;
+  }
+
+  next_case = -1;
+  if (mambo_get_inst(ctx) == A64_HINT) {
+    int imm = (inst >> 5) & 0x7F;
+    if (imm >= LD_ST_CLASS_MARKER && imm < (LD_ST_CLASS_MARKER + LD_ST_CLASS_CASES)) {
+      next_case = imm - LD_ST_CLASS_MARKER;
+    }
+  }
+  return 0;
+}
+
+int ld_st_class_exit_handler(mambo_context *ctx) {
+  assert(checked_cases == (1 << LD_ST_CLASS_CASES) - 1);
+  fprintf(stderr, "ld_st_class: %d cases checked\n", LD_ST_CLASS_CASES);
+  return 0;
+}
+
+__attribute__((constructor)) void ld_st_class_init_plugin() {
+  mambo_context *ctx = mambo_register_plugin();
+  assert(ctx != NULL);
+
+  mambo_register_pre_inst_cb(ctx, &ld_st_class_inst_handler);
+  mambo_register_exit_cb(ctx, &ld_st_class_exit_handler);
+}
+#endif
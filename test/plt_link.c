@@ -0,0 +1,47 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Copyright 2017-2020 The University of Manchester
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Calls through PLT stubs with lazy binding. The first call to each function
+  goes through the resolver, which updates the GOT entry that the stub was
+  linked with when it was first translated.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define ITERATIONS 100000
+
+int main() {
+  char buf[32];
+  long sum = 0;
+
+  for (int i = 0; i < ITERATIONS; i++) {
+    snprintf(buf, sizeof(buf), "%d", i);
+    assert(strlen(buf) > 0);
+    sum += strtol(buf, NULL, 10);
+  }
+  assert(sum == ((long)ITERATIONS * (ITERATIONS - 1)) / 2);
+
+  printf("plt_link: OK\n");
+
+  return 0;
+}
@@ -18,6 +18,7 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <signal.h>
 #include <assert.h>
 #include <unistd.h>
@@ -75,6 +76,19 @@ void handle_sync(int i, siginfo_t *info, void *ptr) {
   #error Unknown architecture
 #endif
 
+/* Calls strtol() through its PLT stub until all the signals sent by
+   signal_parent() are handled, without any system calls in the loop */
+void test_plt_loop() {
+  char buf[] = "1";
+  long sum = 0;
+
+  count = 0;
+  while (count < SIGNAL_CNT) {
+    sum += strtol(buf, NULL, 10);
+  }
+  assert(sum > 0);
+}
+
 // Fill the CC
 #define JUNK_CODE_SIZE (8*1024*1024)
 void fill_cc() {
@@ -228,6 +242,13 @@ int main (int argc, char **argv) {
   printf("success\n");
 #endif
 
+  printf("Test signal handling in loops calling through the PLT: ");
+  fflush(stdout);
+  pthread_create(&thread, NULL, signal_parent, &tid);
+  test_plt_loop();
+  pthread_join(thread, NULL);
+  printf("success\n");
+
   printf("Test handling of a synchronous SIGTRAP signal: ");
   fflush(stdout);
   act.sa_sigaction = handle_sync;
@@ -244,38 +244,13 @@ void patch_trace_branches(dbm_thread *thread_data, uint32_t *orig_branch, uintpt
 #endif
 
 void install_trace(dbm_thread *thread_data) {
-  ll_entry *cc_link;
-  uintptr_t orig_branch;
   int bb_source = thread_data->active_trace.source_bb;
   uintptr_t spc = (uintptr_t)thread_data->code_cache_meta[bb_source].source_addr;
   uintptr_t tpc = thread_data->active_trace.entry_addr;
-  uintptr_t tpc_direct = adjust_cc_entry(tpc);
   assert(thread_data->active_trace.active);
   thread_data->active_trace.active = false;
 
-  cc_link = thread_data->code_cache_meta[bb_source].linked_from;
-  while(cc_link != NULL) {
-    debug("Link from: 0x%lx, update to: 0x%lx\n", cc_link->data, tpc);
-    orig_branch = cc_link->data;
-#ifdef __arm__
-    orig_branch &= 0xFFFFFFFE;
-    if (cc_link->data & THUMB) {
-      thumb_adjust_b_bl_target(thread_data, (uint16_t *)orig_branch, tpc_direct);
-    } else if ((cc_link->data & 3) == FULLADDR) {
-      *(uint32_t *)(orig_branch & (~FULLADDR)) = tpc_direct;
-    } else {
-      arm_adjust_b_bl_target((uintptr_t *)orig_branch, tpc_direct);
-    }
-#elif __aarch64__
-    if (orig_branch >= (uintptr_t)thread_data->code_cache->traces) {
-      patch_trace_branches(thread_data, (uint32_t *)orig_branch, tpc + 4);
-    } else {
-      a64_b_helper((uint32_t *)orig_branch, tpc + 4);
-    }
-#endif
-    cc_link = cc_link->next;
-    __clear_cache((void *)orig_branch, (void *)orig_branch + 4);
-  }
+  patch_cc_links(thread_data, bb_source, tpc);
 
   hash_add(&thread_data->entry_address, spc, tpc);
 
@@ -467,7 +442,8 @@ void set_up_trace_exit(dbm_thread *thread_data, uint32_t **o_write_p, int fragme
 #endif
 #endif
 
-/* This is called from trace_head_incr, which is called by trace heads */
+/* This is called from trace_head_incr on AArch32 and from the inline
+   trace head counters on AArch64 */
 int hot_bb_cnt = 0;
 void create_trace(dbm_thread *thread_data, uint32_t bb_source, cc_addr_pair *ret_addr) {
 #ifdef DBM_TRACES
@@ -25,6 +25,8 @@ extern void dbm_client_entry(uintptr_t addr, uintptr_t *stack_top);
 extern uint32_t atomic_increment_u32(uint32_t *loc, uint32_t inc);
 extern uint64_t atomic_increment_u64(uint64_t *loc, uint64_t inc);
 extern int32_t atomic_decrement_if_positive_i32(int32_t *loc, int32_t inc);
+extern uint32_t atomic_or_u32(uint32_t *loc, uint32_t val);
+extern uint32_t atomic_and_u32(uint32_t *loc, uint32_t val);
 
 static inline int32_t atomic_increment_i32(int32_t *loc, int32_t inc) {
   return (int32_t)atomic_increment_u32((uint32_t *)loc, (uint32_t)inc);